@@ -0,0 +1,282 @@
+/* SW RAID5 - file backends
+ *
+ * Disks stored in regular files (disk images) or block devices, in three variants:
+ *
+ *   TFileMode::PREAD   positional pread/pwrite, no stdio buffering and safe to call from many threads
+ *   TFileMode::DIRECT  O_DIRECT, the page cache is bypassed; unaligned buffers go through an aligned bounce buffer
+ *   TFileMode::MMAP    memcpy against a shared mapping of the whole disk; flushFileDisks () writes it back
+ *
+ * TBlkDev carries plain function pointers only, so a single set of file disks is open at a time. The writes
+ * of the buffered variants (PREAD, MMAP) are durable once flushFileDisks () returns; call it after the
+ * volume is stopped.
+ */
+#include <string>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum class TFileMode
+{
+  PREAD,
+  DIRECT,
+  MMAP
+};
+
+/* O_DIRECT transfers need the buffer, the offset and the length aligned to the logical block size */
+constexpr size_t                       DIRECT_ALIGNMENT                        = 4096;
+
+struct TFileDisk
+{
+  int                                    m_Fd = -1;
+  char                                 * m_Mapping = nullptr;
+};
+
+static std::vector<TFileDisk>          g_FileDisks;
+static int                             g_FileSectors = 0;
+
+//-------------------------------------------------------------------------------------------------
+bool                                   fileRangeValid                          ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 int                                   sectorCnt )
+{
+  return device >= 0 && device < (int) g_FileDisks . size () && sectorCnt > 0 && sectorNr >= 0
+         && sectorNr + sectorCnt <= g_FileSectors;
+}
+//-------------------------------------------------------------------------------------------------
+/** Transfers the whole range, pread/pwrite may stop early; returns the count of complete sectors.
+ */
+int                                    fileTransfer                            ( int                                   fd,
+                                                                                 int                                   sectorNr,
+                                                                                 char                                * data,
+                                                                                 int                                   sectorCnt,
+                                                                                 bool                                  write )
+{
+  size_t     length = (size_t) sectorCnt * SECTOR_SIZE, done = 0;
+  off_t      offset = (off_t) sectorNr * SECTOR_SIZE;
+
+  while ( done < length )
+  {
+    ssize_t  res = write ? pwrite ( fd, data + done, length - done, offset + done )
+                         : pread ( fd, data + done, length - done, offset + done );
+    if ( res < 0 && errno == EINTR )
+      continue;
+    if ( res <= 0 )
+      break;
+    done += res;
+  }
+  return (int) ( done / SECTOR_SIZE );
+}
+//-------------------------------------------------------------------------------------------------
+int                                    filePread                               ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 void                                * data,
+                                                                                 int                                   sectorCnt )
+{
+  if ( ! fileRangeValid ( device, sectorNr, sectorCnt ) )
+    return 0;
+  return fileTransfer ( g_FileDisks[device] . m_Fd, sectorNr, (char *) data, sectorCnt, false );
+}
+//-------------------------------------------------------------------------------------------------
+int                                    filePwrite                              ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 const void                          * data,
+                                                                                 int                                   sectorCnt )
+{
+  if ( ! fileRangeValid ( device, sectorNr, sectorCnt ) )
+    return 0;
+  return fileTransfer ( g_FileDisks[device] . m_Fd, sectorNr, (char *) data, sectorCnt, true );
+}
+//-------------------------------------------------------------------------------------------------
+/** O_DIRECT transfer; a buffer not aligned for the device is bounced through a per-thread aligned buffer.
+ */
+int                                    fileDirectTransfer                      ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 char                                * data,
+                                                                                 int                                   sectorCnt,
+                                                                                 bool                                  write )
+{
+  struct TBounce
+  {
+    char                               * m_Data = nullptr;
+    size_t                               m_Size = 0;
+    ~TBounce () { free ( m_Data ); }
+  };
+  static thread_local TBounce bounce;
+
+  if ( ! fileRangeValid ( device, sectorNr, sectorCnt ) )
+    return 0;
+  size_t     length = (size_t) sectorCnt * SECTOR_SIZE;
+  if ( (uintptr_t) data % DIRECT_ALIGNMENT == 0 )
+    return fileTransfer ( g_FileDisks[device] . m_Fd, sectorNr, data, sectorCnt, write );
+
+  if ( bounce . m_Size < length )
+  {
+    size_t   size = ( length + DIRECT_ALIGNMENT - 1 ) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+    char   * buffer = (char *) aligned_alloc ( DIRECT_ALIGNMENT, size );
+    if ( ! buffer )
+      return 0;
+    free ( bounce . m_Data );
+    bounce . m_Data = buffer;
+    bounce . m_Size = size;
+  }
+  if ( write )
+    memcpy ( bounce . m_Data, data, length );
+  int        res = fileTransfer ( g_FileDisks[device] . m_Fd, sectorNr, bounce . m_Data, sectorCnt, write );
+  if ( ! write )
+    memcpy ( data, bounce . m_Data, (size_t) res * SECTOR_SIZE );
+  return res;
+}
+//-------------------------------------------------------------------------------------------------
+int                                    fileDirectRead                          ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 void                                * data,
+                                                                                 int                                   sectorCnt )
+{
+  return fileDirectTransfer ( device, sectorNr, (char *) data, sectorCnt, false );
+}
+//-------------------------------------------------------------------------------------------------
+int                                    fileDirectWrite                         ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 const void                          * data,
+                                                                                 int                                   sectorCnt )
+{
+  return fileDirectTransfer ( device, sectorNr, (char *) data, sectorCnt, true );
+}
+//-------------------------------------------------------------------------------------------------
+int                                    fileMapRead                             ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 void                                * data,
+                                                                                 int                                   sectorCnt )
+{
+  if ( ! fileRangeValid ( device, sectorNr, sectorCnt ) )
+    return 0;
+  memcpy ( data, g_FileDisks[device] . m_Mapping + (size_t) sectorNr * SECTOR_SIZE, (size_t) sectorCnt * SECTOR_SIZE );
+  return sectorCnt;
+}
+//-------------------------------------------------------------------------------------------------
+int                                    fileMapWrite                            ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 const void                          * data,
+                                                                                 int                                   sectorCnt )
+{
+  if ( ! fileRangeValid ( device, sectorNr, sectorCnt ) )
+    return 0;
+  memcpy ( g_FileDisks[device] . m_Mapping + (size_t) sectorNr * SECTOR_SIZE, data, (size_t) sectorCnt * SECTOR_SIZE );
+  return sectorCnt;
+}
+//-------------------------------------------------------------------------------------------------
+/** Writes the buffered data of all the open disks back to the storage (msync / fdatasync).
+ */
+bool                                   flushFileDisks                          ()
+{
+  bool       ok = true;
+
+  for ( const auto & disk : g_FileDisks )
+    if ( disk . m_Mapping )
+      ok &= msync ( disk . m_Mapping, (size_t) g_FileSectors * SECTOR_SIZE, MS_SYNC ) == 0;
+    else
+      ok &= fdatasync ( disk . m_Fd ) == 0;
+  return ok;
+}
+//-------------------------------------------------------------------------------------------------
+/** Releases the disks opened by createFileDisks/openFileDisks, nothing is flushed.
+ */
+void                                   closeFileDisks                          ()
+{
+  for ( auto & disk : g_FileDisks )
+  {
+    if ( disk . m_Mapping )
+      munmap ( disk . m_Mapping, (size_t) g_FileSectors * SECTOR_SIZE );
+    if ( disk . m_Fd >= 0 )
+      close ( disk . m_Fd );
+  }
+  g_FileDisks . clear ();
+  g_FileSectors = 0;
+}
+//-------------------------------------------------------------------------------------------------
+/** Opens the disks (creating and sizing regular files when asked to) and returns the backend of the mode.
+ * sectors == 0 opens existing disks with the size of the smallest of them.
+ */
+TBlkDev                                openFileDisksMode                       ( const std::vector<std::string>      & paths,
+                                                                                 int                                   sectors,
+                                                                                 TFileMode                             mode,
+                                                                                 bool                                  create )
+{
+  TBlkDev    res;
+
+  closeFileDisks ();
+  if ( paths . empty () || paths . size () > MAX_RAID_DEVICES || sectors < 0 )
+    throw std::runtime_error ( "Raw storage parameters error" );
+  g_FileSectors = sectors;
+  for ( const auto & path : paths )
+  {
+    int      flags = O_RDWR | O_CLOEXEC | ( create ? O_CREAT : 0 ) | ( mode == TFileMode::DIRECT ? O_DIRECT : 0 );
+    g_FileDisks . push_back ( TFileDisk () );
+    TFileDisk & disk = g_FileDisks . back ();
+    disk . m_Fd = ::open ( path . c_str (), flags, 0644 );
+    if ( disk . m_Fd < 0 )
+    {
+      closeFileDisks ();
+      throw std::runtime_error ( "Raw storage access error" );
+    }
+
+    /* new images get their size without writing a single sector: the space is reserved (where the file
+     * system supports it) and reads as zeros */
+    off_t    size = (off_t) sectors * SECTOR_SIZE;
+    if ( create && ( ftruncate ( disk . m_Fd, size ) != 0
+                     || ( posix_fallocate ( disk . m_Fd, 0, size ) != 0 && ftruncate ( disk . m_Fd, size ) != 0 ) ) )
+    {
+      closeFileDisks ();
+      throw std::runtime_error ( "Raw storage create error" );
+    }
+    off_t    available = lseek ( disk . m_Fd, 0, SEEK_END );
+    if ( available < size )
+    {
+      closeFileDisks ();
+      throw std::runtime_error ( "Raw storage size error" );
+    }
+    if ( ! sectors && ( ! g_FileSectors || available / SECTOR_SIZE < g_FileSectors ) )
+      g_FileSectors = (int) std::min<off_t> ( available / SECTOR_SIZE, INT_MAX );
+  }
+
+  if ( mode == TFileMode::MMAP )
+    for ( auto & disk : g_FileDisks )
+    {
+      void   * mapping = mmap ( nullptr, (size_t) g_FileSectors * SECTOR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk . m_Fd, 0 );
+      if ( mapping == MAP_FAILED )
+      {
+        closeFileDisks ();
+        throw std::runtime_error ( "Raw storage map error" );
+      }
+      disk . m_Mapping = (char *) mapping;
+    }
+
+  res . m_Devices = (int) paths . size ();
+  res . m_Sectors = g_FileSectors;
+  res . m_Read    = mode == TFileMode::PREAD ? filePread : mode == TFileMode::DIRECT ? fileDirectRead : fileMapRead;
+  res . m_Write   = mode == TFileMode::PREAD ? filePwrite : mode == TFileMode::DIRECT ? fileDirectWrite : fileMapWrite;
+  return res;
+}
+//-------------------------------------------------------------------------------------------------
+/** Creates (or resizes) disk image files of the given size, no data gets written.
+ */
+TBlkDev                                createFileDisks                         ( const std::vector<std::string>      & paths,
+                                                                                 int                                   sectors,
+                                                                                 TFileMode                             mode )
+{
+  if ( sectors <= 0 )
+    throw std::runtime_error ( "Raw storage parameters error" );
+  return openFileDisksMode ( paths, sectors, mode, true );
+}
+//-------------------------------------------------------------------------------------------------
+/** Opens existing disk images or block devices, sectors == 0 takes the size of the smallest one.
+ */
+TBlkDev                                openFileDisks                           ( const std::vector<std::string>      & paths,
+                                                                                 int                                   sectors,
+                                                                                 TFileMode                             mode )
+{
+  return openFileDisksMode ( paths, sectors, mode, false );
+}
@@ -0,0 +1,316 @@
+/* SW RAID5 - benchmarks
+ *
+ * Built instead of the tests when RAID_BENCHMARK is defined:
+ *
+ *   g++ -std=c++20 -O2 -DRAID_BENCHMARK main.cpp -o bench
+ *   ./bench [xor] [volume] [file]
+ *
+ * Every benchmark prints one line per measurement: the suite name followed by key=value fields
+ * separated by spaces.
+ */
+#include <chrono>
+#include <atomic>
+#include <memory>
+
+//-------------------------------------------------------------------------------------------------
+/** XOR kernel micro-benchmark: every kernel runnable on this CPU folds the given number
+ * of sources of the given length, the throughput is counted in source bytes.
+ */
+void                                   benchXorKernels                         ()
+{
+  const int  lengths[] = { SECTOR_SIZE, 256 * SECTOR_SIZE };
+
+  for ( const auto & kernel : CXorEngine::availableKernels () )
+    for ( int length : lengths )
+      for ( int sourceCount = 2; sourceCount < MAX_RAID_DEVICES; sourceCount ++ )
+      {
+        std::vector<std::byte>   buffers ( ( sourceCount + 1 ) * length, std::byte { 0x5a } );
+        const std::byte        * sources[MAX_RAID_DEVICES];
+        for ( int i = 0; i < sourceCount; i ++ )
+          sources[i] = buffers . data () + ( i + 1 ) * length;
+
+        /* roughly the same amount of data for every configuration */
+        long long  iterations = std::max ( 16LL, ( 1LL << 30 ) / ( (long long) length * sourceCount ) );
+        /* single sectors go through the kernel specialised for the sector size, as in the volume */
+        CXorEngine::TKernel function = length == SECTOR_SIZE ? kernel . m_SectorKernel : kernel . m_Kernel;
+        auto       begin = std::chrono::steady_clock::now ();
+        for ( long long i = 0; i < iterations; i ++ )
+          function ( buffers . data (), sources, sourceCount, length );
+        double     seconds = std::chrono::duration<double> ( std::chrono::steady_clock::now () - begin ) . count ();
+
+        printf ( "xor kernel=%s sources=%d length=%d GBps=%.2f\n", kernel . m_Name, sourceCount, length,
+                 iterations * (double) length * sourceCount / seconds / 1e9 );
+      }
+}
+//-------------------------------------------------------------------------------------------------
+/** Disks kept in memory. Every disk has its own latency added to each call, it may be switched to failing
+ * or set to fail once it has served the given number of calls (-1 for never).
+ */
+struct TBenchDisk
+{
+  std::vector<char>                      m_Data;
+  std::atomic<int>                       m_LatencyUs { 0 };
+  std::atomic<bool>                      m_Failed { false };
+  std::atomic<long long>                 m_Calls { 0 };
+  std::atomic<long long>                 m_FailAfterCalls { -1 };
+};
+
+static std::vector<std::unique_ptr<TBenchDisk>> g_BenchDisks;
+
+int                                    benchTransfer                           ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 char                                * data,
+                                                                                 int                                   sectorCnt,
+                                                                                 bool                                  write )
+{
+  if ( device < 0 || device >= (int) g_BenchDisks . size () || sectorCnt <= 0 )
+    return 0;
+  TBenchDisk & disk = *g_BenchDisks[device];
+  if ( disk . m_LatencyUs )
+    std::this_thread::sleep_for ( std::chrono::microseconds ( disk . m_LatencyUs ) );
+  long long  failAfter = disk . m_FailAfterCalls;
+  if ( disk . m_Calls ++ >= failAfter && failAfter >= 0 )
+    disk . m_Failed = true;
+  if ( disk . m_Failed || sectorNr < 0 || (size_t) ( sectorNr + sectorCnt ) * SECTOR_SIZE > disk . m_Data . size () )
+    return 0;
+  char     * sectors = disk . m_Data . data () + (size_t) sectorNr * SECTOR_SIZE;
+  if ( write )
+    memcpy ( sectors, data, (size_t) sectorCnt * SECTOR_SIZE );
+  else
+    memcpy ( data, sectors, (size_t) sectorCnt * SECTOR_SIZE );
+  return sectorCnt;
+}
+//-------------------------------------------------------------------------------------------------
+int                                    benchRead                               ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 void                                * data,
+                                                                                 int                                   sectorCnt )
+{
+  return benchTransfer ( device, sectorNr, (char *) data, sectorCnt, false );
+}
+//-------------------------------------------------------------------------------------------------
+int                                    benchWrite                              ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 const void                          * data,
+                                                                                 int                                   sectorCnt )
+{
+  return benchTransfer ( device, sectorNr, (char *) data, sectorCnt, true );
+}
+//-------------------------------------------------------------------------------------------------
+TBlkDev                                createBenchDisks                        ( int                                   devices,
+                                                                                 int                                   sectors,
+                                                                                 int                                   latencyUs )
+{
+  TBlkDev    res;
+
+  g_BenchDisks . clear ();
+  for ( int i = 0; i < devices; i ++ )
+  {
+    g_BenchDisks . push_back ( std::make_unique<TBenchDisk> () );
+    g_BenchDisks . back () -> m_Data . assign ( (size_t) sectors * SECTOR_SIZE, 0 );
+    g_BenchDisks . back () -> m_LatencyUs = latencyUs;
+  }
+  res . m_Devices = devices;
+  res . m_Sectors = sectors;
+  res . m_Read    = benchRead;
+  res . m_Write   = benchWrite;
+  return res;
+}
+//-------------------------------------------------------------------------------------------------
+/** Settings of a single memory disk during the measurement: the latency of every call and the count
+ * of calls after which the disk fails (-1 for never).
+ */
+struct TBenchDiskConfig
+{
+  int                                    m_LatencyUs;
+  long long                              m_FailAfterCalls = -1;
+};
+//-------------------------------------------------------------------------------------------------
+struct TVolumeBench
+{
+  const char                           * m_Backend;
+  int                                    m_Devices;
+  int                                    m_Sectors;
+  int                                    m_LatencyUs;
+  bool                                   m_Degraded;
+  bool                                   m_Sequential;
+  bool                                   m_Write;
+  int                                    m_RequestSectors;
+  bool                                   m_ParallelIo;
+  double                                 m_Seconds;
+  /* disk images in RAID_BENCH_DIR (/tmp by default) instead of memory, -1 for memory */
+  int                                    m_FileMode = -1;
+  /* memory disks set apart from m_LatencyUs (disk index, settings) */
+  std::vector<std::pair<int, TBenchDiskConfig>> m_Disks;
+};
+//-------------------------------------------------------------------------------------------------
+std::vector<std::string>               benchFilePaths                          ( int                                   devices )
+{
+  const char * directory = getenv ( "RAID_BENCH_DIR" );
+  std::vector<std::string> paths;
+  for ( int i = 0; i < devices; i ++ )
+    paths . push_back ( std::string ( directory ? directory : "/tmp" ) + "/raid-bench-" + std::to_string ( i ) );
+  return paths;
+}
+//-------------------------------------------------------------------------------------------------
+/** Runs a single workload on a fresh volume for the given time and prints one line:
+ * IOPS, MB/s of user data, median and 99th percentile request latency and backend calls per user sector.
+ */
+void                                   benchVolume                             ( const TVolumeBench                  & bench )
+{
+  TBlkDev    dev = bench . m_FileMode < 0 ? createBenchDisks ( bench . m_Devices, bench . m_Sectors, 0 )
+                                      : createFileDisks ( benchFilePaths ( bench . m_Devices ), bench . m_Sectors, (TFileMode) bench . m_FileMode );
+  TRaidConfig config;
+  config . m_ParallelIo = bench . m_ParallelIo;
+  if ( ! CRaidVolume::create ( dev, config ) )
+    throw std::runtime_error ( "Benchmark volume create error" );
+
+  /* disk 0 does not answer from the start in the degraded mode (memory disks only) */
+  if ( bench . m_FileMode < 0 )
+    g_BenchDisks[0] -> m_Failed = bench . m_Degraded;
+  CRaidVolume vol;
+  if ( vol . start ( dev ) != ( bench . m_Degraded ? RAID_DEGRADED : RAID_OK ) )
+    throw std::runtime_error ( "Benchmark volume start error" );
+  std::vector<TBenchDiskConfig> disks ( bench . m_Devices, TBenchDiskConfig { bench . m_LatencyUs } );
+  for ( const auto & [index, disk] : bench . m_Disks )
+    disks[index] = disk;
+  if ( bench . m_FileMode < 0 )
+    for ( int i = 0; i < bench . m_Devices; i ++ )
+    {
+      g_BenchDisks[i] -> m_LatencyUs = disks[i] . m_LatencyUs;
+      g_BenchDisks[i] -> m_Calls = 0;
+      g_BenchDisks[i] -> m_FailAfterCalls = disks[i] . m_FailAfterCalls;
+    }
+
+  std::vector<char> buffer ( (size_t) bench . m_RequestSectors * SECTOR_SIZE, 0x5a );
+  std::vector<double> latencies;
+  std::mt19937 random ( 12345 );
+  vol . setParallelIo ( bench . m_ParallelIo );
+  vol . resetStats ();
+  const int64_t slots = vol . size () / bench . m_RequestSectors;
+  long long  calls = 0, requests = 0;
+  auto       begin = std::chrono::steady_clock::now (), end = begin;
+
+  while ( end - begin < std::chrono::duration<double> ( bench . m_Seconds ) )
+  {
+    int64_t  secNr = bench . m_Sequential ? requests % slots * bench . m_RequestSectors
+                                          : (int64_t) ( random () % slots ) * bench . m_RequestSectors;
+    bool     ok = bench . m_Write ? vol . write ( secNr, buffer . data (), bench . m_RequestSectors )
+                                  : vol . read ( secNr, buffer . data (), bench . m_RequestSectors );
+    if ( ! ok )
+      throw std::runtime_error ( "Benchmark request error" );
+    auto     now = std::chrono::steady_clock::now ();
+    latencies . push_back ( std::chrono::duration<double, std::micro> ( now - end ) . count () );
+    end = now;
+    requests ++;
+  }
+  CRaidStats::TSnapshot stats = vol . statsSnapshot ();
+  for ( const auto & disk : stats . m_Disks )
+    calls += disk . m_ReadCalls + disk . m_WriteCalls;
+  int        endStatus = vol . status ();
+  vol . stop ();
+  if ( bench . m_FileMode >= 0 )
+  {
+    closeFileDisks ();
+    for ( const auto & path : benchFilePaths ( bench . m_Devices ) )
+      unlink ( path . c_str () );
+  }
+
+  /* per disk settings as comma separated lists, in the order of the disks */
+  std::string diskLatencies, diskFailures;
+  for ( const auto & disk : disks )
+  {
+    diskLatencies += ( diskLatencies . empty () ? "" : "," ) + std::to_string ( disk . m_LatencyUs );
+    diskFailures += ( diskFailures . empty () ? "" : "," ) + std::to_string ( disk . m_FailAfterCalls );
+  }
+
+  double     seconds = std::chrono::duration<double> ( end - begin ) . count ();
+  std::sort ( latencies . begin (), latencies . end () );
+  printf ( "volume backend=%s devices=%d mode=%s pattern=%s op=%s size=%d parallel=%d latencyUs=%d"
+           " diskLatencyUs=%s diskFailAfterCalls=%s endMode=%s"
+           " iops=%.0f MBps=%.2f p50us=%.2f p99us=%.2f callsPerSector=%.3f\n",
+           bench . m_Backend, bench . m_Devices, bench . m_Degraded ? "degraded" : "ok",
+           bench . m_Sequential ? "seq" : "rand", bench . m_Write ? "write" : "read", bench . m_RequestSectors,
+           bench . m_ParallelIo, bench . m_LatencyUs, diskLatencies . c_str (), diskFailures . c_str (),
+           endStatus == RAID_OK ? "ok" : endStatus == RAID_DEGRADED ? "degraded" : "failed",
+           requests / seconds,
+           requests * (double) bench . m_RequestSectors * SECTOR_SIZE / seconds / 1e6,
+           latencies[latencies . size () / 2], latencies[latencies . size () * 99 / 100],
+           calls / ( (double) requests * bench . m_RequestSectors ) );
+  fflush ( stdout );
+}
+//-------------------------------------------------------------------------------------------------
+/** Volume workloads: every device count over the in-memory backend, then a smaller matrix over disks
+ * with injected latency, where the parallel I/O pays off, and the same disks with a single one of them
+ * ten times slower or failing in the middle of the measurement.
+ */
+void                                   benchVolumes                            ()
+{
+  for ( int devices = 3; devices <= MAX_RAID_DEVICES; devices ++ )
+    for ( bool degraded : { false, true } )
+      for ( bool sequential : { true, false } )
+        for ( bool write : { false, true } )
+          for ( int requestSectors : { 1, 8, 64, 256 } )
+            benchVolume ( { "memory", devices, 8192, 0, degraded, sequential, write, requestSectors, false, 0.02 } );
+
+  for ( int devices : { 4, 8, MAX_RAID_DEVICES } )
+    for ( bool degraded : { false, true } )
+      for ( bool write : { false, true } )
+        for ( int requestSectors : { 1, 64, 256 } )
+          for ( bool parallelIo : { false, true } )
+            benchVolume ( { "latency", devices, 8192, 100, degraded, false, write, requestSectors, parallelIo, 0.1 } );
+
+  const std::pair<const char *, TBenchDiskConfig> oddDisks[] = { { "slow", { 1000 } }, { "failing", { 100, 50 } } };
+  for ( const auto & [name, odd] : oddDisks )
+    for ( int devices : { 4, 8 } )
+      for ( bool write : { false, true } )
+        for ( int requestSectors : { 1, 64 } )
+          for ( bool parallelIo : { false, true } )
+          {
+            TVolumeBench bench { name, devices, 8192, 100, false, false, write, requestSectors, parallelIo, 0.1 };
+            bench . m_Disks = { { 1, odd } };
+            benchVolume ( bench );
+          }
+}
+//-------------------------------------------------------------------------------------------------
+/** Disk image workloads over the pread/pwrite, O_DIRECT and mmap backends.
+ */
+void                                   benchFiles                              ()
+{
+  const std::pair<const char *, TFileMode> modes[] = { { "pread", TFileMode::PREAD }, { "direct", TFileMode::DIRECT },
+                                                       { "mmap", TFileMode::MMAP } };
+  for ( const auto & [name, mode] : modes )
+    for ( bool sequential : { true, false } )
+      for ( bool write : { false, true } )
+        for ( int requestSectors : { 8, 256 } )
+          for ( bool parallelIo : { false, true } )
+          {
+            TVolumeBench bench { name, 4, 65536, 0, false, sequential, write, requestSectors, parallelIo, 0.2 };
+            bench . m_FileMode = (int) mode;
+            benchVolume ( bench );
+          }
+}
+//-------------------------------------------------------------------------------------------------
+/** Runs the suites named on the command line (xor, volume, file), all of them without arguments.
+ */
+int                                    main                                    ( int                                   argc,
+                                                                                 char                                * argv[] )
+{
+  auto       selected = [argc, argv] ( const char * name )
+  {
+    if ( argc < 2 )
+      return true;
+    for ( int i = 1; i < argc; i ++ )
+      if ( ! strcmp ( argv[i], name ) )
+        return true;
+    return false;
+  };
+
+  if ( selected ( "xor" ) )
+    benchXorKernels ();
+  if ( selected ( "volume" ) )
+    benchVolumes ();
+  if ( selected ( "file" ) )
+    benchFiles ();
+  return EXIT_SUCCESS;
+}
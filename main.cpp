@@ -3,12 +3,35 @@
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <cstddef>
 #include <cstdint>
+#include <climits>
 #include <cassert>
 #include <stdexcept>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <atomic>
+#include <optional>
+#include <bit>
+#include <chrono>
+#include <random>
+#include <utility>
 using namespace std;
 
-constexpr int                          SECTOR_SIZE                             =             512;
+#ifndef RAID_SECTOR_SIZE
+#define RAID_SECTOR_SIZE 512
+#endif
+constexpr int                          SECTOR_SIZE                             = RAID_SECTOR_SIZE;
 constexpr int                          MAX_RAID_DEVICES                        =              16;
 constexpr int                          MAX_DEVICE_SECTORS                      = 1024 * 1024 * 2;
 constexpr int                          MIN_DEVICE_SECTORS                      =    1 * 1024 * 2;
@@ -27,327 +50,4408 @@ struct TBlkDev
 };
 #endif /* __PROGTEST__ */
 
-struct Metadata
+//The sector size is a compile-time constant (-DRAID_SECTOR_SIZE=4096 for 4Kn disks), every sector-sized copy and
+//XOR is specialised for it
+static_assert(SECTOR_SIZE >= 512 && std::has_single_bit((unsigned) SECTOR_SIZE), "Sector size has to be a power of two, 512 or more");
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RAID_XOR_X86
+#endif
+
+//Parity engine: XORs any number of source buffers into a destination in a single pass, the best kernel
+//supported by the CPU is selected on the first use
+class CXorEngine
 {
-    void resetDisksStatus() {
-        for (int diskIndex = 0; diskIndex < MAX_RAID_DEVICES; ++diskIndex)
-            disksStatus[diskIndex] = false;
+public:
+    using TKernel = void (*)(std::byte *destination, const std::byte * const *sources, int sourceCount, size_t length);
+
+    struct TKernelInfo
+    {
+        const char *m_Name;
+        TKernel m_Kernel;
+        //The same kernel compiled for length == SECTOR_SIZE: constant trip count, no tail
+        TKernel m_SectorKernel;
+    };
+
+    //destination = sources[0] ^ sources[1] ^ ... ^ sources[sourceCount - 1]; destination may be one of the sources
+    static void xorSources(std::byte *destination, const std::byte * const *sources, int sourceCount, size_t length)
+    {
+        if ( sourceCount <= 0 ) {
+            memset(destination, 0, length);
+            return;
+        }
+        const TKernelInfo &kernel = selectedKernel();
+        ( length == SECTOR_SIZE ? kernel.m_SectorKernel : kernel.m_Kernel )(destination, sources, sourceCount, length);
     }
 
-    bool operator==(const Metadata &other) const {
-        for (int i = 0; i < MAX_RAID_DEVICES; ++i) {
-            if ( other.disksStatus[i] != this->disksStatus[i] )
+    static const char* kernelName()
+    {
+        return selectedKernel().m_Name;
+    }
+
+    //All kernels runnable on this CPU, the fastest one goes last
+    static std::vector<TKernelInfo> availableKernels()
+    {
+        std::vector<TKernelInfo> kernels { { "scalar", xorScalar<>, xorScalar<SECTOR_SIZE> } };
+#ifdef RAID_XOR_X86
+        __builtin_cpu_init();
+        if ( __builtin_cpu_supports("sse2") ) kernels.push_back({ "sse2", xorSse2<>, xorSse2<SECTOR_SIZE> });
+        if ( __builtin_cpu_supports("avx2") ) kernels.push_back({ "avx2", xorAvx2<>, xorAvx2<SECTOR_SIZE> });
+        if ( __builtin_cpu_supports("avx512f") ) kernels.push_back({ "avx512", xorAvx512<>, xorAvx512<SECTOR_SIZE> });
+#endif
+        return kernels;
+    }
+
+private:
+    static const TKernelInfo& selectedKernel()
+    {
+        static const TKernelInfo kernel = availableKernels().back();
+        return kernel;
+    }
+
+    template <typename TWord>
+    static void xorTail(std::byte *destination, const std::byte * const *sources, int sourceCount, size_t offset, size_t length)
+    {
+        for ( ; offset + sizeof(TWord) <= length; offset += sizeof(TWord)) {
+            TWord accumulator, word;
+            memcpy(&accumulator, sources[0] + offset, sizeof(TWord));
+            for (int sourceIndex = 1; sourceIndex < sourceCount; ++sourceIndex) {
+                memcpy(&word, sources[sourceIndex] + offset, sizeof(TWord));
+                accumulator ^= word;
+            }
+            memcpy(destination + offset, &accumulator, sizeof(TWord));
+        }
+    }
+
+    //Kernels take FixedLength as the length when it is not 0, the compiler then drops the loop bounds checks and the tail
+    template <size_t FixedLength = 0>
+    static void xorScalar(std::byte *destination, const std::byte * const *sources, int sourceCount, size_t length)
+    {
+        if constexpr ( FixedLength != 0 ) length = FixedLength;
+        xorTail<uint64_t>(destination, sources, sourceCount, 0, length);
+        xorTail<uint8_t>(destination, sources, sourceCount, length & ~(size_t) 7, length);
+    }
+
+#ifdef RAID_XOR_X86
+    template <size_t FixedLength = 0>
+    __attribute__((target("sse2")))
+    static void xorSse2(std::byte *destination, const std::byte * const *sources, int sourceCount, size_t length)
+    {
+        if constexpr ( FixedLength != 0 ) length = FixedLength;
+        size_t offset = 0;
+        for ( ; offset + 64 <= length; offset += 64) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*) (sources[0] + offset));
+            __m128i a1 = _mm_loadu_si128((const __m128i*) (sources[0] + offset + 16));
+            __m128i a2 = _mm_loadu_si128((const __m128i*) (sources[0] + offset + 32));
+            __m128i a3 = _mm_loadu_si128((const __m128i*) (sources[0] + offset + 48));
+            for (int sourceIndex = 1; sourceIndex < sourceCount; ++sourceIndex) {
+                const std::byte *source = sources[sourceIndex] + offset;
+                a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i*) source));
+                a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i*) (source + 16)));
+                a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i*) (source + 32)));
+                a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i*) (source + 48)));
+            }
+            _mm_storeu_si128((__m128i*) (destination + offset), a0);
+            _mm_storeu_si128((__m128i*) (destination + offset + 16), a1);
+            _mm_storeu_si128((__m128i*) (destination + offset + 32), a2);
+            _mm_storeu_si128((__m128i*) (destination + offset + 48), a3);
+        }
+        xorTail<uint8_t>(destination, sources, sourceCount, offset, length);
+    }
+
+    template <size_t FixedLength = 0>
+    __attribute__((target("avx2")))
+    static void xorAvx2(std::byte *destination, const std::byte * const *sources, int sourceCount, size_t length)
+    {
+        if constexpr ( FixedLength != 0 ) length = FixedLength;
+        size_t offset = 0;
+        for ( ; offset + 128 <= length; offset += 128) {
+            __m256i a0 = _mm256_loadu_si256((const __m256i*) (sources[0] + offset));
+            __m256i a1 = _mm256_loadu_si256((const __m256i*) (sources[0] + offset + 32));
+            __m256i a2 = _mm256_loadu_si256((const __m256i*) (sources[0] + offset + 64));
+            __m256i a3 = _mm256_loadu_si256((const __m256i*) (sources[0] + offset + 96));
+            for (int sourceIndex = 1; sourceIndex < sourceCount; ++sourceIndex) {
+                const std::byte *source = sources[sourceIndex] + offset;
+                a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i*) source));
+                a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i*) (source + 32)));
+                a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i*) (source + 64)));
+                a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i*) (source + 96)));
+            }
+            _mm256_storeu_si256((__m256i*) (destination + offset), a0);
+            _mm256_storeu_si256((__m256i*) (destination + offset + 32), a1);
+            _mm256_storeu_si256((__m256i*) (destination + offset + 64), a2);
+            _mm256_storeu_si256((__m256i*) (destination + offset + 96), a3);
+        }
+        xorTail<uint8_t>(destination, sources, sourceCount, offset, length);
+    }
+
+    template <size_t FixedLength = 0>
+    __attribute__((target("avx512f")))
+    static void xorAvx512(std::byte *destination, const std::byte * const *sources, int sourceCount, size_t length)
+    {
+        if constexpr ( FixedLength != 0 ) length = FixedLength;
+        size_t offset = 0;
+        for ( ; offset + 256 <= length; offset += 256) {
+            __m512i a0 = _mm512_loadu_si512(sources[0] + offset);
+            __m512i a1 = _mm512_loadu_si512(sources[0] + offset + 64);
+            __m512i a2 = _mm512_loadu_si512(sources[0] + offset + 128);
+            __m512i a3 = _mm512_loadu_si512(sources[0] + offset + 192);
+            for (int sourceIndex = 1; sourceIndex < sourceCount; ++sourceIndex) {
+                const std::byte *source = sources[sourceIndex] + offset;
+                a0 = _mm512_xor_si512(a0, _mm512_loadu_si512(source));
+                a1 = _mm512_xor_si512(a1, _mm512_loadu_si512(source + 64));
+                a2 = _mm512_xor_si512(a2, _mm512_loadu_si512(source + 128));
+                a3 = _mm512_xor_si512(a3, _mm512_loadu_si512(source + 192));
+            }
+            _mm512_storeu_si512(destination + offset, a0);
+            _mm512_storeu_si512(destination + offset + 64, a1);
+            _mm512_storeu_si512(destination + offset + 128, a2);
+            _mm512_storeu_si512(destination + offset + 192, a3);
+        }
+        xorTail<uint8_t>(destination, sources, sourceCount, offset, length);
+    }
+#endif
+};
+
+//Binary trace of the volume calls and of the backend calls they cause, for replaying a workload offline. A trace file
+//is a THeader followed by TRecord entries, both little-endian as laid out here. Backend calls carry the number of the
+//volume call they were issued by (jobs handed over to the disk workers inherit it), 0 for background work.
+class CIoTracer
+{
+public:
+    static constexpr uint32_t MAGIC = 0x31525452;
+    static constexpr uint16_t VERSION = 1;
+    //Records kept in memory before they are written into the file
+    static constexpr size_t BUFFERED_RECORDS = 4096;
+
+    enum TKind : uint8_t
+    {
+        READ,
+        WRITE,
+        RESYNC,
+        DISK_READ,
+        DISK_WRITE
+    };
+
+    struct TRecord
+    {
+        //Start of the call since the trace began and its duration
+        uint64_t m_TimeUs;
+        uint32_t m_LatencyUs;
+        //Volume call, numbered from 1
+        uint32_t m_Request;
+        //Volume sector, disk sector of backend calls; a resync records the watermark it started from
+        int64_t m_SecNr;
+        //Sectors of the call, those of a resync step (0 for a whole resync)
+        int32_t m_SecCnt;
+        //TKind, the member disk of a backend call (255 for volume calls)
+        uint8_t m_Kind;
+        uint8_t m_Disk;
+        uint8_t m_Succeeded;
+        uint8_t m_Reserved;
+    };
+    static_assert(sizeof(TRecord) == 32, "Trace records have a fixed layout");
+
+    //Geometry of the traced volume, so that a replay can build the same one
+    struct THeader
+    {
+        uint32_t m_Magic = MAGIC;
+        uint16_t m_Version = VERSION;
+        uint16_t m_RecordSize = sizeof(TRecord);
+        uint32_t m_SectorSize = SECTOR_SIZE;
+        int32_t m_Devices = 0;
+        int32_t m_DiskSectors = 0;
+        int32_t m_ChunkSectors = 1;
+        int32_t m_Rotation = 0;
+        int32_t m_AllocationRegion = 0;
+    };
+
+    //Marks the calling thread as working for the volume call while it exists
+    class CCaller
+    {
+    public:
+        explicit CCaller(uint32_t request)
+            : previous(callerRequest)
+        {
+            callerRequest = request;
+        }
+
+        CCaller(const CCaller&) = delete;
+        CCaller& operator=(const CCaller&) = delete;
+
+        ~CCaller()
+        {
+            callerRequest = previous;
+        }
+
+    private:
+        uint32_t previous;
+    };
+
+    //A traced volume call: numbered when it starts, recorded once it is over
+    class CRequest
+    {
+    public:
+        explicit CRequest(CIoTracer &tracer)
+            : tracer(tracer), request(tracer.isEnabled() ? ++tracer.requestCount : 0), caller(request)
+        {
+        }
+
+        void record(TKind kind, int64_t secNr, int secCnt, bool succeeded, std::chrono::steady_clock::time_point begin)
+        {
+            if ( request ) tracer.record(kind, request, -1, secNr, secCnt, succeeded, begin);
+        }
+
+    private:
+        CIoTracer &tracer;
+        uint32_t request;
+        CCaller caller;
+    };
+
+    ~CIoTracer()
+    {
+        close();
+    }
+
+    //Starts a trace in the file (replaced), false if it cannot be written
+    bool open(const char *fileName, const THeader &header)
+    {
+        close();
+        std::lock_guard<std::mutex> lock(mutex);
+        file = fopen(fileName, "wb");
+        if ( !file ) return false;
+        writeFailed = fwrite(&header, sizeof(header), 1, file) != 1;
+        startTime = std::chrono::steady_clock::now();
+        requestCount = 0;
+        enabled = true;
+        return !writeFailed;
+    }
+
+    //Writes out the rest of the trace, false if any part of it was lost
+    bool close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( !file ) return true;
+        enabled = false;
+        writeBuffered();
+        bool result = fclose(file) == 0 && !writeFailed;
+        file = nullptr;
+        return result;
+    }
+
+    bool isEnabled() const
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    void record(TKind kind, uint32_t request, int diskIndex, int64_t secNr, int secCnt, bool succeeded,
+                std::chrono::steady_clock::time_point begin)
+    {
+        auto end = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( !file ) return;
+        buffer.push_back({ (uint64_t) std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(begin - startTime).count(), 0),
+                           (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count(), request, secNr,
+                           secCnt, kind, (uint8_t) diskIndex, succeeded, 0 });
+        if ( buffer.size() >= BUFFERED_RECORDS ) writeBuffered();
+    }
+
+    //Backend call of the calling thread
+    void recordDiskCall(int diskIndex, bool write, int sectorIndex, int sectorCount, bool succeeded,
+                        std::chrono::steady_clock::time_point begin)
+    {
+        if ( isEnabled() ) record(write ? DISK_WRITE : DISK_READ, callerRequest, diskIndex, sectorIndex, sectorCount, succeeded, begin);
+    }
+
+    static uint32_t getCallerRequest()
+    {
+        return callerRequest;
+    }
+
+    //Reads a whole trace file, false if it is not a trace of this build (sector size, record layout)
+    static bool load(const char *fileName, THeader &header, std::vector<TRecord> &records)
+    {
+        FILE *file = fopen(fileName, "rb");
+        if ( !file ) return false;
+        TRecord record;
+        bool result = fread(&header, sizeof(header), 1, file) == 1 && header.m_Magic == MAGIC && header.m_Version == VERSION
+                      && header.m_RecordSize == sizeof(TRecord) && header.m_SectorSize == SECTOR_SIZE;
+        records.clear();
+        while ( result && fread(&record, sizeof(record), 1, file) == 1 )
+            records.push_back(record);
+        fclose(file);
+        return result;
+    }
+
+private:
+    //mutex is held by the caller
+    void writeBuffered()
+    {
+        if ( !buffer.empty() && fwrite(buffer.data(), sizeof(TRecord), buffer.size(), file) != buffer.size() )
+            writeFailed = true;
+        buffer.clear();
+    }
+
+    static inline thread_local uint32_t callerRequest = 0;
+
+    std::atomic<bool> enabled { false };
+    std::atomic<uint32_t> requestCount { 0 };
+    std::mutex mutex;
+    FILE *file = nullptr;
+    bool writeFailed = false;
+    std::vector<TRecord> buffer;
+    std::chrono::steady_clock::time_point startTime;
+};
+
+//One I/O thread per member disk; a batch of jobs is fanned out to the threads of their disks and joined
+class CDiskWorkers
+{
+public:
+    using TJob = std::function<void()>;
+
+    CDiskWorkers() = default;
+    CDiskWorkers(const CDiskWorkers&) = delete;
+    CDiskWorkers& operator=(const CDiskWorkers&) = delete;
+
+    ~CDiskWorkers()
+    {
+        stop();
+    }
+
+    void start(int workerCount)
+    {
+        stop();
+        workers = std::vector<TWorker>(workerCount);
+        for (auto &worker : workers)
+            worker.thread = std::thread(&CDiskWorkers::workerLoop, &worker);
+    }
+
+    void stop()
+    {
+        for (auto &worker : workers) {
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                worker.stopping = true;
+            }
+            worker.wakeUp.notify_one();
+        }
+        for (auto &worker : workers)
+            worker.thread.join();
+        workers.clear();
+    }
+
+    int workerCount() const
+    {
+        return (int) workers.size();
+    }
+
+    //Runs jobs[i].second on the worker of disk jobs[i].first and waits until all of them finish;
+    //without running workers the jobs are simply executed one after another
+    void runBatch(std::vector<std::pair<int, TJob>> &jobs)
+    {
+        if ( workers.empty() || jobs.size() < 2 ) {
+            for (auto &job : jobs)
+                job.second();
+            return;
+        }
+
+        std::mutex doneMutex;
+        std::condition_variable done;
+        size_t pending = jobs.size();
+        for (auto &job : jobs) {
+            post(job.first, [&job, &doneMutex, &done, &pending] {
+                job.second();
+                std::lock_guard<std::mutex> doneLock(doneMutex);
+                if ( --pending == 0 ) done.notify_one();
+            });
+        }
+
+        std::unique_lock<std::mutex> lock(doneMutex);
+        done.wait(lock, [&pending] { return pending == 0; });
+    }
+
+    //Queues the job on the worker of the disk and returns right away; needs running workers
+    void post(int diskIndex, TJob job)
+    {
+        TWorker &worker = workers[diskIndex % workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            ++postedJobs;
+        }
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.queue.emplace_back([this, job = std::move(job), request = CIoTracer::getCallerRequest()] {
+                CIoTracer::CCaller caller(request);
+                job();
+                std::lock_guard<std::mutex> idleLock(idleMutex);
+                if ( --postedJobs == 0 ) idle.notify_all();
+            });
+        }
+        worker.wakeUp.notify_one();
+    }
+
+    //Waits until every job posted so far is finished
+    void waitIdle()
+    {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        idle.wait(lock, [this] { return postedJobs == 0; });
+    }
+
+private:
+    struct TWorker
+    {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wakeUp;
+        std::deque<TJob> queue;
+        bool stopping = false;
+    };
+
+    static void workerLoop(TWorker *worker)
+    {
+        std::unique_lock<std::mutex> lock(worker->mutex);
+        while ( true ) {
+            worker->wakeUp.wait(lock, [worker] { return worker->stopping || !worker->queue.empty(); });
+            if ( worker->queue.empty() ) return;
+            TJob job = std::move(worker->queue.front());
+            worker->queue.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    std::vector<TWorker> workers;
+    std::mutex idleMutex;
+    std::condition_variable idle;
+    size_t postedJobs = 0;
+};
+
+//Write-through LRU cache of disk sectors keyed by (disk sector, disk); it always mirrors the disk content,
+//so entries of a disk are dropped as soon as the disk stops answering. Safe to use from several threads.
+class CStripeCache
+{
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+    struct TStats
+    {
+        size_t m_Hits = 0;
+        size_t m_Misses = 0;
+    };
+
+    void setCapacity(size_t sectors)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        capacity = sectors;
+        while ( entries.size() > capacity ) {
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+    size_t getCapacity() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return capacity;
+    }
+
+    TStats getStats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    //Copies the whole run into destination only if all of its sectors are cached
+    bool lookup(int diskIndex, int sectorIndex, std::byte *destination, int sectorCount = 1)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int offset = 0; offset < sectorCount; ++offset) {
+            if ( !index.count(getKey(diskIndex, sectorIndex + offset)) ) {
+                stats.m_Misses += sectorCount;
                 return false;
+            }
         }
-        if ( other.raidStatus != this->raidStatus )
-            return false;
+        for (int offset = 0; offset < sectorCount; ++offset) {
+            auto entry = index[getKey(diskIndex, sectorIndex + offset)];
+            entries.splice(entries.begin(), entries, entry);
+            memcpy(destination + offset * SECTOR_SIZE, entry->data, SECTOR_SIZE);
+        }
+        stats.m_Hits += sectorCount;
         return true;
+    }
+
+    //Refreshes the cached sectors of the run, inserts them only for small accesses so that large scans do not flush the cache
+    void store(int diskIndex, int sectorIndex, const std::byte *source, int sectorCount = 1)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int offset = 0; offset < sectorCount; ++offset) {
+            uint64_t key = getKey(diskIndex, sectorIndex + offset);
+            auto found = index.find(key);
+            if ( found != index.end() ) {
+                entries.splice(entries.begin(), entries, found->second);
+                memcpy(found->second->data, source + offset * SECTOR_SIZE, SECTOR_SIZE);
+                continue;
+            }
+            if ( sectorCount > MAX_INSERTED_RUN || capacity == 0 )
+                continue;
+
+            //Reuse the least recently used entry once the cache is full
+            if ( entries.size() >= capacity ) {
+                index.erase(entries.back().key);
+                entries.splice(entries.begin(), entries, std::prev(entries.end()));
+            }
+            else
+                entries.emplace_front();
+            entries.front().key = key;
+            memcpy(entries.front().data, source + offset * SECTOR_SIZE, SECTOR_SIZE);
+            index[key] = entries.begin();
+        }
+    }
+
+    void invalidateDisk(int diskIndex)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto entry = entries.begin(); entry != entries.end(); ) {
+            if ( (int) (entry->key & 0xff) != diskIndex ) {
+                ++entry;
+                continue;
+            }
+            index.erase(entry->key);
+            entry = entries.erase(entry);
+        }
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        index.clear();
+        entries.clear();
+    }
+
+private:
+    static constexpr int MAX_INSERTED_RUN = 1;
+
+    struct TEntry
+    {
+        uint64_t key;
+        std::byte data[SECTOR_SIZE];
     };
 
-    bool disksStatus[MAX_RAID_DEVICES] = { false };
-    int raidStatus = RAID_STOPPED;
+    static uint64_t getKey(int diskIndex, int sectorIndex)
+    {
+        return ( (uint64_t) sectorIndex << 8 ) | (uint64_t) diskIndex;
+    }
+
+    mutable std::mutex mutex;
+    size_t capacity = DEFAULT_CAPACITY;
+    TStats stats;
+    std::list<TEntry> entries;
+    std::unordered_map<uint64_t, std::list<TEntry>::iterator> index;
+};
+
+//Write-back buffer of partially written stripes keyed by the stripe index; a stripe holds the volume sectors of
+//one chunk on every data disk. Small writes are merged here until their stripe is complete and can be written as
+//a full stripe. Not synchronised, the volume guards it.
+class CWriteGather
+{
+public:
+    struct TStripe
+    {
+        std::vector<std::byte> data;
+        std::vector<bool> present;
+        int presentCount = 0;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    //Nothing may be being written out
+    void reset(int stripeSectors)
+    {
+        this->stripeSectors = stripeSectors;
+        stripes.clear();
+    }
+
+    int getStripeSectors() const
+    {
+        return stripeSectors;
+    }
+
+    size_t getStripeCount() const
+    {
+        return stripes.size();
+    }
+
+    //Stores the sector, returns true once its stripe is complete
+    bool store(int64_t sectorIndex, const std::byte *source)
+    {
+        int64_t stripeIndex = sectorIndex / stripeSectors;
+        int offset = (int) ( sectorIndex - stripeIndex * stripeSectors );
+        auto [found, inserted] = stripes.try_emplace(stripeIndex);
+        TStripe &stripe = found->second;
+        if ( inserted ) {
+            stripe.data.resize((size_t) stripeSectors * SECTOR_SIZE);
+            stripe.present.assign(stripeSectors, false);
+            stripe.since = std::chrono::steady_clock::now();
+        }
+        memcpy(stripe.data.data() + (size_t) offset * SECTOR_SIZE, source, SECTOR_SIZE);
+        if ( !stripe.present[offset] ) {
+            stripe.present[offset] = true;
+            ++stripe.presentCount;
+        }
+        return stripe.presentCount == stripeSectors;
+    }
+
+    //Any of the sectors [firstSector, lastSector] buffered or being written out
+    bool isPending(int64_t firstSector, int64_t lastSector) const
+    {
+        for (const auto *source : { &stripes, &writing }) {
+            auto stripe = source->lower_bound(firstSector / stripeSectors);
+            if ( stripe != source->end() && stripe->first <= lastSector / stripeSectors ) return true;
+        }
+        return false;
+    }
+
+    //Copies the pending content of the sectors [firstSector, firstSector + count) into the destination (buffered
+    //data win over the data being written out), marks them in present; returns the count of sectors found
+    int copyPending(int64_t firstSector, int count, std::byte *destination, std::vector<bool> &present) const
+    {
+        int found = 0;
+        present.assign(count, false);
+        for (const auto *source : { &stripes, &writing })
+            for (auto stripe = source->lower_bound(firstSector / stripeSectors);
+                 stripe != source->end() && stripe->first <= ( firstSector + count - 1 ) / stripeSectors; ++stripe) {
+                int64_t stripeStart = stripe->first * stripeSectors;
+                int64_t first = std::max(firstSector, stripeStart), end = std::min(firstSector + count, stripeStart + stripeSectors);
+                for (int64_t sectorIndex = first; sectorIndex < end; ++sectorIndex) {
+                    int offset = (int) ( sectorIndex - firstSector ), stripeOffset = (int) ( sectorIndex - stripeStart );
+                    if ( present[offset] || !stripe->second.present[stripeOffset] ) continue;
+                    memcpy(destination + (size_t) offset * SECTOR_SIZE, stripe->second.data.data() + (size_t) stripeOffset * SECTOR_SIZE, SECTOR_SIZE);
+                    present[offset] = true;
+                    ++found;
+                }
+            }
+        return found;
+    }
+
+    //Pending stripes holding any of the sectors [firstSector, lastSector]
+    std::vector<int64_t> getStripes(int64_t firstSector, int64_t lastSector) const
+    {
+        std::vector<int64_t> result;
+        for (auto stripe = stripes.lower_bound(firstSector / stripeSectors);
+             stripe != stripes.end() && stripe->first <= lastSector / stripeSectors; ++stripe)
+            result.push_back(stripe->first);
+        return result;
+    }
+
+    //Pending stripes buffered at or before the time point, oldest first
+    std::vector<int64_t> getStripesSince(std::chrono::steady_clock::time_point limit) const
+    {
+        std::vector<std::pair<std::chrono::steady_clock::time_point, int64_t>> aged;
+        for (const auto &[stripeIndex, stripe] : stripes)
+            if ( stripe.since <= limit ) aged.emplace_back(stripe.since, stripeIndex);
+        std::sort(aged.begin(), aged.end());
+        std::vector<int64_t> result;
+        for (const auto &stripe : aged)
+            result.push_back(stripe.second);
+        return result;
+    }
+
+    bool contains(int64_t stripeIndex) const
+    {
+        return stripes.count(stripeIndex) != 0;
+    }
+
+    //Moves the stripe from the buffer among the stripes being written out, reads keep finding it there until
+    //finishWrite; the stripe may be buffered again meanwhile, but not written out once more
+    const TStripe &startWrite(int64_t stripeIndex)
+    {
+        auto found = stripes.find(stripeIndex);
+        TStripe &stripe = writing[stripeIndex];
+        stripe = std::move(found->second);
+        stripes.erase(found);
+        return stripe;
+    }
+
+    void finishWrite(int64_t stripeIndex)
+    {
+        writing.erase(stripeIndex);
+    }
+
+    //Any stripe being written out, or any of the stripes [firstStripe, lastStripe]
+    bool isWriting() const
+    {
+        return !writing.empty();
+    }
+
+    bool isWriting(int64_t firstStripe, int64_t lastStripe) const
+    {
+        auto stripe = writing.lower_bound(firstStripe);
+        return stripe != writing.end() && stripe->first <= lastStripe;
+    }
+
+private:
+    int stripeSectors = 1;
+    std::map<int64_t, TStripe> stripes;
+    std::map<int64_t, TStripe> writing;
 };
 
-class CRaidVolume
-{
-public:
-    CRaidVolume() = default;
+//Bitmap of fixed-size regions of the data sectors, stored in a few sectors of every disk; sectors with changed
+//bits are tracked so that only those need to be written. A disabled bitmap reports every region as set.
+class CRegionBitmap
+{
+public:
+    //Sectors needed to store the bitmap for the given region size and data sectors
+    static int getStoredSectors(int regionSectors, int dataSectors)
+    {
+        if ( regionSectors <= 0 ) return 0;
+        int regions = (int) ( ( (int64_t) dataSectors + regionSectors - 1 ) / regionSectors );
+        return ( regions + 8 * SECTOR_SIZE - 1 ) / ( 8 * SECTOR_SIZE );
+    }
+
+    void reset(int regionSectors, int dataSectors)
+    {
+        this->regionSectors = std::max(regionSectors, 0);
+        this->dataSectors = dataSectors;
+        storedSectors = getStoredSectors(regionSectors, dataSectors);
+        bits.assign(storedSectors * SECTOR_SIZE, 0);
+        changedSectors.assign(storedSectors, false);
+        changedSectorCount = 0;
+        changes = 0;
+        storedChanges = 0;
+    }
+
+    bool isEnabled() const
+    {
+        return regionSectors > 0;
+    }
+
+    bool test(int sectorIndex) const
+    {
+        if ( !isEnabled() ) return true;
+        int region = sectorIndex / regionSectors;
+        return bits[region / 8] >> (region % 8) & 1;
+    }
+
+    //Sets the regions of the sectors, returns true if any of them was not set before
+    bool setRange(int firstSector, int lastSector)
+    {
+        bool changed = false;
+        if ( !isEnabled() || firstSector >= dataSectors ) return changed;
+        for (int region = std::max(firstSector, 0) / regionSectors; region <= std::min(lastSector, dataSectors - 1) / regionSectors; ++region)
+            changed |= setBit(region, true);
+        return changed;
+    }
+
+    void setAll()
+    {
+        setRange(0, dataSectors - 1);
+    }
+
+    //Clears the regions lying completely within the sectors (the last region ends with the data sectors),
+    //returns how many of them were set before
+    int clearRange(int firstSector, int lastSector)
+    {
+        int changed = 0;
+        if ( !isEnabled() ) return changed;
+        int firstRegion = ( std::max(firstSector, 0) + regionSectors - 1 ) / regionSectors;
+        int endRegion = lastSector >= dataSectors - 1 ? getRegionCount() : ( lastSector + 1 ) / regionSectors;
+        for (int region = firstRegion; region < endRegion; ++region)
+            changed += setBit(region, false);
+        return changed;
+    }
+
+    int getRegionSectors() const
+    {
+        return regionSectors;
+    }
+
+    //Clears the regions lying completely below the sector
+    void clearBelow(int sectorLimit)
+    {
+        if ( !isEnabled() ) return;
+        int regionLimit = sectorLimit >= dataSectors ? getRegionCount() : sectorLimit / regionSectors;
+        for (int region = 0; region < regionLimit; ++region)
+            setBit(region, false);
+    }
+
+    //First sector in [sectorIndex, sectorLimit) whose region is set, sectorLimit if there is none
+    int findSet(int sectorIndex, int sectorLimit) const
+    {
+        while ( sectorIndex < sectorLimit && !test(sectorIndex) )
+            sectorIndex = (int) std::min<int64_t>(( sectorIndex / regionSectors + 1 ) * (int64_t) regionSectors, sectorLimit);
+        return std::min(sectorIndex, sectorLimit);
+    }
+
+    //First sector in [sectorIndex, sectorLimit) whose region is not set, sectorLimit if there is none
+    int findClear(int sectorIndex, int sectorLimit) const
+    {
+        if ( !isEnabled() ) return sectorLimit;
+        while ( sectorIndex < sectorLimit && test(sectorIndex) )
+            sectorIndex = (int) std::min<int64_t>(( sectorIndex / regionSectors + 1 ) * (int64_t) regionSectors, sectorLimit);
+        return std::min(sectorIndex, sectorLimit);
+    }
+
+    int getStoredSectors() const
+    {
+        return storedSectors;
+    }
+
+    bool isSectorChanged(int storedSector) const
+    {
+        return changedSectors[storedSector];
+    }
+
+    int getChangedSectorCount() const
+    {
+        return changedSectorCount;
+    }
+
+    //Every change has been stored (by a flush that has finished); lock-free, so that writes find out cheaply there
+    //is nothing to flush
+    bool isStored() const
+    {
+        return storedChanges.load(std::memory_order_acquire) == changes.load(std::memory_order_acquire);
+    }
+
+    //Count of the changes so far, a flush taking its snapshot passes it to setStored once the sectors are written
+    uint64_t getChanges() const
+    {
+        return changes.load(std::memory_order_relaxed);
+    }
+
+    void setStored(uint64_t storedChanges)
+    {
+        this->storedChanges.store(storedChanges, std::memory_order_release);
+    }
+
+    const std::byte* getSector(int storedSector) const
+    {
+        return (const std::byte*) bits.data() + storedSector * SECTOR_SIZE;
+    }
+
+    void markAllChanged()
+    {
+        changedSectors.assign(storedSectors, true);
+        changedSectorCount = storedSectors;
+        changes.fetch_add(1, std::memory_order_release);
+    }
+
+    void markStored()
+    {
+        changedSectors.assign(storedSectors, false);
+        changedSectorCount = 0;
+    }
+
+    void load(const std::byte *data)
+    {
+        memcpy(bits.data(), data, bits.size());
+        markStored();
+        setStored(getChanges());
+    }
+
+private:
+    int getRegionCount() const
+    {
+        return (int) ( ( (int64_t) dataSectors + regionSectors - 1 ) / regionSectors );
+    }
+
+    bool setBit(int region, bool value)
+    {
+        uint8_t mask = (uint8_t) (1 << (region % 8));
+        if ( ( ( bits[region / 8] & mask ) != 0 ) == value ) return false;
+        bits[region / 8] ^= mask;
+        if ( !changedSectors[region / 8 / SECTOR_SIZE] ) {
+            changedSectors[region / 8 / SECTOR_SIZE] = true;
+            ++changedSectorCount;
+        }
+        changes.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    int regionSectors = 0;
+    int dataSectors = 0;
+    int storedSectors = 0;
+    std::vector<uint8_t> bits;
+    std::vector<bool> changedSectors;
+    int changedSectorCount = 0;
+    std::atomic<uint64_t> changes { 0 };
+    std::atomic<uint64_t> storedChanges { 0 };
+};
+
+//Performance counters of a volume and its member disks; relaxed atomics only, so they can stay on all the time
+class CRaidStats
+{
+public:
+    //Bucket b of a histogram counts latencies in [2^(b-1), 2^b) microseconds, bucket 0 those below 1 us
+    static constexpr int LATENCY_BUCKETS = 32;
+    using THistogram = std::array<uint64_t, LATENCY_BUCKETS>;
+
+    struct TDiskStats
+    {
+        uint64_t m_ReadCalls = 0;
+        uint64_t m_ReadSectors = 0;
+        uint64_t m_WriteCalls = 0;
+        uint64_t m_WriteSectors = 0;
+        uint64_t m_Errors = 0;
+        //Time spent in the backend calls of the disk
+        uint64_t m_BusyUs = 0;
+    };
+
+    struct TSnapshot
+    {
+        std::array<TDiskStats, MAX_RAID_DEVICES> m_Disks;
+        uint64_t m_Reads = 0;
+        uint64_t m_ReadSectors = 0;
+        uint64_t m_Writes = 0;
+        uint64_t m_WriteSectors = 0;
+        uint64_t m_FailedRequests = 0;
+        //Parity reconstructions of unreadable sectors (calls and sectors)
+        uint64_t m_Reconstructions = 0;
+        uint64_t m_ReconstructedSectors = 0;
+        //Partial row writes by strategy, rows written as full stripes
+        uint64_t m_ReadModifyWrites = 0;
+        uint64_t m_ReconstructWrites = 0;
+        uint64_t m_FullStripeRows = 0;
+        //Hedged reads: reconstructions issued for a late disk, those finishing first, disks demoted for reads
+        uint64_t m_HedgedReads = 0;
+        uint64_t m_HedgeWins = 0;
+        uint64_t m_Demotions = 0;
+        //Writes kept in the gather buffer, gathered stripes written complete (full stripe) and incomplete
+        uint64_t m_GatheredWrites = 0;
+        uint64_t m_GatherFullStripes = 0;
+        uint64_t m_GatherPartialStripes = 0;
+        //Rows checked by the scrub, those whose parity did not match the data and those whose parity was rewritten
+        uint64_t m_ScrubbedRows = 0;
+        uint64_t m_ScrubMismatches = 0;
+        uint64_t m_ScrubRepairs = 0;
+        //Sectors read from never written regions (zeros, no disk access), regions written for the first time and
+        //regions discarded
+        uint64_t m_UnwrittenSectorsRead = 0;
+        uint64_t m_RegionsAllocated = 0;
+        uint64_t m_RegionsDiscarded = 0;
+        //Volume sectors moved into the layout of an added disk
+        uint64_t m_ReshapedSectors = 0;
+        THistogram m_ReadLatency {};
+        THistogram m_WriteLatency {};
+        //Single read calls of all the member disks
+        THistogram m_DiskReadLatency {};
+        int m_ResyncDisk = -1;
+        int m_ResyncWatermark = 0;
+        int m_ResyncSectors = 0;
+    };
+
+    static int getLatencyBucket(uint64_t microseconds)
+    {
+        return std::min(LATENCY_BUCKETS - 1, (int) std::bit_width(microseconds));
+    }
+
+    //Upper bound in microseconds of the bucket reaching the given fraction of the requests, 0 for no requests
+    static uint64_t getPercentile(const THistogram &histogram, double fraction)
+    {
+        uint64_t total = 0, counted = 0;
+        for (uint64_t count : histogram)
+            total += count;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS && total; ++bucket) {
+            counted += histogram[bucket];
+            if ( counted >= fraction * total )
+                return 1ULL << bucket;
+        }
+        return 0;
+    }
+
+    //Backend calls are traced as well, while the tracer is enabled
+    void attachTracer(CIoTracer *tracer)
+    {
+        this->tracer = tracer;
+    }
+
+    //Executes a backend call of the disk and counts it
+    template<typename TCall>
+    int measureDiskCall(int diskIndex, bool write, int sectorIndex, int sectorCount, TCall call)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        int result = call();
+        if ( tracer ) tracer->recordDiskCall(diskIndex, write, sectorIndex, sectorCount, result == sectorCount, begin);
+        TDiskCounters &disk = disks[diskIndex];
+        add(write ? disk.writeCalls : disk.readCalls, 1);
+        add(write ? disk.writeSectors : disk.readSectors, std::max(result, 0));
+        if ( result != sectorCount ) add(disk.errors, 1);
+        uint64_t microseconds = getMicroseconds(begin);
+        add(disk.busyUs, microseconds);
+        if ( !write ) add(diskReadLatency[getLatencyBucket(microseconds)], 1);
+        return result;
+    }
+
+    void countRequest(bool write, int sectorCount, bool succeeded, std::chrono::steady_clock::time_point begin)
+    {
+        add(write ? writes : reads, 1);
+        add(write ? writeSectors : readSectors, std::max(sectorCount, 0));
+        if ( !succeeded ) add(failedRequests, 1);
+        add((write ? writeLatency : readLatency)[getLatencyBucket(getMicroseconds(begin))], 1);
+    }
+
+    void countReconstruction(int sectorCount)
+    {
+        add(reconstructions, 1);
+        add(reconstructedSectors, sectorCount);
+    }
+
+    void countReadModifyWrite()
+    {
+        add(readModifyWrites, 1);
+    }
+
+    void countReconstructWrite()
+    {
+        add(reconstructWrites, 1);
+    }
+
+    void countFullStripeRows(int rowCount)
+    {
+        add(fullStripeRows, rowCount);
+    }
+
+    void countHedge(bool won)
+    {
+        add(won ? hedgeWins : hedgedReads, 1);
+    }
+
+    void countDemotion()
+    {
+        add(demotions, 1);
+    }
+
+    void countGatheredWrite()
+    {
+        add(gatheredWrites, 1);
+    }
+
+    void countGatherFlush(bool complete)
+    {
+        add(complete ? gatherFullStripes : gatherPartialStripes, 1);
+    }
+
+    void countScrub(int rowCount, int mismatches, int repairs)
+    {
+        add(scrubbedRows, rowCount);
+        add(scrubMismatches, mismatches);
+        add(scrubRepairs, repairs);
+    }
+
+    void countUnwrittenRead(int sectorCount)
+    {
+        add(unwrittenSectorsRead, sectorCount);
+    }
+
+    void countAllocation(int allocated, int discarded)
+    {
+        add(regionsAllocated, allocated);
+        add(regionsDiscarded, discarded);
+    }
+
+    void countReshape(int64_t sectorCount)
+    {
+        add(reshapedSectors, sectorCount);
+    }
+
+    //Finished read and write requests so far, background work uses it to notice foreground traffic
+    uint64_t getRequestCount() const
+    {
+        return reads.load(std::memory_order_relaxed) + writes.load(std::memory_order_relaxed);
+    }
+
+    //Latency of the disk read calls reaching the given fraction of them, 0 before the first call
+    uint64_t getDiskReadPercentile(double fraction) const
+    {
+        THistogram histogram;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+            histogram[bucket] = diskReadLatency[bucket].load(std::memory_order_relaxed);
+        return getPercentile(histogram, fraction);
+    }
+
+    TSnapshot getSnapshot() const
+    {
+        TSnapshot snapshot;
+        for (int diskIndex = 0; diskIndex < MAX_RAID_DEVICES; ++diskIndex) {
+            const TDiskCounters &disk = disks[diskIndex];
+            snapshot.m_Disks[diskIndex] = { disk.readCalls, disk.readSectors, disk.writeCalls, disk.writeSectors,
+                                            disk.errors, disk.busyUs };
+        }
+        snapshot.m_Reads = reads;
+        snapshot.m_ReadSectors = readSectors;
+        snapshot.m_Writes = writes;
+        snapshot.m_WriteSectors = writeSectors;
+        snapshot.m_FailedRequests = failedRequests;
+        snapshot.m_Reconstructions = reconstructions;
+        snapshot.m_ReconstructedSectors = reconstructedSectors;
+        snapshot.m_ReadModifyWrites = readModifyWrites;
+        snapshot.m_ReconstructWrites = reconstructWrites;
+        snapshot.m_FullStripeRows = fullStripeRows;
+        snapshot.m_HedgedReads = hedgedReads;
+        snapshot.m_HedgeWins = hedgeWins;
+        snapshot.m_Demotions = demotions;
+        snapshot.m_GatheredWrites = gatheredWrites;
+        snapshot.m_GatherFullStripes = gatherFullStripes;
+        snapshot.m_GatherPartialStripes = gatherPartialStripes;
+        snapshot.m_ScrubbedRows = scrubbedRows;
+        snapshot.m_ScrubMismatches = scrubMismatches;
+        snapshot.m_ScrubRepairs = scrubRepairs;
+        snapshot.m_UnwrittenSectorsRead = unwrittenSectorsRead;
+        snapshot.m_RegionsAllocated = regionsAllocated;
+        snapshot.m_RegionsDiscarded = regionsDiscarded;
+        snapshot.m_ReshapedSectors = reshapedSectors;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+            snapshot.m_ReadLatency[bucket] = readLatency[bucket];
+            snapshot.m_WriteLatency[bucket] = writeLatency[bucket];
+            snapshot.m_DiskReadLatency[bucket] = diskReadLatency[bucket];
+        }
+        return snapshot;
+    }
+
+    void reset()
+    {
+        for (auto &disk : disks)
+            for (auto *counter : { &disk.readCalls, &disk.readSectors, &disk.writeCalls, &disk.writeSectors, &disk.errors, &disk.busyUs })
+                counter->store(0, std::memory_order_relaxed);
+        for (auto *counter : { &reads, &readSectors, &writes, &writeSectors, &failedRequests, &reconstructions,
+                               &reconstructedSectors, &readModifyWrites, &reconstructWrites, &fullStripeRows, &hedgedReads,
+                               &hedgeWins, &demotions, &gatheredWrites, &gatherFullStripes, &gatherPartialStripes,
+                               &scrubbedRows, &scrubMismatches, &scrubRepairs, &unwrittenSectorsRead, &regionsAllocated,
+                               &regionsDiscarded, &reshapedSectors })
+            counter->store(0, std::memory_order_relaxed);
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+            readLatency[bucket].store(0, std::memory_order_relaxed);
+            writeLatency[bucket].store(0, std::memory_order_relaxed);
+            diskReadLatency[bucket].store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    using TCounter = std::atomic<uint64_t>;
+
+    struct TDiskCounters
+    {
+        TCounter readCalls { 0 };
+        TCounter readSectors { 0 };
+        TCounter writeCalls { 0 };
+        TCounter writeSectors { 0 };
+        TCounter errors { 0 };
+        TCounter busyUs { 0 };
+    };
+
+    static void add(TCounter &counter, uint64_t value)
+    {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    static uint64_t getMicroseconds(std::chrono::steady_clock::time_point begin)
+    {
+        return (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    CIoTracer *tracer = nullptr;
+    TDiskCounters disks[MAX_RAID_DEVICES];
+    TCounter reads { 0 };
+    TCounter readSectors { 0 };
+    TCounter writes { 0 };
+    TCounter writeSectors { 0 };
+    TCounter failedRequests { 0 };
+    TCounter reconstructions { 0 };
+    TCounter reconstructedSectors { 0 };
+    TCounter readModifyWrites { 0 };
+    TCounter reconstructWrites { 0 };
+    TCounter fullStripeRows { 0 };
+    TCounter hedgedReads { 0 };
+    TCounter hedgeWins { 0 };
+    TCounter demotions { 0 };
+    TCounter gatheredWrites { 0 };
+    TCounter gatherFullStripes { 0 };
+    TCounter gatherPartialStripes { 0 };
+    TCounter scrubbedRows { 0 };
+    TCounter scrubMismatches { 0 };
+    TCounter scrubRepairs { 0 };
+    TCounter unwrittenSectorsRead { 0 };
+    TCounter regionsAllocated { 0 };
+    TCounter regionsDiscarded { 0 };
+    TCounter reshapedSectors { 0 };
+    TCounter readLatency[LATENCY_BUCKETS] {};
+    TCounter writeLatency[LATENCY_BUCKETS] {};
+    TCounter diskReadLatency[LATENCY_BUCKETS] {};
+};
+
+//Reader/writer locks of the stripe rows hashed into a fixed number of slots; a range locks its slots in ascending
+//order, so two ranges never deadlock. A range of SLOT_COUNT rows or more locks every slot.
+class CRowLocks
+{
+public:
+    static constexpr int SLOT_COUNT = 256;
+
+    //Holds the rows locked for its whole lifetime
+    class CGuard
+    {
+    public:
+        CGuard(CRowLocks &locks, int firstRow, int lastRow, bool exclusive)
+            : locks(locks), firstRow(firstRow), lastRow(lastRow), exclusive(exclusive)
+        {
+            locks.forEachSlot(firstRow, lastRow, [exclusive](std::shared_mutex &slot) {
+                if ( exclusive ) slot.lock();
+                else slot.lock_shared();
+            });
+        }
+
+        CGuard(const CGuard&) = delete;
+        CGuard& operator=(const CGuard&) = delete;
+
+        ~CGuard()
+        {
+            locks.forEachSlot(firstRow, lastRow, [this](std::shared_mutex &slot) {
+                if ( exclusive ) slot.unlock();
+                else slot.unlock_shared();
+            });
+        }
+
+    private:
+        CRowLocks &locks;
+        int firstRow;
+        int lastRow;
+        bool exclusive;
+    };
+
+private:
+    //Rows hash onto consecutive slots (wrapping around), so a range visits min(rowCount, SLOT_COUNT) slots: the
+    //wrapped part first, to keep the ascending slot order all the guards lock in
+    template<typename TFunction>
+    void forEachSlot(int firstRow, int lastRow, TFunction function)
+    {
+        int rowCount = std::min(lastRow - firstRow + 1, SLOT_COUNT), firstSlot = firstRow % SLOT_COUNT;
+        int wrapped = std::max(firstSlot + rowCount - SLOT_COUNT, 0);
+        for (int slotIndex = 0; slotIndex < wrapped; ++slotIndex)
+            function(slots[slotIndex]);
+        for (int slotIndex = firstSlot; slotIndex < firstSlot + rowCount - wrapped; ++slotIndex)
+            function(slots[slotIndex]);
+    }
+
+    std::array<std::shared_mutex, SLOT_COUNT> slots;
+};
+
+//Pool of aligned buffers for the data which cannot stay in the caller memory (parity, old sectors, reconstructed
+//rows); a buffer returns to the pool when its handle goes away, so steady traffic allocates nothing. The alignment
+//suits O_DIRECT backends.
+class CBufferArena
+{
+public:
+    static constexpr size_t ALIGNMENT = 4096;
+    //Free buffers kept per size class, size class c holds buffers of ALIGNMENT << c bytes
+    static constexpr size_t MAX_POOLED = 64;
+    static constexpr int SIZE_CLASSES = 40;
+
+    class CBuffer
+    {
+    public:
+        CBuffer() = default;
+        CBuffer(const CBuffer&) = delete;
+        CBuffer& operator=(const CBuffer&) = delete;
+
+        CBuffer(CBuffer &&other) noexcept
+            : arena(other.arena), buffer(std::exchange(other.buffer, nullptr)), sizeClass(other.sizeClass)
+        {
+        }
+
+        CBuffer& operator=(CBuffer &&other) noexcept
+        {
+            release();
+            arena = other.arena;
+            buffer = std::exchange(other.buffer, nullptr);
+            sizeClass = other.sizeClass;
+            return *this;
+        }
+
+        ~CBuffer()
+        {
+            release();
+        }
+
+        std::byte *data() const
+        {
+            return buffer;
+        }
+
+    private:
+        friend class CBufferArena;
+
+        CBuffer(CBufferArena *arena, std::byte *buffer, int sizeClass)
+            : arena(arena), buffer(buffer), sizeClass(sizeClass)
+        {
+        }
+
+        void release()
+        {
+            if ( buffer ) arena->release(buffer, sizeClass);
+            buffer = nullptr;
+        }
+
+        CBufferArena *arena = nullptr;
+        std::byte *buffer = nullptr;
+        int sizeClass = 0;
+    };
+
+    CBufferArena() = default;
+    CBufferArena(const CBufferArena&) = delete;
+    CBufferArena& operator=(const CBufferArena&) = delete;
+
+    ~CBufferArena()
+    {
+        for (auto &buffers : freeBuffers)
+            for (std::byte *buffer : buffers)
+                std::free(buffer);
+    }
+
+    //Buffer of at least the given length, its content is undefined
+    CBuffer acquire(size_t length)
+    {
+        if ( !length ) return CBuffer();
+        int sizeClass = (int) std::bit_width(( length - 1 ) / ALIGNMENT);
+        if ( sizeClass >= SIZE_CLASSES ) throw std::bad_alloc();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if ( !freeBuffers[sizeClass].empty() ) {
+                std::byte *buffer = freeBuffers[sizeClass].back();
+                freeBuffers[sizeClass].pop_back();
+                return CBuffer(this, buffer, sizeClass);
+            }
+        }
+        auto *buffer = (std::byte*) std::aligned_alloc(ALIGNMENT, ALIGNMENT << sizeClass);
+        if ( !buffer ) throw std::bad_alloc();
+        return CBuffer(this, buffer, sizeClass);
+    }
+
+private:
+    void release(std::byte *buffer, int sizeClass)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if ( freeBuffers[sizeClass].size() < MAX_POOLED ) {
+                freeBuffers[sizeClass].push_back(buffer);
+                return;
+            }
+        }
+        std::free(buffer);
+    }
+
+    std::mutex mutex;
+    std::array<std::vector<std::byte*>, SIZE_CLASSES> freeBuffers;
+};
+
+//A piece of the caller memory of a vectored request, the same as struct iovec
+struct TIoSegment
+{
+    void *m_Data;
+    size_t m_Length;
+};
+
+//Data of a request spread over caller segments; sectors lying in a single segment are transferred in place,
+//a sector split between two segments is gathered or scattered through a copy
+class CIoSegments
+{
+public:
+    CIoSegments(const TIoSegment *segments, int segmentCount)
+        : segments(segments), segmentCount(std::max(segmentCount, 0))
+    {
+        size_t length = 0;
+        for (int segmentIndex = 0; segmentIndex < this->segmentCount; ++segmentIndex)
+            length += segments[segmentIndex].m_Length;
+        valid = length % SECTOR_SIZE == 0;
+        sectorCount = (int) ( length / SECTOR_SIZE );
+        if ( this->segmentCount <= 1 || !valid ) return;
+
+        //Start of every sector, the single segment of a plain request needs no table
+        positions.reserve(sectorCount);
+        int segmentIndex = 0;
+        size_t offset = 0;
+        for (int sectorIndex = 0; sectorIndex < sectorCount; ++sectorIndex) {
+            for ( ; offset == segments[segmentIndex].m_Length; offset = 0) ++segmentIndex;
+            positions.push_back({ segmentIndex, offset });
+            if ( offset + SECTOR_SIZE > segments[segmentIndex].m_Length ) ++splitSectors;
+            for (size_t remaining = SECTOR_SIZE; remaining; ) {
+                size_t step = std::min(remaining, segments[segmentIndex].m_Length - offset);
+                offset += step;
+                remaining -= step;
+                if ( remaining ) {
+                    ++segmentIndex;
+                    offset = 0;
+                }
+            }
+        }
+    }
+
+    bool isValid() const
+    {
+        return valid;
+    }
+
+    int getSectorCount() const
+    {
+        return sectorCount;
+    }
+
+    //Sectors not lying in a single segment
+    int getSplitSectorCount() const
+    {
+        return splitSectors;
+    }
+
+    //Caller memory of the sectors [firstSector, firstSector + count) if all of them lie in a single segment
+    std::byte *getRun(int firstSector, int count) const
+    {
+        TPosition position = getPosition(firstSector);
+        if ( position.m_Offset + (size_t) count * SECTOR_SIZE > segments[position.m_Segment].m_Length )
+            return nullptr;
+        return (std::byte*) segments[position.m_Segment].m_Data + position.m_Offset;
+    }
+
+    void gather(int sectorIndex, std::byte *destination) const
+    {
+        transfer(sectorIndex, destination, false);
+    }
+
+    void scatter(int sectorIndex, const std::byte *source) const
+    {
+        transfer(sectorIndex, (std::byte*) source, true);
+    }
+
+    //Caller memory of the sectors [firstSector, firstSector + count) as segments of their own
+    std::vector<TIoSegment> slice(int firstSector, int count) const
+    {
+        std::vector<TIoSegment> result;
+        size_t skipped = (size_t) firstSector * SECTOR_SIZE, remaining = (size_t) count * SECTOR_SIZE;
+        for (int segmentIndex = 0; segmentIndex < segmentCount && remaining; ++segmentIndex) {
+            size_t length = segments[segmentIndex].m_Length;
+            if ( skipped >= length ) {
+                skipped -= length;
+                continue;
+            }
+            size_t step = std::min(length - skipped, remaining);
+            result.push_back({ (std::byte*) segments[segmentIndex].m_Data + skipped, step });
+            remaining -= step;
+            skipped = 0;
+        }
+        return result;
+    }
+
+private:
+    struct TPosition
+    {
+        int m_Segment;
+        size_t m_Offset;
+    };
+
+    TPosition getPosition(int sectorIndex) const
+    {
+        if ( segmentCount == 1 ) return { 0, (size_t) sectorIndex * SECTOR_SIZE };
+        return positions[sectorIndex];
+    }
+
+    void transfer(int sectorIndex, std::byte *buffer, bool toCaller) const
+    {
+        TPosition position = getPosition(sectorIndex);
+        for (size_t done = 0; done < SECTOR_SIZE; ++position.m_Segment, position.m_Offset = 0) {
+            const TIoSegment &segment = segments[position.m_Segment];
+            size_t length = std::min(SECTOR_SIZE - done, segment.m_Length - position.m_Offset);
+            std::byte *caller = (std::byte*) segment.m_Data + position.m_Offset;
+            if ( toCaller ) memcpy(caller, buffer + done, length);
+            else memcpy(buffer + done, caller, length);
+            done += length;
+        }
+    }
+
+    const TIoSegment *segments;
+    int segmentCount;
+    int sectorCount = 0;
+    int splitSectors = 0;
+    bool valid = true;
+    std::vector<TPosition> positions;
+};
+
+//Placement of the volume sectors: chunks of a stripe go to the data disks of the stripe in the order given by the
+//parity rotation. The rotation repeats every N stripes, so the disks of every stripe phase are tabled once and
+//requests walk the layout with an iterator that only increments and compares. While a reshape onto one more disk
+//runs, the volume sectors from the reshape boundary on still lie in the layout of the previous device count.
+class CRaidLayout
+{
+    struct TGeometry;
+
+public:
+    //Right rotations move the parity from the first disk to the last one, left rotations the other way; asymmetric
+    //ones keep the data in disk order, symmetric ones start right after the parity disk and wrap around
+    enum TRotation { RIGHT_ASYMMETRIC = 0, RIGHT_SYMMETRIC, LEFT_ASYMMETRIC, LEFT_SYMMETRIC, ROTATION_COUNT };
+
+    //Walks the volume sectors one by one: (disk, row, parity disk) of the current sector
+    class CIterator
+    {
+    public:
+        CIterator(const CRaidLayout &layout, int64_t sectorIndex)
+            : layout(&layout)
+        {
+            seek(sectorIndex);
+        }
+
+        int disk() const { return geometry->dataDisks[phase][dataIndex]; }
+        int row() const { return rowBase + chunkOffset; }
+        int parityDisk() const { return geometry->parityDisks[phase]; }
+
+        CIterator &operator++()
+        {
+            //The reshape boundary switches over to the previous layout
+            if ( ++sectorIndex == zoneEnd ) {
+                seek(sectorIndex);
+                return *this;
+            }
+            if ( ++chunkOffset < layout->chunkSectors ) return *this;
+            chunkOffset = 0;
+            if ( ++dataIndex < geometry->devices - 1 ) return *this;
+            dataIndex = 0;
+            rowBase += layout->chunkSectors;
+            if ( ++phase == geometry->devices ) phase = 0;
+            return *this;
+        }
+
+    private:
+        void seek(int64_t sectorIndex)
+        {
+            geometry = &layout->getGeometry(sectorIndex);
+            this->sectorIndex = sectorIndex;
+            zoneEnd = sectorIndex < layout->boundary ? layout->boundary : INT64_MAX;
+            int64_t chunkIndex = layout->splitChunk(sectorIndex, chunkOffset), stripe = chunkIndex / ( geometry->devices - 1 );
+            dataIndex = (int) ( chunkIndex - stripe * ( geometry->devices - 1 ) );
+            phase = (int) ( stripe % geometry->devices );
+            rowBase = (int) ( stripe * layout->chunkSectors );
+        }
+
+        const CRaidLayout *layout;
+        const TGeometry *geometry = nullptr;
+        int64_t sectorIndex = 0;
+        int64_t zoneEnd = INT64_MAX;
+        int chunkOffset = 0;
+        int dataIndex = 0;
+        int phase = 0;
+        int rowBase = 0;
+    };
+
+    void reset(int devices, int chunkSectors, TRotation rotation)
+    {
+        this->chunkSectors = chunkSectors;
+        this->rotation = rotation;
+        chunkShift = std::has_single_bit((unsigned) chunkSectors) ? std::countr_zero((unsigned) chunkSectors) : -1;
+        current.reset(devices, rotation);
+        boundary = INT64_MAX;
+        boundaryRow = INT_MAX;
+    }
+
+    //Volume sectors from the boundary (a whole stripe of the current layout) on lie in the layout of the previous
+    //device count; the rows of the current layout end at the row of the boundary
+    void setReshape(int previousDevices, int64_t boundary)
+    {
+        previous.reset(previousDevices, rotation);
+        this->boundary = boundary;
+        boundaryRow = (int) ( boundary / ( (int64_t) ( current.devices - 1 ) * chunkSectors ) * chunkSectors );
+    }
+
+    //Maps the volume sector to (disk, row); volume sectors are 64-bit, the rows of a member disk fit into an int
+    std::pair<int, int> locate(int64_t sectorIndex) const
+    {
+        const TGeometry &geometry = getGeometry(sectorIndex);
+        return geometry.locateFunction(*this, geometry, sectorIndex);
+    }
+
+    //All the rows of a stripe (one chunk per disk) share the parity disk
+    int getParityDisk(int rowIndex) const
+    {
+        const TGeometry &geometry = rowIndex < boundaryRow ? current : previous;
+        int stripe = chunkShift >= 0 ? rowIndex >> chunkShift : rowIndex / chunkSectors;
+        return geometry.parityDisks[stripe % geometry.devices];
+    }
+
+    CIterator begin(int64_t sectorIndex) const
+    {
+        return CIterator(*this, sectorIndex);
+    }
+
+private:
+    //Disks of every stripe phase for a device count
+    struct TGeometry
+    {
+        void reset(int devices, TRotation rotation)
+        {
+            this->devices = devices;
+            for (int phase = 0; phase < devices; ++phase) {
+                bool left = rotation == LEFT_ASYMMETRIC || rotation == LEFT_SYMMETRIC;
+                bool symmetric = rotation == RIGHT_SYMMETRIC || rotation == LEFT_SYMMETRIC;
+                int parityDisk = left ? devices - 1 - phase : phase;
+                parityDisks[phase] = parityDisk;
+                for (int dataIndex = 0; dataIndex < devices - 1; ++dataIndex)
+                    dataDisks[phase][dataIndex] = symmetric ? ( parityDisk + 1 + dataIndex ) % devices
+                                                            : dataIndex + ( dataIndex >= parityDisk );
+            }
+
+            //Divisions by a constant device count compile into multiplications
+            switch ( devices ) {
+                case 3: locateFunction = &locateFixed<3>; break;
+                case 4: locateFunction = &locateFixed<4>; break;
+                case 5: locateFunction = &locateFixed<5>; break;
+                case 6: locateFunction = &locateFixed<6>; break;
+                case 8: locateFunction = &locateFixed<8>; break;
+                default: locateFunction = &locateFixed<0>;
+            }
+        }
+
+        int devices = 0;
+        std::array<int8_t, MAX_RAID_DEVICES> parityDisks {};
+        std::array<std::array<int8_t, MAX_RAID_DEVICES>, MAX_RAID_DEVICES> dataDisks {};
+        std::pair<int, int> (*locateFunction)(const CRaidLayout&, const TGeometry&, int64_t) = &locateFixed<0>;
+    };
+
+    const TGeometry &getGeometry(int64_t sectorIndex) const
+    {
+        return sectorIndex < boundary ? current : previous;
+    }
+
+    int64_t splitChunk(int64_t sectorIndex, int &chunkOffset) const
+    {
+        if ( chunkShift >= 0 ) {
+            chunkOffset = (int) ( sectorIndex & ( chunkSectors - 1 ) );
+            return sectorIndex >> chunkShift;
+        }
+        chunkOffset = (int) ( sectorIndex % chunkSectors );
+        return sectorIndex / chunkSectors;
+    }
+
+    //Device count known at compile time, 0 for any
+    template<int Devices>
+    static std::pair<int, int> locateFixed(const CRaidLayout &layout, const TGeometry &geometry, int64_t sectorIndex)
+    {
+        int devices = Devices ? Devices : geometry.devices, chunkOffset;
+        int64_t chunkIndex = layout.splitChunk(sectorIndex, chunkOffset), stripe = chunkIndex / ( devices - 1 );
+        return make_pair((int) geometry.dataDisks[stripe % devices][chunkIndex - stripe * ( devices - 1 )],
+                         (int) ( stripe * layout.chunkSectors + chunkOffset ));
+    }
+
+    int chunkSectors = 1;
+    int chunkShift = 0;
+    TRotation rotation = RIGHT_ASYMMETRIC;
+    TGeometry current;
+    TGeometry previous;
+    int64_t boundary = INT64_MAX;
+    int boundaryRow = INT_MAX;
+};
+
+//Parameters of a new volume
+struct TRaidConfig
+{
+    //Disk sectors covered by a single bit of the write-intent bitmap, 0 for no bitmap (every resync rebuilds the whole disk)
+    int m_BitmapRegion = 1024;
+    //Consecutive volume sectors stored on a single disk before moving to the next one
+    int m_ChunkSectors = 1;
+    //Parity rotation; the default is the placement of volumes created before the rotation was selectable
+    CRaidLayout::TRotation m_Rotation = CRaidLayout::RIGHT_ASYMMETRIC;
+    //Rows covered by a single bit of the allocation bitmap (rounded up to whole chunks), 0 for no tracking (every
+    //row counts as written, the disks are read as they are)
+    int m_AllocationRegion = 0;
+    bool m_ParallelIo = false;
+};
+
+//Volume state stored in the last sector of every disk, the write-intent bitmap lies right in front of it and the
+//allocation bitmap in front of that
+struct Metadata
+{
+    static constexpr uint32_t MAGIC = 0x35444952;
+
+    void resetDisksStatus() {
+        for (int diskIndex = 0; diskIndex < MAX_RAID_DEVICES; ++diskIndex)
+            disksStatus[diskIndex] = false;
+    }
+
+    bool operator==(const Metadata &other) const {
+        for (int i = 0; i < MAX_RAID_DEVICES; ++i) {
+            if ( other.disksStatus[i] != this->disksStatus[i] )
+                return false;
+        }
+        if ( other.raidStatus != this->raidStatus )
+            return false;
+        return other.magic == magic && other.volumeId == volumeId && other.dataSectors == dataSectors
+               && other.bitmapRegion == bitmapRegion && other.bitmapSectors == bitmapSectors && other.chunkSectors == chunkSectors
+               && other.rotation == rotation && other.sectorSize == sectorSize && other.allocationRegion == allocationRegion
+               && other.allocationSectors == allocationSectors && other.reshapeDevices == reshapeDevices
+               && other.reshapeWatermark == reshapeWatermark;
+    };
+
+    void store(std::byte *sector) const {
+        memset(sector, 0, SECTOR_SIZE);
+        memcpy(sector, this, sizeof(*this));
+    }
+
+    //Sectors written before the format carried the magic hold only the disks and RAID status
+    void load(const std::byte *sector) {
+        *this = Metadata();
+        memcpy(this, sector, sizeof(*this));
+        if ( magic != MAGIC ) {
+            magic = volumeId = dataSectors = bitmapRegion = bitmapSectors = chunkSectors = rotation = sectorSize = scrubRow
+                  = allocationRegion = allocationSectors = reshapeDevices = 0;
+            reshapeWatermark = 0;
+        }
+        //Volumes created before the sector size was recorded use 512 byte sectors
+        else if ( !sectorSize )
+            sectorSize = 512;
+    }
+
+    bool disksStatus[MAX_RAID_DEVICES] = { false };
+    int raidStatus = RAID_STOPPED;
+    uint32_t magic = 0;
+    uint32_t volumeId = 0;
+    int dataSectors = 0;
+    int bitmapRegion = 0;
+    int bitmapSectors = 0;
+    int chunkSectors = 0;
+    int rotation = CRaidLayout::RIGHT_ASYMMETRIC;
+    int sectorSize = 0;
+    //Row the parity scrub continues from; progress only, not compared between the disks
+    int scrubRow = 0;
+    int allocationRegion = 0;
+    int allocationSectors = 0;
+    //Reshape onto one more disk: the previous device count (0 if none runs) and the volume sector from which on the
+    //data still lie in the previous layout
+    int reshapeDevices = 0;
+    int64_t reshapeWatermark = 0;
+};
+static_assert(sizeof(Metadata) <= SECTOR_SIZE, "Metadata has to fit into a single sector");
+
+//Reads, writes, resync and reshape steps may run from any number of threads at once; start, stop and the setters
+//are expected to be called while no request is running
+class CRaidVolume
+{
+public:
+    CRaidVolume()
+    {
+        stats.attachTracer(&tracer);
+    }
+
+    //Reads abandoned by hedging may still be running and counting into the statistics
+    ~CRaidVolume()
+    {
+        stopScrubThread();
+        stopGatherThread();
+        ioWorkers.stop();
+    }
+
+
+    static bool create ( const TBlkDev& dev, const TRaidConfig& config = TRaidConfig() )
+    {
+        //Initialize standard metadata
+        Metadata data;
+        data.magic = Metadata::MAGIC;
+        data.volumeId = std::random_device()();
+        data.bitmapRegion = std::max(config.m_BitmapRegion, 0);
+        data.bitmapSectors = CRegionBitmap::getStoredSectors(data.bitmapRegion, dev.m_Sectors - 1);
+        data.chunkSectors = config.m_ChunkSectors;
+        if ( data.chunkSectors <= 0 ) return false;
+        data.rotation = config.m_Rotation;
+        if ( data.rotation < 0 || data.rotation >= CRaidLayout::ROTATION_COUNT ) return false;
+        data.sectorSize = SECTOR_SIZE;
+        //Allocation regions are whole stripes, so that a region is a contiguous range of volume sectors
+        data.allocationRegion = ( std::max(config.m_AllocationRegion, 0) + data.chunkSectors - 1 ) / data.chunkSectors * data.chunkSectors;
+        data.allocationSectors = CRegionBitmap::getStoredSectors(data.allocationRegion, dev.m_Sectors - 1);
+
+        //Data area holds whole chunks only, the rest of the disk up to the bitmaps stays unused
+        data.dataSectors = ( dev.m_Sectors - 1 - data.bitmapSectors - data.allocationSectors ) / data.chunkSectors * data.chunkSectors;
+        if ( data.dataSectors <= 0 ) return false;
+
+        //Some variables
+        std::byte metadataSector[SECTOR_SIZE];
+        std::vector<std::byte> bitmapSectors(std::max(data.bitmapSectors, data.allocationSectors) * SECTOR_SIZE);
+        std::vector<TDiskRequest> requests;
+        CDiskWorkers workers;
+        data.store(metadataSector);
+
+        //Write this metadata to each disk at the last sector, clean write-intent bitmap in front of it and an empty
+        //allocation bitmap (nothing written yet) in front of that
+        for (int diskIndex = 0; diskIndex < dev.m_Devices; ++diskIndex) {
+            int bitmapStart = dev.m_Sectors - 1 - data.bitmapSectors;
+            if ( data.allocationSectors )
+                requests.push_back({ diskIndex, bitmapStart - data.allocationSectors, data.allocationSectors, nullptr, bitmapSectors.data() });
+            if ( data.bitmapSectors )
+                requests.push_back({ diskIndex, bitmapStart, data.bitmapSectors, nullptr, bitmapSectors.data() });
+            requests.push_back({ diskIndex, dev.m_Sectors - 1, 1, nullptr, metadataSector });
+        }
+        if ( config.m_ParallelIo ) workers.start(dev.m_Devices);
+        runRequests(dev, workers, requests);
+
+        for (const auto &request : requests)
+            if ( !request.succeeded() )
+                return false;
+        return true;
+    }
+
+
+    int start ( const TBlkDev& dev )
+    {
+        //Check current status
+        if ( getRaidStatus() != RAID_STOPPED ) return getRaidStatus();
+
+        //Some variables
+        Metadata disksMetadata[MAX_RAID_DEVICES];
+        std::byte buffer[SECTOR_SIZE]{};
+
+        //Copy the device
+        stopScrubThread();
+        this->device = dev;
+        if ( ioWorkers.workerCount() ) ioWorkers.start(dev.m_Devices);
+
+        //Mark all disks as working ones
+        systemState.resetDisksStatus();
+        rebuildDiskIndex = -1;
+        rebuildWatermark = 0;
+
+        //Collect metadata from disks and mark unavailable ones
+        for (int diskIndex = 0; diskIndex < dev.m_Devices; ++diskIndex) {
+            if ( deviceRead(diskIndex, dev.m_Sectors - 1, buffer, 1) != 1 ) {
+                systemState.disksStatus[diskIndex] = true;
+                continue;
+            }
+            disksMetadata[diskIndex].load(buffer);
+        }
+        
+        //Mark all disks with wrong metadata
+        Metadata standardMetadata = getStandardMetadata(disksMetadata);
+        markWrongMetadataDisks(disksMetadata, standardMetadata);
+        //A volume of another sector size has all its rows elsewhere, it is left alone
+        if ( standardMetadata.magic == Metadata::MAGIC && standardMetadata.sectorSize != SECTOR_SIZE )
+            return RAID_STOPPED;
+        //A volume in the middle of a reshape lies on the disks it is being reshaped onto
+        if ( standardMetadata.magic == Metadata::MAGIC && standardMetadata.reshapeDevices
+             && standardMetadata.reshapeDevices != dev.m_Devices - 1 )
+            return RAID_STOPPED;
+
+        //Take over the volume layout
+        loadLayout(standardMetadata);
+        if ( scrub.m_Enabled ) scrubThread = std::thread(&CRaidVolume::scrubLoop, this);
+        
+        //Check the RAID system status 
+        publishState(RAID_STOPPED);
+        if ( countFailedDisks() > 1 ) return publishState(RAID_FAILED);
+        else if ( countFailedDisks() == 1) return publishState(RAID_DEGRADED);
+        return publishState(RAID_OK);
+    }
+
+
+    int stop ()
+    {
+        //Buffered writes go out first, the scrub position is kept for the next start
+        flushGathered(false);
+        stopScrubThread();
+        systemState.scrubRow = scrubRow;
+
+        //A reshape still clearing the added disk starts over with addDisk, one moving the data continues after start
+        if ( !systemState.reshapeDevices ) reshaping = false;
+
+        //Insert current metadata into all the disks
+        flushIntentBitmap();
+        storeMetadata();
+
+        //Cached content may be stale once somebody else touches the disks
+        stripeCache.clear();
+
+        //Update the status
+        return publishState(RAID_STOPPED);
+    }
+
+
+    int resync ()
+    {
+        auto begin = std::chrono::steady_clock::now();
+        CIoTracer::CRequest trace(tracer);
+        std::lock_guard<std::mutex> lock(resyncMutex);
+        int startWatermark = rebuildWatermark;
+
+        //Rebuild step by step until the disk is done or it refuses to take the data
+        while ( getRaidStatus() == RAID_DEGRADED ) {
+            int watermark = rebuildWatermark;
+            rebuildStep(systemState.dataSectors);
+            if ( getRaidStatus() == RAID_DEGRADED && rebuildWatermark <= watermark )
+                break;
+        }
+        trace.record(CIoTracer::RESYNC, startWatermark, 0, getRaidStatus() == RAID_OK, begin);
+        return getRaidStatus();
+    }
+
+
+    //Rebuilds up to sectorCount next sectors of the failed disk and returns; foreground reads and writes may run
+    //between the steps, the part of the disk below the watermark is already usable for them
+    int resyncStep ( int sectorCount = RESYNC_STEP_SECTORS )
+    {
+        auto begin = std::chrono::steady_clock::now();
+        CIoTracer::CRequest trace(tracer);
+        std::lock_guard<std::mutex> lock(resyncMutex);
+        int watermark = rebuildWatermark, result = rebuildStep(sectorCount);
+        trace.record(CIoTracer::RESYNC, watermark, sectorCount, result != RAID_FAILED, begin);
+        return result;
+    }
+
+
+    struct TResyncProgress
+    {
+        int m_DiskIndex;
+        int m_Watermark;
+        int m_Sectors;
+    };
+
+    //Disk being rebuilt (-1 if none) and the count of its sectors restored so far
+    TResyncProgress resyncProgress () const
+    {
+        return { rebuildDiskIndex, rebuildWatermark, systemState.dataSectors };
+    }
+
+
+    //Upper bound of the rebuild bandwidth in sectors per second, 0 for no limit
+    void setResyncRate ( int sectorsPerSecond )
+    {
+        std::lock_guard<std::mutex> lock(resyncMutex);
+        resyncRate = sectorsPerSecond;
+        resyncStartTime = std::chrono::steady_clock::now();
+        resyncThrottledSectors = 0;
+    }
+
+
+    //Stripe-wide operations are fanned out to one I/O thread per member disk
+    void setParallelIo ( bool enabled )
+    {
+        if ( !enabled ) ioWorkers.stop();
+        else ioWorkers.start(std::max(device.m_Devices, 1));
+    }
+
+
+    struct THedgeConfig
+    {
+        bool m_Enabled = false;
+        //Time a disk gets before its sectors are reconstructed from the others as well, 0 for the given percentile
+        //of the disk read latencies (never below m_MinDelayUs)
+        int m_DelayUs = 0;
+        double m_Percentile = 0.95;
+        int m_MinDelayUs = 200;
+        //Reads in a row lost by the disk after which it is read through the parity only, for m_DemoteUs
+        int m_DemoteAfter = 8;
+        int m_DemoteUs = 1000000;
+    };
+
+    //In RAID_OK state a read which the disk does not finish in time is reconstructed from the other disks in parallel
+    //and the first result is used; a disk losing repeatedly is demoted, i.e. read through the parity for a while,
+    //without being failed. Hedging runs on the parallel I/O threads, so it turns them on.
+    void setHedging ( const THedgeConfig &config )
+    {
+        hedge = config;
+        for (int diskIndex = 0; diskIndex < MAX_RAID_DEVICES; ++diskIndex) {
+            slowReads[diskIndex] = 0;
+            demotedUntil[diskIndex] = 0;
+        }
+        if ( hedge.m_Enabled && !ioWorkers.workerCount() ) setParallelIo(true);
+    }
+
+
+    struct TGatherConfig
+    {
+        bool m_Enabled = false;
+        //Incomplete stripes buffered at most, the oldest ones are written out beyond that
+        int m_MaxStripes = 64;
+        //Age after which an incomplete stripe is written out, 0 for never (only flush and stop write it then)
+        int m_DelayUs = 2000;
+    };
+
+    //Writes not covering a whole stripe are buffered and merged per stripe; a stripe goes to the disks once it is
+    //complete (as a full stripe, without reading the parity), too old or pushed out by newer ones. Reads see the
+    //buffered data. Buffered data does not survive a volume failure, flush and stop write it out.
+    void setWriteGather ( const TGatherConfig &config )
+    {
+        stopGatherThread();
+        flushGathered(false);
+        gather = config;
+        if ( gather.m_Enabled && gather.m_DelayUs > 0 ) gatherThread = std::thread(&CRaidVolume::gatherLoop, this);
+    }
+
+
+    //Writes out every buffered stripe; false if any buffered write failed since the previous flush
+    bool flush ()
+    {
+        flushGathered(false);
+        return !gatherFailed.exchange(false);
+    }
+
+
+    //Forgets the data of the allocation regions lying completely within the sectors: they read as zeros again and
+    //resync and scrub skip them. Sectors of regions covered only partly keep their data.
+    bool discard ( int64_t secNr, int secCnt )
+    {
+        if ( getRaidStatus() == RAID_STOPPED || getRaidStatus() == RAID_FAILED )
+            return false;
+        if ( secCnt <= 0 || !allocationBitmap.isEnabled() )
+            return secCnt >= 0;
+        if ( secNr < 0 || secNr + secCnt > size() )
+            return false;
+        flushGathered(false);
+
+        //Regions are rows, which hold other sectors in the two layouts of a reshape
+        std::shared_lock<std::shared_mutex> reshapeGuard(reshapeMutex);
+        if ( reshaping )
+            return true;
+
+        //Whole stripes of the range, only those map onto whole rows
+        int64_t stripeSectors = (int64_t) std::max(device.m_Devices - 1, 1) * systemState.chunkSectors;
+        int firstRow = (int) ( ( secNr + stripeSectors - 1 ) / stripeSectors * systemState.chunkSectors );
+        int endRow = secNr + secCnt == size() ? systemState.dataSectors
+                                              : (int) ( ( secNr + secCnt ) / stripeSectors * systemState.chunkSectors );
+        if ( firstRow >= endRow )
+            return true;
+
+        int discarded;
+        {
+            CRowLocks::CGuard rows(rowLocks, firstRow, endRow - 1, true);
+            std::lock_guard<std::mutex> lock(allocationMutex);
+            discarded = allocationBitmap.clearRange(firstRow, endRow - 1);
+        }
+        stats.countAllocation(0, discarded);
+        flushAllocationBitmap();
+        return true;
+    }
+
+
+    //Online capacity expansion: the disk with the next index (dev has one device more than the volume, the disks are of
+    //the same size) joins the volume. reshapeStep first clears the data rows of the new disk, then moves the volume
+    //sectors batch by batch from the layout without it into the layout with it, parity included; reads and writes
+    //run between the steps and wait only for the batch being moved. The moved part is stored in the metadata after every
+    //batch, so a reshape continues after start with the new disks, even if the volume was not stopped. The volume
+    //grows once the last batch is moved.
+    bool addDisk ( const TBlkDev &dev )
+    {
+        if ( getRaidStatus() != RAID_OK || reshaping || dev.m_Devices != device.m_Devices + 1
+             || dev.m_Devices > MAX_RAID_DEVICES || dev.m_Sectors != device.m_Sectors )
+            return false;
+
+        //Buffered writes go out first; requests still running finish before the reshape starts, later ones see it
+        //(and do not hedge), reads abandoned by hedging are waited for
+        flushGathered(false);
+        std::lock_guard<std::mutex> lock(reshapeStepMutex);
+        {
+            std::unique_lock<std::shared_mutex> reshapeLock(reshapeMutex);
+            reshapeDevice = dev;
+            reshapeClearedRows = 0;
+            reshaping = true;
+        }
+        std::unique_lock<std::mutex> abandonedLock(abandonedMutex);
+        abandonedDone.wait(abandonedLock, [this] { return abandonedRows.empty(); });
+        return true;
+    }
+
+
+    //Clears or moves up to rowCount next rows (rounded up to whole stripes) and returns; in other than RAID_OK state
+    //nothing moves until resync brings the volume back
+    int reshapeStep ( int rowCount = RESHAPE_STEP_ROWS )
+    {
+        std::lock_guard<std::mutex> lock(reshapeStepMutex);
+        if ( !reshaping || getRaidStatus() != RAID_OK )
+            return getRaidStatus();
+        return systemState.reshapeDevices ? moveReshapeRows(rowCount) : clearReshapeRows(rowCount);
+    }
+
+
+    //Runs the reshape to its end, false if it stops short of it
+    bool reshape ()
+    {
+        while ( reshaping ) {
+            TReshapeProgress progress = reshapeProgress();
+            if ( reshapeStep() != RAID_OK && progress == reshapeProgress() )
+                return false;
+        }
+        return getRaidStatus() == RAID_OK;
+    }
+
+
+    struct TReshapeProgress
+    {
+        //Disks of the volume and the disks being reshaped onto, the same if no reshape runs
+        int m_Devices;
+        int m_NewDevices;
+        //Data rows of the new disk cleared so far, then the volume sectors moved so far, of all of them
+        int m_ClearedRows;
+        int m_Rows;
+        int64_t m_MovedSectors;
+        int64_t m_Sectors;
+
+        bool operator==(const TReshapeProgress &other) const = default;
+    };
+
+    TReshapeProgress reshapeProgress () const
+    {
+        std::lock_guard<std::mutex> lock(reshapeStepMutex);
+        if ( !reshaping ) return { device.m_Devices, device.m_Devices, 0, 0, 0, 0 };
+        int newDevices = systemState.reshapeDevices ? device.m_Devices : reshapeDevice.m_Devices;
+        return { newDevices - 1, newDevices, systemState.reshapeDevices ? systemState.dataSectors : reshapeClearedRows,
+                 systemState.dataSectors, systemState.reshapeDevices ? systemState.reshapeWatermark : 0,
+                 (int64_t) ( newDevices - 1 ) * systemState.dataSectors };
+    }
+
+
+    struct TScrubConfig
+    {
+        //Background scrubbing, passes over the volume one after another
+        bool m_Enabled = false;
+        //Rows checked per second at most, 0 for no limit
+        int m_RowsPerSecond = 0;
+        //Parity not matching the data of its row is rewritten from the data
+        bool m_Repair = false;
+        //Pause before every batch of the background scrub, extended while foreground requests keep coming up to
+        //m_MaxYieldUs
+        int m_YieldUs = 1000;
+        int m_MaxYieldUs = 100000;
+    };
+
+    struct TScrubProgress
+    {
+        int m_Row;
+        int m_Rows;
+        int m_Passes;
+    };
+
+    //Parity scrub: in RAID_OK state the rows are read from all the disks, rows whose XOR is not zero are counted as
+    //mismatches (statsSnapshot) and with m_Repair their parity is rewritten. The position is stored by stop, so a
+    //scrub continues after start where it ended.
+    void setScrub ( const TScrubConfig &config )
+    {
+        stopScrubThread();
+        std::lock_guard<std::mutex> lock(scrubMutex);
+        scrub = config;
+        scrubStartTime = std::chrono::steady_clock::now();
+        scrubThrottledRows = 0;
+        if ( scrub.m_Enabled && getRaidStatus() != RAID_STOPPED ) scrubThread = std::thread(&CRaidVolume::scrubLoop, this);
+    }
+
+
+    //Checks up to rowCount next rows and returns; the scrub wraps around at the end of the disks
+    int scrubStep ( int rowCount = SCRUB_STEP_ROWS )
+    {
+        std::lock_guard<std::mutex> lock(scrubMutex);
+        return scrubRows(rowCount, true);
+    }
+
+
+    TScrubProgress scrubProgress () const
+    {
+        return { scrubRow, systemState.dataSectors, scrubPasses };
+    }
+
+
+    void setCacheCapacity ( size_t sectors )
+    {
+        stripeCache.setCapacity(sectors);
+    }
+
+
+    CStripeCache::TStats cacheStats () const
+    {
+        return stripeCache.getStats();
+    }
+
+
+    int status () const
+    {
+        return getRaidStatus();
+    }
+
+
+    //Grows once a reshape is complete
+    int64_t size () const
+    {
+        return volumeSectors;
+    }
+
+
+    bool read ( int64_t secNr, void * data, int secCnt )
+    {
+        auto begin = std::chrono::steady_clock::now();
+        CIoTracer::CRequest trace(tracer);
+        TIoSegment segment { data, (size_t) std::max(secCnt, 0) * SECTOR_SIZE };
+        CIoSegments segments(&segment, 1);
+        bool result = gather.m_Enabled ? gatheredRead(secNr, segments, secCnt) : readRequest(secNr, segments, secCnt);
+        stats.countRequest(false, secCnt, result, begin);
+        trace.record(CIoTracer::READ, secNr, secCnt, result, begin);
+        return result;
+    }
+
+
+    bool write ( int64_t secNr, const void * data, int secCnt )
+    {
+        auto begin = std::chrono::steady_clock::now();
+        CIoTracer::CRequest trace(tracer);
+        TIoSegment segment { const_cast<void*>(data), (size_t) std::max(secCnt, 0) * SECTOR_SIZE };
+        CIoSegments segments(&segment, 1);
+        bool result = gather.m_Enabled ? gatherWrite(secNr, segments, secCnt) : writeRequest(secNr, segments, secCnt);
+        stats.countRequest(true, secCnt, result, begin);
+        trace.record(CIoTracer::WRITE, secNr, secCnt, result, begin);
+        return result;
+    }
+
+
+    //Vectored read and write: the request data lies in the segments one after another, their total length has to be
+    //a multiple of SECTOR_SIZE (a sector may be split between segments). Disk runs are transferred straight from and
+    //into the segments wherever the layout keeps them contiguous.
+    bool readv ( int64_t secNr, const TIoSegment * segments, int segmentCount )
+    {
+        auto begin = std::chrono::steady_clock::now();
+        CIoTracer::CRequest trace(tracer);
+        CIoSegments data(segments, segmentCount);
+        bool result = data.isValid() && ( gather.m_Enabled ? gatheredRead(secNr, data, data.getSectorCount())
+                                                           : readRequest(secNr, data, data.getSectorCount()) );
+        stats.countRequest(false, data.getSectorCount(), result, begin);
+        trace.record(CIoTracer::READ, secNr, data.getSectorCount(), result, begin);
+        return result;
+    }
+
+
+    bool writev ( int64_t secNr, const TIoSegment * segments, int segmentCount )
+    {
+        auto begin = std::chrono::steady_clock::now();
+        CIoTracer::CRequest trace(tracer);
+        CIoSegments data(segments, segmentCount);
+        bool result = data.isValid() && ( gather.m_Enabled ? gatherWrite(secNr, data, data.getSectorCount())
+                                                           : writeRequest(secNr, data, data.getSectorCount()) );
+        stats.countRequest(true, data.getSectorCount(), result, begin);
+        trace.record(CIoTracer::WRITE, secNr, data.getSectorCount(), result, begin);
+        return result;
+    }
+
+
+    //Counters of the volume and its disks, together with the resync progress
+    CRaidStats::TSnapshot statsSnapshot () const
+    {
+        CRaidStats::TSnapshot snapshot = stats.getSnapshot();
+        TResyncProgress progress = resyncProgress();
+        snapshot.m_ResyncDisk = progress.m_DiskIndex;
+        snapshot.m_ResyncWatermark = progress.m_Watermark;
+        snapshot.m_ResyncSectors = progress.m_Sectors;
+        return snapshot;
+    }
+
+
+    void resetStats ()
+    {
+        stats.reset();
+    }
+
+
+    //Records every read, write and resync call together with the backend calls it causes into the file (replaced)
+    //until stopTrace; the header describes the geometry of the volume for a replay. False if the file cannot be written.
+    bool startTrace ( const char * fileName )
+    {
+        CIoTracer::THeader header;
+        header.m_Devices = device.m_Devices;
+        header.m_DiskSectors = device.m_Sectors;
+        header.m_ChunkSectors = systemState.chunkSectors;
+        header.m_Rotation = systemState.rotation;
+        header.m_AllocationRegion = systemState.allocationRegion;
+        return tracer.open(fileName, header);
+    }
+
+
+    //False if any part of the trace could not be written
+    bool stopTrace ()
+    {
+        return tracer.close();
+    }
+
+
+protected:
+    bool readRequest ( int64_t secNr, const CIoSegments &data, int secCnt )
+    {
+        //Status check
+        if ( getRaidStatus() == RAID_STOPPED || getRaidStatus() == RAID_FAILED )
+            return false;
+        if ( secCnt <= 0 )
+            return true;
+        //Sectors past the end would map onto rows of the bitmap and the metadata
+        if ( secNr < 0 || secNr + secCnt > size() )
+            return false;
+
+        //A request crossing the reshape boundary is split there, every part lies in a single layout
+        std::shared_lock<std::shared_mutex> reshapeGuard(reshapeMutex);
+        if ( int headCount = getReshapeSplit(secNr, secCnt) ) {
+            std::vector<TIoSegment> head = data.slice(0, headCount), tail = data.slice(headCount, secCnt - headCount);
+            return readZone(secNr, CIoSegments(head.data(), (int) head.size()), headCount)
+                   && readZone(secNr + headCount, CIoSegments(tail.data(), (int) tail.size()), secCnt - headCount);
+        }
+        return readZone(secNr, data, secCnt);
+    }
+
+    //Part of a read lying in a single layout
+    bool readZone ( int64_t secNr, const CIoSegments &data, int secCnt )
+    {
+        //Writes to the same rows wait until the read is done
+        auto [firstRow, lastRow] = getRowRange(secNr, secCnt);
+        CRowLocks::CGuard rows(rowLocks, firstRow, lastRow, false);
+        std::vector<bool> unwritten = getUnwrittenRegions(firstRow, lastRow);
+        static const std::byte zeroSector[SECTOR_SIZE] = {};
+
+        //Some variables
+        std::vector<std::pair<int, int>> diskPlans[MAX_RAID_DEVICES], diskRanges[MAX_RAID_DEVICES];
+        std::vector<TDiskRequest> runs;
+        std::vector<bool> runMissing, runDirect;
+        size_t diskRuns[MAX_RAID_DEVICES + 1] = {};
+        CBufferArena::CBuffer buffer;
+        size_t bufferSize = 0;
+
+        //Plan the request per disk: (disk sector, sector offset in the request); disk sectors come out ascending.
+        //Sectors of regions never written read as zeros and need no disk at all.
+        CRaidLayout::CIterator position = layout.begin(secNr);
+        int regionRows = allocationBitmap.getRegionSectors(), unwrittenCount = 0;
+        for (int offset = 0; offset < secCnt; ++offset, ++position) {
+            if ( !unwritten.empty() && unwritten[position.row() / regionRows - firstRow / regionRows] ) {
+                data.scatter(offset, zeroSector);
+                ++unwrittenCount;
+                continue;
+            }
+            diskPlans[position.disk()].emplace_back(position.row(), offset);
+        }
+        if ( unwrittenCount ) stats.countUnwrittenRead(unwrittenCount);
+
+        //Split the plans into ranges (first sector, sector count), every range is read with a single call; a range may
+        //step over a single unrequested sector (typically the parity of the row), reading it is cheaper than another call
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+            const auto &plan = diskPlans[diskIndex];
+            for (size_t runStart = 0, runEnd; runStart < plan.size(); runStart = runEnd) {
+                int firstSector = plan[runStart].first;
+                for (runEnd = runStart + 1; runEnd < plan.size() && plan[runEnd].first - firstSector < MAX_BATCH_SECTORS
+                                            && plan[runEnd].first - plan[runEnd - 1].first <= 2; ++runEnd);
+                diskRanges[diskIndex].emplace_back(firstSector, plan[runEnd - 1].first - firstSector + 1);
+            }
+        }
+
+        //Rows a disk cannot provide are fetched from all the other disks in the same batch, so that they get
+        //reconstructed from the buffers of this request instead of reading the rows once again
+        size_t ownRanges[MAX_RAID_DEVICES];
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex)
+            ownRanges[diskIndex] = diskRanges[diskIndex].size();
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex)
+            for (size_t rangeIndex = 0; rangeIndex < ownRanges[diskIndex]; ++rangeIndex) {
+                auto range = diskRanges[diskIndex][rangeIndex];
+                if ( isDiskReadable(diskIndex, range.first, range.second) ) continue;
+                for (int otherDiskIndex = 0; otherDiskIndex < device.m_Devices; ++otherDiskIndex)
+                    if ( otherDiskIndex != diskIndex )
+                        diskRanges[otherDiskIndex].push_back(range);
+            }
+
+        //Merge the ranges of every disk into runs: overlapping ranges always, close ones up to the batch size
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+            auto &ranges = diskRanges[diskIndex];
+            const auto &plan = diskPlans[diskIndex];
+            std::sort(ranges.begin(), ranges.end());
+            diskRuns[diskIndex] = runs.size();
+            for (size_t rangeIndex = 0, planIndex = 0; rangeIndex < ranges.size(); ) {
+                int firstSector = ranges[rangeIndex].first, endSector = firstSector + ranges[rangeIndex].second;
+                for (++rangeIndex; rangeIndex < ranges.size() && ( ranges[rangeIndex].first < endSector
+                                   || ( ranges[rangeIndex].first <= endSector + 1
+                                        && ranges[rangeIndex].first + ranges[rangeIndex].second - firstSector <= MAX_BATCH_SECTORS ) ); ++rangeIndex)
+                    endSector = std::max(endSector, ranges[rangeIndex].first + ranges[rangeIndex].second);
+
+                //A run made of requested sectors only, which lie one after another in a caller segment, is read in place
+                size_t planEnd;
+                for ( ; planIndex < plan.size() && plan[planIndex].first < firstSector; ++planIndex);
+                for (planEnd = planIndex; planEnd < plan.size() && plan[planEnd].first < endSector; ++planEnd);
+                std::byte *direct = nullptr;
+                if ( (int) ( planEnd - planIndex ) == endSector - firstSector
+                     && plan[planEnd - 1].second - plan[planIndex].second == endSector - firstSector - 1 )
+                    direct = data.getRun(plan[planIndex].second, endSector - firstSector);
+                planIndex = planEnd;
+
+                runs.push_back({ diskIndex, firstSector, endSector - firstSector, direct ? direct : (std::byte*) bufferSize });
+                runDirect.push_back(direct != nullptr);
+                if ( !direct ) bufferSize += ( endSector - firstSector ) * SECTOR_SIZE;
+            }
+        }
+        diskRuns[device.m_Devices] = runs.size();
+        buffer = bufferArena.acquire(bufferSize);
+        for (size_t runIndex = 0; runIndex < runs.size(); ++runIndex) {
+            TDiskRequest &run = runs[runIndex];
+            if ( !runDirect[runIndex] ) run.readDestination = buffer.data() + (size_t) run.readDestination;
+            run.completed = !isDiskReadable(run.diskIndex, run.sectorIndex, run.sectorCount);
+            runMissing.push_back(run.completed);
+        }
+
+        //Read all the disks at once, then check the system state run by run
+        if ( isHedging() ) hedgedRequests(runs);
+        else backendRequests(runs);
+        for (size_t runIndex = 0; runIndex < runs.size(); ++runIndex) {
+            const TDiskRequest &run = runs[runIndex];
+            if ( !runMissing[runIndex] && !completeRead(run.diskIndex, run.sectorIndex, run.readDestination, run.sectorCount, run.succeeded()) )
+                return false;
+        }
+
+        //Missing runs are folded from the same rows of the other disks; if those are not at hand, the rows are
+        //read or reconstructed the usual way
+        for (size_t runIndex = 0; runIndex < runs.size(); ++runIndex) {
+            if ( !runMissing[runIndex] ) continue;
+            TDiskRequest &run = runs[runIndex];
+            const std::byte *sources[MAX_RAID_DEVICES];
+            int sourceCount = 0;
+            for (int otherDiskIndex = 0; otherDiskIndex < device.m_Devices; ++otherDiskIndex) {
+                if ( otherDiskIndex == run.diskIndex ) continue;
+                for (size_t sourceIndex = diskRuns[otherDiskIndex]; sourceIndex < diskRuns[otherDiskIndex + 1]; ++sourceIndex) {
+                    const TDiskRequest &source = runs[sourceIndex];
+                    if ( runMissing[sourceIndex] || source.sectorIndex > run.sectorIndex
+                         || source.sectorIndex + source.sectorCount < run.sectorIndex + run.sectorCount ) continue;
+                    sources[sourceCount++] = source.readDestination + ( run.sectorIndex - source.sectorIndex ) * SECTOR_SIZE;
+                    break;
+                }
+            }
+            if ( sourceCount != device.m_Devices - 1 ) {
+                if ( !checkedRead(run.diskIndex, run.sectorIndex, run.readDestination, run.sectorCount) )
+                    return false;
+                continue;
+            }
+            stats.countReconstruction(run.sectorCount);
+            CXorEngine::xorSources(run.readDestination, sources, sourceCount, run.sectorCount * SECTOR_SIZE);
+        }
+
+        //Scatter the data of the runs not read in place into the reading destination
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+            size_t runIndex = diskRuns[diskIndex];
+            for (auto [diskSector, offset] : diskPlans[diskIndex]) {
+                while ( runs[runIndex].sectorIndex + runs[runIndex].sectorCount <= diskSector )
+                    ++runIndex;
+                if ( !runDirect[runIndex] )
+                    data.scatter(offset, runs[runIndex].readDestination + ( diskSector - runs[runIndex].sectorIndex ) * SECTOR_SIZE);
+            }
+        }
+        return true;
+    }
+
+    bool writeRequest ( int64_t secNr, const CIoSegments &data, int secCnt )
+    {
+        //Status check
+        if ( getRaidStatus() == RAID_STOPPED || getRaidStatus() == RAID_FAILED )
+            return false;
+        if ( secCnt <= 0 )
+            return true;
+        if ( secNr < 0 || secNr + secCnt > size() )
+            return false;
+
+        std::shared_lock<std::shared_mutex> reshapeGuard(reshapeMutex);
+        if ( int headCount = getReshapeSplit(secNr, secCnt) ) {
+            std::vector<TIoSegment> head = data.slice(0, headCount), tail = data.slice(headCount, secCnt - headCount);
+            return writeZone(secNr, CIoSegments(head.data(), (int) head.size()), headCount)
+                   && writeZone(secNr + headCount, CIoSegments(tail.data(), (int) tail.size()), secCnt - headCount);
+        }
+        return writeZone(secNr, data, secCnt);
+    }
+
+    //Part of a write lying in a single layout
+    bool writeZone ( int64_t secNr, const CIoSegments &data, int secCnt )
+    {
+        //The rows are written by a single request at a time; rows being rebuilt by resync right now are not
+        //written until the rebuild passes them. The first write of a region zeroes its rows, so all of them are
+        //locked then.
+        auto [firstRow, lastRow] = getRowRange(secNr, secCnt);
+        std::optional<CRowLocks::CGuard> rows;
+        std::pair<int, int> locked;
+        while ( true ) {
+            locked = getAllocationRange(firstRow, lastRow);
+            rows.emplace(rowLocks, locked.first, locked.second, true);
+            std::unique_lock<std::mutex> windowLock(rebuildWindowMutex);
+            if ( !isInRebuildWindow(locked.first, locked.second) && getAllocationRange(firstRow, lastRow) == locked ) break;
+            rows.reset();
+            rebuildWindowChanged.wait(windowLock, [this, locked] { return !isInRebuildWindow(locked.first, locked.second); });
+        }
+
+        //Reads abandoned by hedging may still be reading the rows
+        {
+            std::unique_lock<std::mutex> abandonedLock(abandonedMutex);
+            abandonedDone.wait(abandonedLock, [this, locked] {
+                return std::none_of(abandonedRows.begin(), abandonedRows.end(), [locked](const auto &rows) {
+                    return rows.first <= locked.second && locked.first <= rows.second;
+                });
+            });
+        }
+        if ( !allocateRegions(secNr, secCnt, firstRow, lastRow) )
+            return false;
+
+        //A disk missing the data gets its regions recorded before the data lands; the same applies once some
+        //disk fails during the request
+        markWriteIntent(firstRow, lastRow);
+        bool result = writeSectors(secNr, data, secCnt);
+        markWriteIntent(firstRow, lastRow);
+        return result;
+    }
+
+    //Rebuild step of resyncStep, resyncMutex is held by the caller
+    int rebuildStep(int sectorCount)
+    {
+        //Check the status
+        if ( getRaidStatus() != RAID_DEGRADED )
+            return getRaidStatus();
+        std::shared_lock<std::shared_mutex> reshapeGuard(reshapeMutex);
+
+        //Start a new rebuild; a returning member only misses the regions written while it was away
+        if ( rebuildDiskIndex != getFailedDiscIndex() || rebuildWatermark == 0 ) {
+            rebuildWatermark = 0;
+            rebuildDiskIndex = getFailedDiscIndex();
+            resyncStartTime = std::chrono::steady_clock::now();
+            resyncThrottledSectors = 0;
+            if ( !isReturningMember(rebuildDiskIndex) ) {
+                std::lock_guard<std::mutex> lock(bitmapMutex);
+                intentBitmap.setAll();
+            }
+            flushIntentBitmap();
+        }
+
+        //Some variables
+        std::vector<std::byte> readBuffer, parityBuffers[2];
+        int watermark = rebuildWatermark, diskIndex = rebuildDiskIndex;
+        int stepEnd = (int) std::min<int64_t>(systemState.dataSectors, (int64_t) watermark + sectorCount);
+        int nextSector = watermark, pendingSector = 0, pendingCount = 0, parityBufferIndex = 0;
+
+        //Writers of the rows of the step are drained and kept away until the watermark passes their rows
+        openRebuildWindow(watermark, stepEnd);
+
+        //Pipeline over batches: reads of the next batch run together with the write of the previous reconstructed one
+        while ( true ) {
+            //Regions the disk has not missed and regions never written are skipped
+            int batchCount;
+            {
+                std::lock_guard<std::mutex> lock(bitmapMutex);
+                std::pair<int, int> written;
+                while ( true ) {
+                    nextSector = intentBitmap.findSet(nextSector, stepEnd);
+                    written = findWrittenRows(nextSector, stepEnd);
+                    if ( written.first == nextSector ) break;
+                    nextSector = written.first;
+                }
+                batchCount = std::min({ MAX_BATCH_SECTORS, intentBitmap.findClear(nextSector, stepEnd) - nextSector,
+                                        written.second - nextSector });
+            }
+            if ( !batchCount && !pendingCount ) break;
+
+            const std::byte *sources[MAX_RAID_DEVICES];
+            std::vector<TDiskRequest> requests;
+            if ( batchCount )
+                planParityReads(diskIndex, nextSector, batchCount, readBuffer, requests, sources);
+            if ( pendingCount )
+                requests.push_back({ diskIndex, pendingSector, pendingCount, nullptr, parityBuffers[parityBufferIndex ^ 1].data() });
+            backendRequests(requests);
+
+            //If attempt to write failed, disk is still not working, same state
+            if ( pendingCount ) {
+                if ( !requests.back().succeeded() ) {
+                    rebuildWatermark = 0;
+                    closeRebuildWindow();
+                    flushIntentBitmap();
+                    return getRaidStatus();
+                }
+                throttleResync(pendingCount);
+                requests.pop_back();
+            }
+
+            //A foreground request failing on the rebuilt part restarts the rebuild, nothing more counts then
+            if ( !advanceRebuildWatermark(watermark, nextSector) ) {
+                closeRebuildWindow();
+                return getRaidStatus();
+            }
+
+            //Calculate parity of the sectors from the stripes; in case another disk failed, memory is lost
+            if ( batchCount ) {
+                parityBuffers[parityBufferIndex].resize(batchCount * SECTOR_SIZE);
+                if ( !foldParityReads(requests, sources, parityBuffers[parityBufferIndex].data()) ) {
+                    closeRebuildWindow();
+                    return RAID_FAILED;
+                }
+            }
+            pendingSector = nextSector;
+            pendingCount = batchCount;
+            nextSector += batchCount;
+            parityBufferIndex ^= 1;
+        }
+        bool advanced = advanceRebuildWatermark(watermark, nextSector);
+        closeRebuildWindow();
+        if ( !advanced )
+            return getRaidStatus();
+
+        //Whole disk restored, the bitmap is written to every disk including the restored one
+        if ( watermark >= systemState.dataSectors ) {
+            if ( !restoreDisk(diskIndex) )
+                return getRaidStatus();
+            rebuildDiskIndex = -1;
+            rebuildWatermark = 0;
+            {
+                std::lock_guard<std::mutex> lock(bitmapMutex);
+                intentBitmap.clearBelow(systemState.dataSectors);
+                intentBitmap.markAllChanged();
+            }
+            {
+                std::lock_guard<std::mutex> lock(allocationMutex);
+                allocationBitmap.markAllChanged();
+            }
+            flushIntentBitmap();
+            flushAllocationBitmap();
+            return RAID_OK;
+        }
+
+        //Regions completely below the watermark are in sync again, unless a failure has restarted the rebuild
+        {
+            std::lock_guard<std::mutex> lock(bitmapMutex);
+            if ( rebuildWatermark == watermark )
+                intentBitmap.clearBelow(watermark);
+        }
+        flushIntentBitmap();
+        return getRaidStatus();
+    }
+
+    //Scrub step of scrubStep and the scrub thread, scrubMutex is held by the caller. Rows are read straight from the
+    //disks batch by batch, writes to the batch wait meanwhile (with repair reads as well).
+    int scrubRows(int rowCount, bool throttled)
+    {
+        std::vector<std::byte> buffer, syndrome;
+        int row = scrubRow, stepEnd = std::min(systemState.dataSectors, row + std::max(rowCount, 0));
+
+        while ( row < stepEnd && getRaidStatus() == RAID_OK ) {
+            //Regions never written hold nothing to check
+            auto [writtenRow, writtenEnd] = findWrittenRows(row, stepEnd);
+            if ( writtenRow != row ) {
+                scrubRow = row = writtenRow;
+                continue;
+            }
+            int batchCount = std::min(MAX_BATCH_SECTORS, writtenEnd - row), mismatches = 0, repairs = 0;
+            size_t length = (size_t) batchCount * SECTOR_SIZE;
+            {
+                std::shared_lock<std::shared_mutex> reshapeGuard(reshapeMutex);
+                CRowLocks::CGuard rows(rowLocks, row, row + batchCount - 1, scrub.m_Repair);
+                std::vector<TDiskRequest> requests;
+                const std::byte *sources[MAX_RAID_DEVICES];
+                buffer.resize(device.m_Devices * length);
+                syndrome.resize(length);
+                for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+                    sources[diskIndex] = buffer.data() + diskIndex * length;
+                    requests.push_back({ diskIndex, row, batchCount, buffer.data() + diskIndex * length });
+                }
+                runRequests(device, ioWorkers, requests, &stats);
+
+                //A latent read error is a disk failure found early
+                bool failed = false;
+                for (const auto &request : requests) {
+                    if ( request.succeeded() ) continue;
+                    stripeCache.invalidateDisk(request.diskIndex);
+                    failDisk(request.diskIndex);
+                    failed = true;
+                }
+                if ( failed ) break;
+
+                //XOR of a whole row is zero, otherwise it is the difference to apply to the parity
+                CXorEngine::xorSources(syndrome.data(), sources, device.m_Devices, length);
+                for (int rowIndex = 0; rowIndex < batchCount; ++rowIndex) {
+                    const std::byte *difference = syndrome.data() + rowIndex * SECTOR_SIZE;
+                    if ( std::all_of(difference, difference + SECTOR_SIZE, [](std::byte value) { return value == std::byte { 0 }; }) )
+                        continue;
+                    ++mismatches;
+                    if ( !scrub.m_Repair ) continue;
+                    int parityDisk = layout.getParityDisk(row + rowIndex);
+                    std::byte *parity = buffer.data() + parityDisk * length + rowIndex * SECTOR_SIZE;
+                    const std::byte *parityParts[] = { parity, difference };
+                    CXorEngine::xorSources(parity, parityParts, 2, SECTOR_SIZE);
+                    if ( backendWrite(parityDisk, row + rowIndex, parity, 1) == 1 ) ++repairs;
+                    else if ( failDisk(parityDisk) != RAID_OK ) break;
+                }
+            }
+            stats.countScrub(batchCount, mismatches, repairs);
+            row += batchCount;
+            scrubRow = row;
+            if ( throttled ) std::this_thread::sleep_until(getScrubDeadline(batchCount));
+        }
+
+        //Pass finished, the next one starts from the beginning
+        if ( row >= systemState.dataSectors && systemState.dataSectors > 0 ) {
+            scrubRow = 0;
+            ++scrubPasses;
+        }
+        return getRaidStatus();
+    }
+
+    //Time the next batch may start at to keep the scrub rate
+    std::chrono::steady_clock::time_point getScrubDeadline(int rowCount)
+    {
+        if ( scrub.m_RowsPerSecond <= 0 ) return std::chrono::steady_clock::now();
+        scrubThrottledRows += rowCount;
+        return scrubStartTime + std::chrono::microseconds(scrubThrottledRows * 1000000 / scrub.m_RowsPerSecond);
+    }
+
+    //Background scrub: batch after batch, each after a pause that lasts as long as foreground requests keep coming;
+    //the rate limit is waited for on the condition variable, so that stop does not wait for it
+    void scrubLoop()
+    {
+        std::unique_lock<std::mutex> lock(scrubThreadMutex);
+        while ( !scrubStopping ) {
+            for (int waited = 0; !scrubStopping && waited < std::max(scrub.m_MaxYieldUs, 1); waited += std::max(scrub.m_YieldUs, 1)) {
+                uint64_t requests = stats.getRequestCount();
+                scrubWake.wait_for(lock, std::chrono::microseconds(std::max(scrub.m_YieldUs, 1)));
+                if ( stats.getRequestCount() == requests ) break;
+            }
+            if ( scrubStopping ) break;
+            lock.unlock();
+            int status;
+            std::chrono::steady_clock::time_point next;
+            {
+                std::lock_guard<std::mutex> scrubLock(scrubMutex);
+                status = scrubRows(MAX_BATCH_SECTORS, false);
+                next = getScrubDeadline(MAX_BATCH_SECTORS);
+            }
+            lock.lock();
+            //Rate limit; nothing to check until the volume is OK again
+            if ( status != RAID_OK )
+                next = std::chrono::steady_clock::now() + std::chrono::microseconds(std::max(scrub.m_MaxYieldUs, 1));
+            scrubWake.wait_until(lock, next, [this] { return scrubStopping; });
+        }
+    }
+
+    void stopScrubThread()
+    {
+        if ( !scrubThread.joinable() ) return;
+        {
+            std::lock_guard<std::mutex> lock(scrubThreadMutex);
+            scrubStopping = true;
+        }
+        scrubWake.notify_one();
+        scrubThread.join();
+        scrubStopping = false;
+    }
+
+    //Sectors of the request in front of the reshape boundary if it crosses the boundary, 0 otherwise; the reshape
+    //lock is held by the caller
+    int getReshapeSplit(int64_t secNr, int secCnt) const
+    {
+        int64_t boundary = systemState.reshapeWatermark;
+        if ( !systemState.reshapeDevices || secNr >= boundary || secNr + secCnt <= boundary )
+            return 0;
+        return (int) ( boundary - secNr );
+    }
+
+    //First phase of a reshape: the data rows of the new disk are zeroed, so that they keep the parity of the rows
+    //not moved yet; regions never written are zeroed on the volume disks as well, as the allocation bitmap cannot
+    //tell the rows of the two layouts apart. The new disk joins the volume after its last row.
+    int clearReshapeRows(int rowCount)
+    {
+        int row = reshapeClearedRows, stepEnd = std::min(systemState.dataSectors, row + std::max(rowCount, 1));
+        int newDisk = device.m_Devices;
+        std::vector<std::byte> zeros(MAX_BATCH_SECTORS * SECTOR_SIZE);
+
+        if ( allocationBitmap.isEnabled() ) {
+            std::unique_lock<std::shared_mutex> lock(reshapeMutex);
+            if ( !allocateRegions(0, 0, row, stepEnd - 1) )
+                return getRaidStatus();
+        }
+        for ( ; row < stepEnd; row += MAX_BATCH_SECTORS) {
+            int batchCount = std::min(MAX_BATCH_SECTORS, stepEnd - row);
+            int result = stats.measureDiskCall(newDisk, true, row, batchCount, [&] {
+                return reshapeDevice.m_Write(newDisk, row, zeros.data(), batchCount);
+            });
+            //A new disk refusing the data is not taken
+            if ( result != batchCount ) {
+                reshaping = false;
+                return getRaidStatus();
+            }
+            reshapeClearedRows = row + batchCount;
+        }
+        if ( reshapeClearedRows < systemState.dataSectors )
+            return getRaidStatus();
+
+        //The new disk joins the volume, all the sectors are in the previous layout yet; the bitmaps and the metadata
+        //go to every disk, the new one included
+        std::unique_lock<std::shared_mutex> lock(reshapeMutex);
+        int previousDevices = device.m_Devices;
+        device = reshapeDevice;
+        if ( ioWorkers.workerCount() ) ioWorkers.start(device.m_Devices);
+        stripeCache.invalidateDisk(newDisk);
+        systemState.reshapeDevices = previousDevices;
+        systemState.reshapeWatermark = 0;
+        layout.reset(device.m_Devices, systemState.chunkSectors, (CRaidLayout::TRotation) systemState.rotation);
+        layout.setReshape(previousDevices, 0);
+        {
+            std::lock_guard<std::mutex> bitmapLock(bitmapMutex);
+            intentBitmap.markAllChanged();
+        }
+        {
+            std::lock_guard<std::mutex> allocationLock(allocationMutex);
+            allocationBitmap.markAllChanged();
+        }
+        flushIntentBitmap();
+        flushAllocationBitmap();
+        storeMetadata();
+        return getRaidStatus();
+    }
+
+    //Second phase of a reshape: the next whole stripes of the new layout are built from the rows of the previous one
+    //(read from all the disks at once), their parity computed and written to all the disks at once. Stripes past the
+    //end of the previous layout are zeros. Requests wait for the batch; the rows of the previous layout overwritten
+    //by the batch hold only sectors moved already.
+    int moveReshapeRows(int rowCount)
+    {
+        int chunkSectors = systemState.chunkSectors, previousDevices = systemState.reshapeDevices;
+        int64_t previousStripe = (int64_t) ( previousDevices - 1 ) * chunkSectors;
+        int64_t stripeSectors = (int64_t) ( device.m_Devices - 1 ) * chunkSectors;
+        int64_t previousSize = ( previousDevices - 1 ) * (int64_t) systemState.dataSectors;
+        int64_t newSize = ( device.m_Devices - 1 ) * (int64_t) systemState.dataSectors;
+        int64_t from = systemState.reshapeWatermark;
+        int64_t to = std::min(newSize, from + std::max(( rowCount + chunkSectors - 1 ) / chunkSectors, 1) * stripeSectors);
+
+        //The last batch changes the stripe of the gathering buffer: buffered writes go out first, later ones go to
+        //the disks directly until the batch is done (gatherLock is not held over its disk I/O)
+        if ( to == newSize ) {
+            std::unique_lock<std::mutex> gatherGuard(gatherLock);
+            drainGathered(gatherGuard);
+            gatherSuspended = true;
+        }
+        std::unique_lock<std::shared_mutex> lock(reshapeMutex);
+        if ( getRaidStatus() != RAID_OK )
+            return getRaidStatus();
+
+        //Some variables
+        CRaidLayout previous, current;
+        previous.reset(previousDevices, chunkSectors, (CRaidLayout::TRotation) systemState.rotation);
+        current.reset(device.m_Devices, chunkSectors, (CRaidLayout::TRotation) systemState.rotation);
+        int firstRow = (int) ( from / stripeSectors * chunkSectors ), rows = (int) ( ( to - from ) / stripeSectors * chunkSectors );
+        int64_t sourceEnd = std::min(to, previousSize);
+        std::vector<std::byte> sources, stripes((size_t) device.m_Devices * rows * SECTOR_SIZE);
+        std::vector<TDiskRequest> requests;
+        int sourceRow = 0, sourceRows = 0;
+
+        //Rows of the previous layout holding the sectors of the batch, a single call per disk
+        if ( from < sourceEnd ) {
+            sourceRow = (int) ( from / previousStripe * chunkSectors );
+            sourceRows = (int) ( ( sourceEnd - 1 ) / previousStripe * chunkSectors ) + chunkSectors - sourceRow;
+            sources.resize((size_t) previousDevices * sourceRows * SECTOR_SIZE);
+            for (int diskIndex = 0; diskIndex < previousDevices; ++diskIndex)
+                requests.push_back({ diskIndex, sourceRow, sourceRows, sources.data() + (size_t) diskIndex * sourceRows * SECTOR_SIZE });
+            backendRequests(requests);
+            for (const auto &request : requests)
+                if ( !request.succeeded() ) failDisk(request.diskIndex);
+            if ( getRaidStatus() != RAID_OK )
+                return getRaidStatus();
+        }
+
+        //Sectors into the new rows, then the parity of every new stripe
+        CRaidLayout::CIterator source = previous.begin(from), target = current.begin(from);
+        for (int64_t sector = from; sector < sourceEnd; ++sector, ++source, ++target)
+            memcpy(stripes.data() + ( (size_t) target.disk() * rows + target.row() - firstRow ) * SECTOR_SIZE,
+                   sources.data() + ( (size_t) source.disk() * sourceRows + source.row() - sourceRow ) * SECTOR_SIZE, SECTOR_SIZE);
+        for (int row = firstRow; row < firstRow + rows; row += chunkSectors) {
+            const std::byte *parts[MAX_RAID_DEVICES];
+            int parityDisk = current.getParityDisk(row), partCount = 0;
+            for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex)
+                if ( diskIndex != parityDisk )
+                    parts[partCount++] = stripes.data() + ( (size_t) diskIndex * rows + row - firstRow ) * SECTOR_SIZE;
+            CXorEngine::xorSources(stripes.data() + ( (size_t) parityDisk * rows + row - firstRow ) * SECTOR_SIZE,
+                                   parts, partCount, (size_t) chunkSectors * SECTOR_SIZE);
+        }
+
+        //The previous rows are overwritten from here on, so the boundary moves even if a disk fails; the parity has
+        //the lost part then
+        requests.clear();
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex)
+            requests.push_back({ diskIndex, firstRow, rows, nullptr, stripes.data() + (size_t) diskIndex * rows * SECTOR_SIZE });
+        backendRequests(requests);
+        for (const auto &request : requests)
+            completeWrite(request.diskIndex, request.sectorIndex, request.sectorCount, request.succeeded());
+        systemState.reshapeWatermark = to;
+        layout.setReshape(previousDevices, to);
+        stats.countReshape(to - from);
+        if ( to < newSize ) {
+            //The next batch overwrites rows of the previous layout that held sectors of this one, the watermark has to
+            //be on the disks before
+            storeMetadata();
+            return getRaidStatus();
+        }
+
+        //Every sector is in the new layout, the volume grows
+        systemState.reshapeDevices = 0;
+        systemState.reshapeWatermark = 0;
+        layout.reset(device.m_Devices, chunkSectors, (CRaidLayout::TRotation) systemState.rotation);
+        {
+            std::lock_guard<std::mutex> gatherGuard(gatherLock);
+            writeGather.reset((int) stripeSectors);
+            gatherSuspended = false;
+        }
+        volumeSectors = newSize;
+        storeMetadata();
+        reshaping = false;
+        return getRaidStatus();
+    }
+
+    //Requests covering a whole stripe go to the disks right away, after the buffered stripes they touch are written
+    //out (only partly covered, older data underneath) or dropped once the request is written (overwritten
+    //completely); the rest is buffered. gatherLock guards the buffer only, the disks are written without it.
+    bool gatherWrite ( int64_t secNr, const CIoSegments &data, int secCnt )
+    {
+        //Status check
+        if ( getRaidStatus() == RAID_STOPPED || getRaidStatus() == RAID_FAILED )
+            return false;
+        if ( secCnt <= 0 )
+            return true;
+        if ( secNr < 0 || secNr + secCnt > size() )
+            return false;
+
+        std::unique_lock<std::mutex> lock(gatherLock);
+        if ( gatherSuspended ) {
+            lock.unlock();
+            return writeRequest(secNr, data, secCnt);
+        }
+        int stripeSectors = writeGather.getStripeSectors();
+        int64_t lastSector = secNr + secCnt - 1;
+        if ( ( secNr + stripeSectors - 1 ) / stripeSectors < ( lastSector + 1 ) / stripeSectors ) {
+            //Buffered data of the stripes being written out land first; the buffered stripes stay readable (as being
+            //written out) until the request is on the disks, those covered by it completely are not written at all
+            gatherDone.wait(lock, [&] { return !writeGather.isWriting(secNr / stripeSectors, lastSector / stripeSectors); });
+            std::vector<TTakenStripe> taken = takeGatheredStripes(lock, writeGather.getStripes(secNr, lastSector));
+            lock.unlock();
+            for (const auto &[stripeIndex, stripe] : taken)
+                if ( stripeIndex * stripeSectors < secNr || ( stripeIndex + 1 ) * stripeSectors - 1 > lastSector )
+                    writeGatheredStripe(stripeIndex, *stripe);
+            bool result = writeRequest(secNr, data, secCnt);
+            finishGatheredStripes(taken);
+            return result;
+        }
+
+        //Sectors go into the buffer, the stripes completed by them are written
+        std::vector<int64_t> completed;
+        std::byte gathered[SECTOR_SIZE];
+        for (int offset = 0; offset < secCnt; ++offset) {
+            const std::byte *source = data.getRun(offset, 1);
+            if ( !source ) {
+                data.gather(offset, gathered);
+                source = gathered;
+            }
+            int64_t stripeIndex = ( secNr + offset ) / stripeSectors;
+            if ( writeGather.store(secNr + offset, source) && ( completed.empty() || completed.back() != stripeIndex ) )
+                completed.push_back(stripeIndex);
+        }
+        stats.countGatheredWrite();
+
+        //The oldest stripes make room
+        std::vector<int64_t> written = completed;
+        size_t maxStripes = (size_t) std::max(gather.m_MaxStripes, 0), remaining = writeGather.getStripeCount() - completed.size();
+        if ( remaining > maxStripes ) {
+            for (int64_t stripeIndex : writeGather.getStripesSince(std::chrono::steady_clock::time_point::max())) {
+                if ( remaining <= maxStripes ) break;
+                if ( std::find(completed.begin(), completed.end(), stripeIndex) != completed.end() ) continue;
+                written.push_back(stripeIndex);
+                --remaining;
+            }
+        }
+        if ( written.empty() )
+            return true;
+
+        //Failures of the stripes made room for are reported by flush only
+        std::vector<TTakenStripe> taken = takeGatheredStripes(lock, written);
+        lock.unlock();
+        bool result = true;
+        for (const auto &[stripeIndex, stripe] : taken)
+            if ( !writeGatheredStripe(stripeIndex, *stripe)
+                 && std::find(completed.begin(), completed.end(), stripeIndex) != completed.end() )
+                result = false;
+        finishGatheredStripes(taken);
+        return result;
+    }
+
+    //Buffered sectors (and those being written out) take the place of the disk content; a request found in the
+    //buffer completely does not touch the disks
+    bool gatheredRead ( int64_t secNr, const CIoSegments &data, int secCnt )
+    {
+        //Status check
+        if ( getRaidStatus() == RAID_STOPPED || getRaidStatus() == RAID_FAILED )
+            return false;
+        if ( secCnt <= 0 )
+            return true;
+        if ( secNr < 0 || secNr + secCnt > size() )
+            return false;
+
+        std::vector<std::byte> pending;
+        std::vector<bool> present;
+        int found = 0;
+        {
+            std::lock_guard<std::mutex> lock(gatherLock);
+            if ( writeGather.isPending(secNr, secNr + secCnt - 1) ) {
+                pending.resize((size_t) secCnt * SECTOR_SIZE);
+                found = writeGather.copyPending(secNr, secCnt, pending.data(), present);
+            }
+        }
+        if ( found < secCnt && !readRequest(secNr, data, secCnt) )
+            return false;
+        for (int offset = 0; found && offset < secCnt; ++offset)
+            if ( present[offset] )
+                data.scatter(offset, pending.data() + (size_t) offset * SECTOR_SIZE);
+        return true;
+    }
+
+    //Stripes taken out of the buffer for writing: index and content (kept by the buffer until they are finished)
+    using TTakenStripe = std::pair<int64_t, const CWriteGather::TStripe*>;
+
+    //Takes the buffered ones of the stripes out for writing, once earlier writes of the same stripes are done, so
+    //that older data never land over newer ones; gatherLock is held by the caller (released while waiting)
+    std::vector<TTakenStripe> takeGatheredStripes(std::unique_lock<std::mutex> &lock, const std::vector<int64_t> &stripeIndices)
+    {
+        gatherDone.wait(lock, [&] {
+            return std::none_of(stripeIndices.begin(), stripeIndices.end(), [this](int64_t stripeIndex) {
+                return writeGather.isWriting(stripeIndex, stripeIndex);
+            });
+        });
+        std::vector<TTakenStripe> taken;
+        for (int64_t stripeIndex : stripeIndices)
+            if ( writeGather.contains(stripeIndex) )
+                taken.emplace_back(stripeIndex, &writeGather.startWrite(stripeIndex));
+        return taken;
+    }
+
+    void finishGatheredStripes(const std::vector<TTakenStripe> &taken)
+    {
+        if ( taken.empty() ) return;
+        {
+            std::lock_guard<std::mutex> lock(gatherLock);
+            for (const auto &stripe : taken)
+                writeGather.finishWrite(stripe.first);
+        }
+        gatherDone.notify_all();
+    }
+
+    //Writes a taken stripe out: a complete one as a single full-stripe request, an incomplete one run by run
+    bool writeGatheredStripe(int64_t stripeIndex, const CWriteGather::TStripe &stripe)
+    {
+        int stripeSectors = (int) stripe.present.size();
+        bool result = true;
+        for (int runStart = 0, runEnd; runStart < stripeSectors; runStart = runEnd) {
+            for (runEnd = runStart + 1; runEnd < stripeSectors && stripe.present[runEnd] == stripe.present[runStart]; ++runEnd);
+            if ( !stripe.present[runStart] ) continue;
+            TIoSegment segment { const_cast<std::byte*>(stripe.data.data()) + (size_t) runStart * SECTOR_SIZE,
+                                 (size_t) ( runEnd - runStart ) * SECTOR_SIZE };
+            result &= writeRequest(stripeIndex * stripeSectors + runStart, CIoSegments(&segment, 1), runEnd - runStart);
+        }
+        stats.countGatherFlush(stripe.presentCount == stripeSectors);
+        if ( !result ) gatherFailed = true;
+        return result;
+    }
+
+    //Writes out the buffered stripes, all of them (waiting for the writes of the others too) or those older than
+    //the gather delay
+    void flushGathered(bool expiredOnly)
+    {
+        std::unique_lock<std::mutex> lock(gatherLock);
+        if ( !expiredOnly ) {
+            drainGathered(lock);
+            return;
+        }
+        auto limit = std::chrono::steady_clock::now() - std::chrono::microseconds(gather.m_DelayUs);
+        std::vector<TTakenStripe> taken = takeGatheredStripes(lock, writeGather.getStripesSince(limit));
+        lock.unlock();
+        for (const auto &[stripeIndex, stripe] : taken)
+            writeGatheredStripe(stripeIndex, *stripe);
+        finishGatheredStripes(taken);
+    }
+
+    //Writes out every buffered stripe and waits until no stripe is being written; returns with gatherLock held by
+    //the lock and the buffer empty
+    void drainGathered(std::unique_lock<std::mutex> &lock)
+    {
+        while ( true ) {
+            gatherDone.wait(lock, [this] { return !writeGather.isWriting(); });
+            std::vector<int64_t> stripes = writeGather.getStripesSince(std::chrono::steady_clock::time_point::max());
+            if ( stripes.empty() ) return;
+            std::vector<TTakenStripe> taken = takeGatheredStripes(lock, stripes);
+            lock.unlock();
+            for (const auto &[stripeIndex, stripe] : taken)
+                writeGatheredStripe(stripeIndex, *stripe);
+            finishGatheredStripes(taken);
+            lock.lock();
+        }
+    }
+
+    //Background thread writing out the stripes buffered for too long
+    void gatherLoop()
+    {
+        std::unique_lock<std::mutex> lock(gatherThreadMutex);
+        while ( !gatherStopping ) {
+            gatherWake.wait_for(lock, std::chrono::microseconds(std::max(gather.m_DelayUs / 2, 1)));
+            if ( gatherStopping ) break;
+            lock.unlock();
+            flushGathered(true);
+            lock.lock();
+        }
+    }
+
+    void stopGatherThread()
+    {
+        if ( !gatherThread.joinable() ) return;
+        {
+            std::lock_guard<std::mutex> lock(gatherThreadMutex);
+            gatherStopping = true;
+        }
+        gatherWake.notify_one();
+        gatherThread.join();
+        gatherStopping = false;
+    }
+
+    //Rows of the request are within the chunk rows of its first and last stripe
+    std::pair<int, int> getRowRange(int64_t secNr, int secCnt) const
+    {
+        int chunkSectors = systemState.chunkSectors;
+        return { layout.locate(secNr).second / chunkSectors * chunkSectors,
+                 ( layout.locate(secNr + secCnt - 1).second / chunkSectors + 1 ) * chunkSectors - 1 };
+    }
+
+    //Rows a write has to lock: its own rows, extended to whole regions if some of them has never been written
+    std::pair<int, int> getAllocationRange(int firstRow, int lastRow)
+    {
+        std::lock_guard<std::mutex> lock(allocationMutex);
+        if ( allocationBitmap.findClear(firstRow, lastRow + 1) > lastRow )
+            return { firstRow, lastRow };
+        int regionRows = allocationBitmap.getRegionSectors();
+        return { firstRow / regionRows * regionRows,
+                 (int) std::min<int64_t>(( lastRow / regionRows + 1 ) * (int64_t) regionRows, systemState.dataSectors) - 1 };
+    }
+
+    //Regions of the rows never written (true), indexed from the region of the first row; empty if all were written
+    std::vector<bool> getUnwrittenRegions(int firstRow, int lastRow)
+    {
+        std::vector<bool> unwritten;
+        std::lock_guard<std::mutex> lock(allocationMutex);
+        if ( allocationBitmap.findClear(firstRow, lastRow + 1) > lastRow )
+            return unwritten;
+        int regionRows = allocationBitmap.getRegionSectors();
+        for (int row = firstRow / regionRows * regionRows; row <= lastRow; row += regionRows)
+            unwritten.push_back(!allocationBitmap.test(row));
+        return unwritten;
+    }
+
+    //First written row in [row, rowLimit) and the end of the written rows from there
+    std::pair<int, int> findWrittenRows(int row, int rowLimit)
+    {
+        std::lock_guard<std::mutex> lock(allocationMutex);
+        row = allocationBitmap.findSet(row, rowLimit);
+        return { row, allocationBitmap.findClear(row, rowLimit) };
+    }
+
+    //Regions of the write not written before get their rows zeroed on every disk first (parity of zeros is zero), so
+    //that data and parity agree in the rest of the region; a write covering a whole region needs no zeroing. The
+    //regions are stored as written before the data lands. Rows of the regions are locked by the caller.
+    bool allocateRegions(int64_t secNr, int secCnt, int firstRow, int lastRow)
+    {
+        if ( !allocationBitmap.isEnabled() ) return true;
+        int regionRows = allocationBitmap.getRegionSectors(), allocated = 0;
+        int64_t rowSectors = std::max(device.m_Devices - 1, 1);
+        std::vector<std::byte> zeros;
+
+        for (int regionRow = firstRow / regionRows * regionRows; regionRow <= lastRow; regionRow += regionRows) {
+            {
+                std::lock_guard<std::mutex> lock(allocationMutex);
+                if ( allocationBitmap.test(regionRow) ) continue;
+            }
+            int regionEnd = (int) std::min<int64_t>((int64_t) regionRow + regionRows, systemState.dataSectors);
+            if ( secNr > regionRow * rowSectors || secNr + secCnt < regionEnd * rowSectors ) {
+                markWriteIntent(regionRow, regionEnd - 1);
+                zeros.resize(MAX_BATCH_SECTORS * SECTOR_SIZE);
+                for (int row = regionRow; row < regionEnd; row += MAX_BATCH_SECTORS) {
+                    int rowCount = std::min(MAX_BATCH_SECTORS, regionEnd - row);
+                    std::vector<TDiskRequest> requests;
+                    for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex)
+                        if ( isDiskUsable(diskIndex, row, rowCount) )
+                            requests.push_back({ diskIndex, row, rowCount, nullptr, zeros.data() });
+                    backendRequests(requests);
+                    for (const auto &request : requests)
+                        if ( !completeWrite(request.diskIndex, request.sectorIndex, request.sectorCount, request.succeeded()) )
+                            return false;
+                }
+            }
+            std::lock_guard<std::mutex> lock(allocationMutex);
+            allocationBitmap.setRange(regionRow, regionEnd - 1);
+            ++allocated;
+        }
+        if ( !allocated ) return true;
+        stats.countAllocation(allocated, 0);
+        flushAllocationBitmap();
+        return true;
+    }
+
+    //Rows between the watermark and the end of the window are being rebuilt, rebuildWindowMutex is held by the caller
+    bool isInRebuildWindow(int firstRow, int lastRow) const
+    {
+        return lastRow >= rebuildWatermark && firstRow < rebuildWindowEnd;
+    }
+
+    void openRebuildWindow(int firstRow, int windowEnd)
+    {
+        if ( firstRow >= windowEnd ) return;
+        CRowLocks::CGuard rows(rowLocks, firstRow, windowEnd - 1, true);
+        std::lock_guard<std::mutex> lock(rebuildWindowMutex);
+        rebuildWindowEnd = windowEnd;
+    }
+
+    void closeRebuildWindow()
+    {
+        {
+            std::lock_guard<std::mutex> lock(rebuildWindowMutex);
+            rebuildWindowEnd = 0;
+        }
+        rebuildWindowChanged.notify_all();
+    }
+
+    //Moves the watermark from the expected value, fails if a foreground failure has reset it meanwhile
+    bool advanceRebuildWatermark(int &watermark, int newWatermark)
+    {
+        {
+            std::lock_guard<std::mutex> lock(rebuildWindowMutex);
+            if ( !rebuildWatermark.compare_exchange_strong(watermark, newWatermark) )
+                return false;
+            watermark = newWatermark;
+        }
+        rebuildWindowChanged.notify_all();
+        return true;
+    }
+
+    bool writeSectors ( int64_t secNr, const CIoSegments &data, int secCnt )
+    {
+        //Some variables
+        std::vector<TRowSources> fullRows, rowSources;
+        std::vector<int> coveredSectors;
+        int firstRow = device.m_Sectors, lastRow = 0, fullRowsStart = 0, splitSectors = 0;
+        CBufferArena::CBuffer splitBuffer = bufferArena.acquire(data.getSplitSectorCount() * SECTOR_SIZE);
+
+        //Sort the sectors of the request into the stripe rows; with chunks the request does not cover the rows in order
+        CRaidLayout::CIterator position = layout.begin(secNr);
+        for (int offset = 0; offset < secCnt; ++offset, ++position) {
+            firstRow = std::min(firstRow, position.row());
+            lastRow = std::max(lastRow, position.row());
+        }
+        rowSources.assign(lastRow - firstRow + 1, TRowSources());
+        coveredSectors.assign(lastRow - firstRow + 1, 0);
+        //Sectors are written straight from the caller memory, those split between segments are gathered first
+        position = layout.begin(secNr);
+        for (int offset = 0; offset < secCnt; ++offset, ++position) {
+            const std::byte *source = data.getRun(offset, 1);
+            if ( !source ) {
+                std::byte *gathered = splitBuffer.data() + splitSectors++ * SECTOR_SIZE;
+                data.gather(offset, gathered);
+                source = gathered;
+            }
+            rowSources[position.row() - firstRow][position.disk()] = source;
+            ++coveredSectors[position.row() - firstRow];
+        }
+
+        //Main loop that goes through all the stripe rows that we need to write into
+        for (int rowIndex = firstRow; rowIndex <= lastRow; ++rowIndex) {
+            int covered = coveredSectors[rowIndex - firstRow];
+
+            //Consecutive full rows are collected and written together, so that every disk gets one call per batch
+            if ( covered == device.m_Devices - 1 ) {
+                if ( fullRows.empty() ) fullRowsStart = rowIndex;
+                fullRows.push_back(rowSources[rowIndex - firstRow]);
+                if ( (int) fullRows.size() < MAX_BATCH_SECTORS ) continue;
+            }
+            if ( !fullRows.empty() ) {
+                if ( !fullStripeWrite(fullRowsStart, fullRows) )
+                    return false;
+                fullRows.clear();
+            }
+
+            //Write the partial row with the system state checks
+            if ( covered && covered != device.m_Devices - 1 && !checkedWrite(rowIndex, rowSources[rowIndex - firstRow].data()) )
+                return false;
+        }
+        return fullRows.empty() || fullStripeWrite(fullRowsStart, fullRows);
+    }
+
+    //Upper bound of sectors moved by a single backend call
+    static constexpr int MAX_BATCH_SECTORS = 256;
+
+    //Sectors rebuilt by a single resync step by default
+    static constexpr int RESYNC_STEP_SECTORS = 16 * MAX_BATCH_SECTORS;
+
+    //Rows checked by a single scrub step by default
+    static constexpr int SCRUB_STEP_ROWS = 16 * MAX_BATCH_SECTORS;
+
+    //Rows cleared or moved by a single reshape step by default
+    static constexpr int RESHAPE_STEP_ROWS = 16 * MAX_BATCH_SECTORS;
+
+    //New content of each disk of a row, nullptr for untouched disks
+    using TRowSources = std::array<const std::byte*, MAX_RAID_DEVICES>;
+
+    //A single backend call, either a read (readDestination) or a write (writeSource)
+    struct TDiskRequest
+    {
+        int diskIndex;
+        int sectorIndex;
+        int sectorCount;
+        std::byte *readDestination = nullptr;
+        const std::byte *writeSource = nullptr;
+        int result = 0;
+        bool completed = false;
+
+        bool succeeded() const
+        {
+            return result == sectorCount;
+        }
+    };
+
+    //Executes all the requests not completed yet, in parallel when the workers run; the system state is left untouched
+    static void runRequests(const TBlkDev &dev, CDiskWorkers &workers, std::vector<TDiskRequest> &requests,
+                            CRaidStats *stats = nullptr)
+    {
+        std::vector<std::pair<int, CDiskWorkers::TJob>> jobs;
+        for (auto &request : requests) {
+            if ( request.completed ) continue;
+            jobs.emplace_back(request.diskIndex, [&dev, &request, stats] {
+                auto call = [&dev, &request] {
+                    return request.readDestination
+                        ? dev.m_Read(request.diskIndex, request.sectorIndex, request.readDestination, request.sectorCount)
+                        : dev.m_Write(request.diskIndex, request.sectorIndex, request.writeSource, request.sectorCount);
+                };
+                request.result = stats ? stats->measureDiskCall(request.diskIndex, !request.readDestination, request.sectorIndex,
+                                                                     request.sectorCount, call) : call();
+                request.completed = true;
+            });
+        }
+        workers.runBatch(jobs);
+    }
+
+    Metadata getStandardMetadata (Metadata* disksMetadata) const
+    {
+        if ( device.m_Devices <= 0) return {};
+        if ( device.m_Devices < 3 ) return disksMetadata[0];
+        return disksMetadata[0] == disksMetadata[1] ? disksMetadata[0] : disksMetadata[2];
+    }
+
+    void markWrongMetadataDisks(Metadata* disksMetadata, Metadata& standardMetadata)
+    {
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+            //A disk recorded as failed keeps missing data even if it answers again
+            if ( disksMetadata[diskIndex] != standardMetadata || standardMetadata.disksStatus[diskIndex] )
+                systemState.disksStatus[diskIndex] = true;
+        }
+    }
+    
+    int countFailedDisks()
+    {
+        int counter = 0;
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+            if ( isDiskFailed(diskIndex) )
+                ++counter;
+        }
+        return counter;
+    }
+
+    int getFailedDiscIndex()
+    {
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+            if ( isDiskFailed(diskIndex) )
+                return diskIndex;
+        }
+        return MAX_RAID_DEVICES;
+    }
+
+    bool calculateParity(int failedDiskIndex, int sectorIndex, std::byte *parityBuffer, int sectorCount = 1)
+    {
+        std::vector<std::byte> buffer;
+        std::vector<TDiskRequest> requests;
+        const std::byte *sources[MAX_RAID_DEVICES];
+
+        //Collect the rest of the stripes from all the disks at once, then fold them all in a single pass
+        stats.countReconstruction(sectorCount);
+        planParityReads(failedDiskIndex, sectorIndex, sectorCount, buffer, requests, sources);
+        backendRequests(requests);
+        return foldParityReads(requests, sources, parityBuffer);
+    }
+
+    //Appends reads of the rest of the stripes into buffer, sources point to the data of the particular disks
+    void planParityReads(int failedDiskIndex, int sectorIndex, int sectorCount, std::vector<std::byte> &buffer,
+                         std::vector<TDiskRequest> &requests, const std::byte **sources)
+    {
+        buffer.resize((device.m_Devices - 1) * sectorCount * SECTOR_SIZE);
+        int sourceCount = 0;
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+            if ( diskIndex == failedDiskIndex ) continue;
+            std::byte *destination = buffer.data() + sourceCount * sectorCount * SECTOR_SIZE;
+            sources[sourceCount++] = destination;
+            requests.push_back({ diskIndex, sectorIndex, sectorCount, destination });
+            requests.back().completed = !isDiskUsable(diskIndex, sectorIndex, sectorCount);
+        }
+    }
+
+    bool foldParityReads(const std::vector<TDiskRequest> &requests, const std::byte **sources, std::byte *parityBuffer)
+    {
+        for (const auto &request : requests) {
+            if ( !request.succeeded() ) {
+                failDisk(request.diskIndex);
+                failRaid();
+                return false;
+            }
+        }
+        CXorEngine::xorSources(parityBuffer, sources, (int) requests.size(), requests[0].sectorCount * SECTOR_SIZE);
+        return true;
+    }
+
+    void throttleResync(int sectorCount)
+    {
+        if ( resyncRate <= 0 ) return;
+        resyncThrottledSectors += sectorCount;
+        std::this_thread::sleep_until(resyncStartTime + std::chrono::microseconds(resyncThrottledSectors * 1000000 / resyncRate));
+    }
+
+    //A failed disk is still usable for the part already rebuilt by resync
+    bool isDiskUsable(int diskIndex, int sectorIndex, int sectorCount = 1) const
+    {
+        return getUsableSectorCount(diskIndex, sectorIndex, sectorCount) == sectorCount;
+    }
+
+    //Count of leading sectors of the run which can be accessed on the disk
+    int getUsableSectorCount(int diskIndex, int sectorIndex, int sectorCount) const
+    {
+        if ( !isDiskFailed(diskIndex) ) return sectorCount;
+        if ( diskIndex != rebuildDiskIndex ) return 0;
+        return std::max(0, std::min(sectorCount, rebuildWatermark - sectorIndex));
+    }
+
+    //Uncached read straight from the disk
+    int deviceRead(int diskIndex, int sectorIndex, void *destination, int sectorCount)
+    {
+        return stats.measureDiskCall(diskIndex, false, sectorIndex, sectorCount, [&] {
+            return device.m_Read(diskIndex, sectorIndex, destination, sectorCount);
+        });
+    }
+
+    //All the data sector traffic goes through these two, so that the stripe cache stays coherent with the disks
+    int backendRead(int diskIndex, int sectorIndex, std::byte *destination, int sectorCount)
+    {
+        if ( stripeCache.lookup(diskIndex, sectorIndex, destination, sectorCount) )
+            return sectorCount;
+        int result = deviceRead(diskIndex, sectorIndex, destination, sectorCount);
+        if ( result == sectorCount ) stripeCache.store(diskIndex, sectorIndex, destination, sectorCount);
+        else stripeCache.invalidateDisk(diskIndex);
+        return result;
+    }
+
+    int backendWrite(int diskIndex, int sectorIndex, const std::byte *source, int sectorCount)
+    {
+        int result = stats.measureDiskCall(diskIndex, true, sectorIndex, sectorCount, [&] {
+            return device.m_Write(diskIndex, sectorIndex, source, sectorCount);
+        });
+        if ( result == sectorCount ) stripeCache.store(diskIndex, sectorIndex, source, sectorCount);
+        else stripeCache.invalidateDisk(diskIndex);
+        return result;
+    }
+
+    //Batched variant of backendRead/backendWrite; requests marked completed by the caller are skipped
+    void backendRequests(std::vector<TDiskRequest> &requests)
+    {
+        for (auto &request : requests) {
+            if ( !request.completed && request.readDestination
+                 && stripeCache.lookup(request.diskIndex, request.sectorIndex, request.readDestination, request.sectorCount) ) {
+                request.result = request.sectorCount;
+                request.completed = true;
+            }
+        }
+
+        std::vector<TDiskRequest*> executed;
+        for (auto &request : requests)
+            if ( !request.completed ) executed.push_back(&request);
+        runRequests(device, ioWorkers, requests, &stats);
 
+        for (TDiskRequest *request : executed) {
+            if ( !request->succeeded() ) stripeCache.invalidateDisk(request->diskIndex);
+            else stripeCache.store(request->diskIndex, request->sectorIndex,
+                                   request->readDestination ? request->readDestination : request->writeSource, request->sectorCount);
+        }
+    }
 
-    static bool create ( const TBlkDev& dev )
+    bool isHedging() const
     {
-        //Initialize standard metadata
-        Metadata data;
+        return hedge.m_Enabled && ioWorkers.workerCount() && getRaidStatus() == RAID_OK && !reshaping;
+    }
 
-        //Write this metadata to each disk at the last sector
-        for (int diskIndex = 0; diskIndex < dev.m_Devices; ++diskIndex)
-            if ( dev.m_Write(diskIndex, dev.m_Sectors - 1, &data, 1) != 1)
-                return false;
-        return true;
+    static int64_t getSteadyMicroseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
     }
 
+    //Demoted disk is left out of reads as long as all the other disks work
+    bool isDiskReadable(int diskIndex, int sectorIndex, int sectorCount) const
+    {
+        if ( !isDiskUsable(diskIndex, sectorIndex, sectorCount) ) return false;
+        return !hedge.m_Enabled || demotedUntil[diskIndex] <= getSteadyMicroseconds() || getRaidStatus() != RAID_OK;
+    }
 
-    int start ( const TBlkDev& dev )
+    //Counts reads lost by the disk; a disk losing too many of them in a row gets demoted, one disk at a time
+    void noteHedgeResult(int diskIndex, bool diskWon)
     {
-        //Check current status
-        if ( systemState.raidStatus != RAID_STOPPED ) return systemState.raidStatus;
+        if ( diskWon ) {
+            slowReads[diskIndex] = 0;
+            return;
+        }
+        stats.countHedge(true);
+        if ( ++slowReads[diskIndex] < hedge.m_DemoteAfter ) return;
+        int64_t now = getSteadyMicroseconds();
+        for (int otherDiskIndex = 0; otherDiskIndex < device.m_Devices; ++otherDiskIndex)
+            if ( otherDiskIndex != diskIndex && demotedUntil[otherDiskIndex] > now ) return;
+        slowReads[diskIndex] = 0;
+        demotedUntil[diskIndex] = now + hedge.m_DemoteUs;
+        stats.countDemotion();
+    }
 
-        //Some variables
-        Metadata disksMetadata[MAX_RAID_DEVICES];
-        std::byte buffer[SECTOR_SIZE]{};
+    //Reads the requests like backendRequests, but a request the disk does not finish within the hedging delay is
+    //reconstructed from the same rows of the other disks as well and whichever finishes first is used. Reads losing
+    //the race keep running on the workers, so all the reads go into buffers of the shared state.
+    void hedgedRequests(std::vector<TDiskRequest> &requests)
+    {
+        struct THedgedRead
+        {
+            std::vector<std::byte> buffer;
+            int diskResult = -1;
+            bool hedged = false;
+            int pendingSources = 0;
+            bool sourcesFailed = false;
+            //Reads still running, the rows stay registered as abandoned until all of them finish
+            int runningReads = 0;
+            bool abandoned = false;
+        };
+        struct THedgeState
+        {
+            std::mutex mutex;
+            std::condition_variable changed;
+            std::vector<THedgedRead> reads;
+        };
+        auto state = std::make_shared<THedgeState>();
+        state->reads.resize(requests.size());
+        int sourceCount = device.m_Devices - 1;
 
-        //Copy the device
-        this->device = dev;
+        //Posts a read of the disk into the given part of the buffer of the read, state mutex is held by the caller
+        auto postRead = [this, state](size_t readIndex, int diskIndex, int sectorIndex, int sectorCount, size_t offset, bool source) {
+            ++state->reads[readIndex].runningReads;
+            ioWorkers.post(diskIndex, [this, state, readIndex, diskIndex, sectorIndex, sectorCount, offset, source] {
+                THedgedRead &read = state->reads[readIndex];
+                int result = stats.measureDiskCall(diskIndex, false, sectorIndex, sectorCount, [&] {
+                    return device.m_Read(diskIndex, sectorIndex, read.buffer.data() + offset, sectorCount);
+                });
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if ( --read.runningReads == 0 && read.abandoned ) {
+                    std::lock_guard<std::mutex> abandonedLock(abandonedMutex);
+                    abandonedRows.erase(std::find(abandonedRows.begin(), abandonedRows.end(),
+                                                  std::make_pair(sectorIndex, sectorIndex + sectorCount - 1)));
+                    abandonedDone.notify_all();
+                }
+                if ( !source ) read.diskResult = result;
+                else {
+                    read.sourcesFailed |= result != sectorCount;
+                    --read.pendingSources;
+                }
+                state->changed.notify_all();
+            });
+        };
 
-        //Mark all disks as working ones
-        systemState.resetDisksStatus();
+        std::unique_lock<std::mutex> lock(state->mutex);
+        for (size_t requestIndex = 0; requestIndex < requests.size(); ++requestIndex) {
+            TDiskRequest &request = requests[requestIndex];
+            if ( !request.completed
+                 && stripeCache.lookup(request.diskIndex, request.sectorIndex, request.readDestination, request.sectorCount) ) {
+                request.result = request.sectorCount;
+                request.completed = true;
+            }
+            if ( request.completed ) continue;
+            state->reads[requestIndex].buffer.resize(( 1 + sourceCount ) * request.sectorCount * SECTOR_SIZE);
+            postRead(requestIndex, request.diskIndex, request.sectorIndex, request.sectorCount, 0, false);
+        }
 
-        //Collect metadata from disks and mark unavailable ones
-        for (int diskIndex = 0; diskIndex < dev.m_Devices; ++diskIndex) {
-            if ( dev.m_Read(diskIndex, dev.m_Sectors - 1, buffer, 1) != 1 ) {
-                systemState.disksStatus[diskIndex] = true;
+        uint64_t delayUs = hedge.m_DelayUs > 0 ? hedge.m_DelayUs
+                                               : std::max<uint64_t>(hedge.m_MinDelayUs, stats.getDiskReadPercentile(hedge.m_Percentile));
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(delayUs);
+        bool hedgesPosted = false;
+        while ( true ) {
+            bool finished = true;
+            for (size_t requestIndex = 0; requestIndex < requests.size(); ++requestIndex) {
+                const THedgedRead &read = state->reads[requestIndex];
+                finished &= requests[requestIndex].completed || read.diskResult >= 0
+                            || ( read.hedged && !read.pendingSources && !read.sourcesFailed );
+            }
+            if ( finished ) break;
+            if ( hedgesPosted ) {
+                state->changed.wait(lock);
                 continue;
             }
-            memcpy(&disksMetadata[diskIndex].disksStatus, buffer, MAX_RAID_DEVICES);
-            memcpy(&disksMetadata[diskIndex].raidStatus, &buffer[MAX_RAID_DEVICES], sizeof(int));
+            if ( state->changed.wait_until(lock, deadline) != std::cv_status::timeout ) continue;
+
+            //Late reads get the same rows from all the other disks, provided they can give them
+            hedgesPosted = true;
+            for (size_t requestIndex = 0; requestIndex < requests.size(); ++requestIndex) {
+                const TDiskRequest &request = requests[requestIndex];
+                THedgedRead &read = state->reads[requestIndex];
+                if ( request.completed || read.diskResult >= 0 ) continue;
+                bool sourcesUsable = true;
+                for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex)
+                    sourcesUsable &= diskIndex == request.diskIndex || isDiskUsable(diskIndex, request.sectorIndex, request.sectorCount);
+                if ( !sourcesUsable ) continue;
+                read.hedged = true;
+                read.pendingSources = sourceCount;
+                stats.countHedge(false);
+                for (int diskIndex = 0, sourceIndex = 1; diskIndex < device.m_Devices; ++diskIndex)
+                    if ( diskIndex != request.diskIndex )
+                        postRead(requestIndex, diskIndex, request.sectorIndex, request.sectorCount,
+                                 sourceIndex++ * request.sectorCount * SECTOR_SIZE, true);
+            }
         }
-        
-        //Mark all disks with wrong metadata
-        Metadata standardMetadata = getStandardMetadata(disksMetadata);
-        markWrongMetadataDisks(disksMetadata, standardMetadata);
-        
-        //Check the RAID system status 
-        if ( countFailedDisks() > 1 ) return systemState.raidStatus = RAID_FAILED;
-        else if ( countFailedDisks() == 1) return systemState.raidStatus = RAID_DEGRADED;
-        return systemState.raidStatus = RAID_OK;
-    }
 
+        //The disk read is preferred once it is done, an unfinished one is abandoned; writes of its rows wait for it
+        for (size_t requestIndex = 0; requestIndex < requests.size(); ++requestIndex) {
+            TDiskRequest &request = requests[requestIndex];
+            THedgedRead &read = state->reads[requestIndex];
+            if ( request.completed ) continue;
+            request.completed = true;
+            size_t length = request.sectorCount * SECTOR_SIZE;
+            if ( read.runningReads ) {
+                read.abandoned = true;
+                std::lock_guard<std::mutex> abandonedLock(abandonedMutex);
+                abandonedRows.emplace_back(request.sectorIndex, request.sectorIndex + request.sectorCount - 1);
+            }
+            if ( read.diskResult == request.sectorCount ) {
+                memcpy(request.readDestination, read.buffer.data(), length);
+                request.result = request.sectorCount;
+                stripeCache.store(request.diskIndex, request.sectorIndex, request.readDestination, request.sectorCount);
+                if ( read.hedged ) noteHedgeResult(request.diskIndex, true);
+            }
+            else if ( read.diskResult < 0 ) {
+                const std::byte *sources[MAX_RAID_DEVICES];
+                for (int sourceIndex = 0; sourceIndex < sourceCount; ++sourceIndex)
+                    sources[sourceIndex] = read.buffer.data() + ( sourceIndex + 1 ) * length;
+                CXorEngine::xorSources(request.readDestination, sources, sourceCount, length);
+                request.result = request.sectorCount;
+                noteHedgeResult(request.diskIndex, false);
+            }
+            else {
+                request.result = read.diskResult;
+                stripeCache.invalidateDisk(request.diskIndex);
+            }
+        }
+    }
 
-    int stop ()
+    void loadLayout(const Metadata &metadata)
     {
-        //Insert current metadata into all the disks
-        for (int diskIndex = 0; diskIndex < this->device.m_Devices; ++diskIndex)
-            this->device.m_Write(diskIndex, this->device.m_Sectors - 1, &systemState, 1);
+        systemState.magic = metadata.magic;
+        systemState.volumeId = metadata.volumeId;
+        systemState.dataSectors = metadata.magic == Metadata::MAGIC ? metadata.dataSectors : device.m_Sectors - 1;
+        systemState.bitmapRegion = metadata.bitmapRegion;
+        systemState.bitmapSectors = metadata.bitmapSectors;
+        systemState.chunkSectors = std::max(metadata.chunkSectors, 1);
+        systemState.rotation = metadata.rotation;
+        systemState.sectorSize = metadata.sectorSize;
+        systemState.allocationRegion = metadata.allocationRegion;
+        systemState.allocationSectors = metadata.allocationSectors;
+        systemState.reshapeDevices = metadata.reshapeDevices;
+        systemState.reshapeWatermark = metadata.reshapeWatermark;
+        scrubRow = metadata.scrubRow > 0 && metadata.scrubRow < systemState.dataSectors ? metadata.scrubRow : 0;
 
-        //Update the status
-        return systemState.raidStatus = RAID_STOPPED;
-    }
+        //Sectors from the reshape watermark on are still in the previous layout, which gives the volume size until the
+        //reshape is complete
+        int volumeDevices = systemState.reshapeDevices ? systemState.reshapeDevices : device.m_Devices;
+        layout.reset(device.m_Devices, systemState.chunkSectors, (CRaidLayout::TRotation) systemState.rotation);
+        if ( systemState.reshapeDevices ) layout.setReshape(systemState.reshapeDevices, systemState.reshapeWatermark);
+        volumeSectors = (int64_t) ( volumeDevices - 1 ) * systemState.dataSectors;
+        reshaping = systemState.reshapeDevices != 0;
+        {
+            std::lock_guard<std::mutex> lock(gatherLock);
+            writeGather.reset(std::max(volumeDevices - 1, 1) * systemState.chunkSectors);
+            gatherSuspended = false;
+        }
 
+        //Bitmaps come from any working disk; without one every region has to be considered dirty and written
+        intentBitmap.reset(systemState.bitmapRegion, systemState.dataSectors);
+        if ( !loadBitmap(intentBitmap, getBitmapStart()) )
+            intentBitmap.setAll();
+        allocationBitmap.reset(systemState.allocationRegion, systemState.dataSectors);
+        if ( !loadBitmap(allocationBitmap, getAllocationStart()) )
+            allocationBitmap.setAll();
+    }
 
-    int resync ()
+    bool loadBitmap(CRegionBitmap &bitmap, int firstSector)
     {
-        //Check the status
-        if ( systemState.raidStatus != RAID_DEGRADED )
-            return systemState.raidStatus;
-
-        //Some variables
-        int failedDiskIndex = getFailedDiscIndex();
-        std::byte buffer[SECTOR_SIZE]{};
+        std::vector<std::byte> buffer(bitmap.getStoredSectors() * SECTOR_SIZE);
+        if ( !bitmap.getStoredSectors() ) return true;
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+            if ( systemState.disksStatus[diskIndex] ) continue;
+            if ( deviceRead(diskIndex, firstSector, buffer.data(), bitmap.getStoredSectors()) == bitmap.getStoredSectors() ) {
+                bitmap.load(buffer.data());
+                return true;
+            }
+        }
+        return false;
+    }
 
-        //Go through all sectors (except for the bottom one with metadata) of previously failed disk and restore them
-        for (int sectorIndex = 0; sectorIndex < device.m_Sectors - 1; ++sectorIndex) {
-            //Calculate parity of the sector from the stripe and put it in the buffer; in case another disk failed, memory is lost
-            if ( !calculateParity(failedDiskIndex, sectorIndex, buffer) )
-                return systemState.raidStatus = RAID_FAILED;
+    //A disk still carrying the metadata of this volume holds its old data, so only the regions written meanwhile
+    //need a rebuild; a brand new disk needs all of them
+    bool isReturningMember(int diskIndex)
+    {
+        std::byte buffer[SECTOR_SIZE];
+        Metadata diskMetadata;
+        if ( deviceRead(diskIndex, device.m_Sectors - 1, buffer, 1) != 1 )
+            return false;
+        diskMetadata.load(buffer);
+        return diskMetadata.magic == Metadata::MAGIC && diskMetadata.volumeId == systemState.volumeId;
+    }
 
-            //If attempt to write failed, disk is still not working, same state
-            if ( device.m_Write(failedDiskIndex, sectorIndex, buffer, 1) != 1 )
-                return systemState.raidStatus;
+    //Records the rows in the write-intent bitmap if some disk is not going to receive them
+    void markWriteIntent(int firstSector, int lastSector)
+    {
+        bool missing = false;
+        for (int diskIndex = 0; diskIndex < device.m_Devices && !missing; ++diskIndex)
+            missing = !isDiskUsable(diskIndex, firstSector, lastSector - firstSector + 1);
+        if ( missing ) {
+            std::lock_guard<std::mutex> lock(bitmapMutex);
+            intentBitmap.setRange(firstSector, lastSector);
         }
-
-        systemState.resetDisksStatus();
-        return systemState.raidStatus = RAID_OK;
+        flushIntentBitmap();
     }
 
+    void flushIntentBitmap()
+    {
+        flushBitmap(intentBitmap, bitmapMutex, getBitmapStart());
+    }
 
-    int status () const
+    void flushAllocationBitmap()
     {
-        return systemState.raidStatus;
+        flushBitmap(allocationBitmap, allocationMutex, getAllocationStart());
     }
 
+    //Writes the changed sectors of the bitmap into all the working disks; flushes run one at a time, so that a newer
+    //snapshot of a bitmap never gets overwritten by an older one. Returns once the bits set before the call are stored;
+    //with everything stored already (the usual case of a write in RAID_OK) it takes no lock at all.
+    void flushBitmap(CRegionBitmap &bitmap, std::mutex &bitmapLock, int firstSector)
+    {
+        if ( bitmap.isStored() ) return;
+        std::lock_guard<std::mutex> flushLock(bitmapFlushMutex);
+        if ( bitmap.isStored() ) return;
+        std::vector<std::byte> snapshot;
+        std::vector<TDiskRequest> requests;
+        uint64_t changes;
+        {
+            std::lock_guard<std::mutex> lock(bitmapLock);
+            changes = bitmap.getChanges();
+            snapshot.resize((size_t) bitmap.getChangedSectorCount() * SECTOR_SIZE);
+            std::byte *sector = snapshot.data();
+            for (int storedSector = 0; storedSector < bitmap.getStoredSectors(); ++storedSector) {
+                if ( !bitmap.isSectorChanged(storedSector) ) continue;
+                memcpy(sector, bitmap.getSector(storedSector), SECTOR_SIZE);
+                for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex)
+                    if ( !isDiskFailed(diskIndex) )
+                        requests.push_back({ diskIndex, firstSector + storedSector, 1, nullptr, sector });
+                sector += SECTOR_SIZE;
+            }
+            bitmap.markStored();
+        }
+
+        runRequests(device, ioWorkers, requests, &stats);
+        for (const auto &request : requests)
+            completeWrite(request.diskIndex, request.sectorIndex, request.sectorCount, request.succeeded());
+        bitmap.setStored(changes);
+    }
 
-    int size () const
+    //Write-intent bitmap lies right in front of the metadata sector
+    int getBitmapStart() const
     {
-        return (device.m_Devices - 1) * (device.m_Sectors - 1);
+        return device.m_Sectors - 1 - systemState.bitmapSectors;
     }
 
+    //Allocation bitmap lies in front of the write-intent bitmap
+    int getAllocationStart() const
+    {
+        return getBitmapStart() - systemState.allocationSectors;
+    }
 
-    bool read ( int secNr, void * data, int secCnt )
+    bool checkedRead(int diskIndex, int sectorIndex, std::byte *destination, int sectorCount = 1)
     {
-        //Status check
-        if ( systemState.raidStatus == RAID_STOPPED || systemState.raidStatus == RAID_FAILED )
-            return false;
+        bool readSucceeded = isDiskUsable(diskIndex, sectorIndex, sectorCount)
+                             && backendRead(diskIndex, sectorIndex, destination, sectorCount) == sectorCount;
+        return completeRead(diskIndex, sectorIndex, destination, sectorCount, readSucceeded);
+    }
 
-        //Some variables
-        std::byte buffer[SECTOR_SIZE]{};
+    //Updates the system state after a read of the disk, reconstructs the data in case the disk is not usable
+    bool completeRead(int diskIndex, int sectorIndex, std::byte *destination, int sectorCount, bool readSucceeded)
+    {
+        if ( readSucceeded )
+            return true;
 
-        //Main loop that goes through all the sectors that we need to read
-        for (int absoluteSectorIndex = secNr; absoluteSectorIndex < secNr + secCnt; ++absoluteSectorIndex) {
-            auto [diskIndex, diskSector] = getRelativeIndexes(absoluteSectorIndex);
+        //Failed to read the rebuilt part of the disk being resynced -> the rebuild starts over
+        if ( isDiskFailed(diskIndex) ) {
+            if ( isDiskUsable(diskIndex, sectorIndex, sectorCount) )
+                rebuildWatermark = 0;
+        }
+        //Failed to read in normal state -> degraded, try to read the same sector as failed one;
+        //failed in degraded state -> Disk failed
+        else if ( failDisk(diskIndex) == RAID_FAILED )
+            return false;
 
-            //Read with the system state checking
-            if ( !checkedRead(diskIndex, diskSector, buffer) )
+        //Reading from a failed disk -> parity needs to be calculated
+        {
+            if ( !calculateParity(diskIndex, sectorIndex, destination, sectorCount) ) {
+                failRaid();
                 return false;
-
-            //Transfer read data into the reading destination
-            memcpy( ( std::byte* ) data + ( absoluteSectorIndex - secNr ) * SECTOR_SIZE, buffer, SECTOR_SIZE);
+            }
         }
         return true;
     }
 
-
-    bool write ( int secNr, const void * data, int secCnt )
+    //Writes consecutive rows fully covered by new data; parity comes from the new data alone and every disk gets one call
+    bool fullStripeWrite(int sectorIndex, const std::vector<TRowSources> &rows)
     {
-        //Status check
-        if ( systemState.raidStatus == RAID_STOPPED || systemState.raidStatus == RAID_FAILED )
-            return false;
+        int sectorCount = (int) rows.size();
+        CBufferArena::CBuffer buffer = bufferArena.acquire(device.m_Devices * sectorCount * SECTOR_SIZE);
+        std::vector<TDiskRequest> requests;
+        stats.countFullStripeRows(sectorCount);
 
-        //Some variables
-        std::byte buffer[SECTOR_SIZE]{};
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
+            //Nothing to be written into a failed disk, except for the part already rebuilt by resync
+            int usableCount = getUsableSectorCount(diskIndex, sectorIndex, sectorCount);
+            if ( usableCount == 0 ) continue;
+
+            //Data rows of the disk lying one after another in the caller memory are written from there
+            const std::byte *direct = rows[0][diskIndex];
+            for (int rowIndex = 0; direct && rowIndex < usableCount; ++rowIndex)
+                if ( diskIndex == layout.getParityDisk(sectorIndex + rowIndex) || rows[rowIndex][diskIndex] != direct + rowIndex * SECTOR_SIZE )
+                    direct = nullptr;
+            if ( direct ) {
+                requests.push_back({ diskIndex, sectorIndex, usableCount, nullptr, direct });
+                continue;
+            }
 
-        //Main loop that goes through all the sectors that we need to write into
-        for (int absoluteSectorIndex = secNr; absoluteSectorIndex < secNr + secCnt; ++absoluteSectorIndex) {
-            //Transfer input data sector into the buffer
-            memcpy(buffer,  ( std::byte* ) data + ( absoluteSectorIndex - secNr ) * SECTOR_SIZE, SECTOR_SIZE);
+            //Gather the disk content of all the rows: either the new data or the freshly calculated parity
+            std::byte *diskBuffer = buffer.data() + diskIndex * sectorCount * SECTOR_SIZE;
+            for (int rowIndex = 0; rowIndex < usableCount; ++rowIndex) {
+                std::byte *destination = diskBuffer + rowIndex * SECTOR_SIZE;
+                if ( diskIndex != layout.getParityDisk(sectorIndex + rowIndex) ) {
+                    memcpy(destination, rows[rowIndex][diskIndex], SECTOR_SIZE);
+                    continue;
+                }
+                const std::byte *sources[MAX_RAID_DEVICES];
+                int sourceCount = 0;
+                for (int dataDiskIndex = 0; dataDiskIndex < device.m_Devices; ++dataDiskIndex)
+                    if ( dataDiskIndex != diskIndex )
+                        sources[sourceCount++] = rows[rowIndex][dataDiskIndex];
+                CXorEngine::xorSources(destination, sources, sourceCount, SECTOR_SIZE);
+            }
 
-            //Some more variables
-            auto [diskIndex, diskSector] = getRelativeIndexes(absoluteSectorIndex);
+            requests.push_back({ diskIndex, sectorIndex, usableCount, nullptr, diskBuffer });
+        }
 
-            //Write the data with system state checks
-            if ( !checkedWrite(diskIndex, diskSector, buffer) )
+        //Write all the disks at once, then check the system state disk by disk
+        backendRequests(requests);
+        for (const auto &request : requests)
+            if ( !completeWrite(request.diskIndex, request.sectorIndex, request.sectorCount, request.succeeded()) )
                 return false;
-        }
         return true;
     }
 
-
-protected:
-    Metadata getStandardMetadata (Metadata* disksMetadata) const
+    //Writes new data into the given row; sources[diskIndex] is the new content of that data disk or nullptr if untouched
+    bool checkedWrite(int sectorIndex, const std::byte **sources)
     {
-        if ( device.m_Devices <= 0) return {};
-        if ( device.m_Devices < 3 ) return disksMetadata[0];
-        return disksMetadata[0] == disksMetadata[1] ? disksMetadata[0] : disksMetadata[2];
-    }
+        int parityDiskIndex = layout.getParityDisk(sectorIndex);
 
-    void markWrongMetadataDisks(Metadata* disksMetadata, Metadata& standardMetadata)
-    {
+        //Parity disk is gone -> there is nothing to keep consistent, just write the data
+        if ( !isDiskUsable(parityDiskIndex, sectorIndex) )
+            return writeRowData(sectorIndex, sources);
+
+        //Count reads needed by both strategies (a failed disk has to be reconstructed from the rest of the row)
+        int readModifyWriteCost = 1, reconstructWriteCost = 0;
         for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
-            if ( disksMetadata[diskIndex] != standardMetadata )
-                systemState.disksStatus[diskIndex] = true;
+            if ( diskIndex == parityDiskIndex ) continue;
+            int cost = isDiskUsable(diskIndex, sectorIndex) ? 1 : device.m_Devices - 1;
+            if ( sources[diskIndex] ) readModifyWriteCost += cost;
+            else reconstructWriteCost += cost;
         }
+
+        //Full stripe has nothing to read, so it always ends up here
+        if ( reconstructWriteCost < readModifyWriteCost )
+            return reconstructWrite(sectorIndex, sources);
+        return readModifyWrite(sectorIndex, sources);
     }
-    
-    int countFailedDisks()
+
+    //Parity is calculated from the new data and the untouched members of the row
+    bool reconstructWrite(int sectorIndex, const std::byte **sources)
     {
-        int counter = 0;
+        CBufferArena::CBuffer buffer = bufferArena.acquire(( device.m_Devices + 1 ) * SECTOR_SIZE);
+        std::byte *parityBuffer = buffer.data() + device.m_Devices * SECTOR_SIZE;
+        auto oldSectorsData = [&buffer](int diskIndex) { return buffer.data() + diskIndex * SECTOR_SIZE; };
+        const std::byte *paritySources[MAX_RAID_DEVICES];
+        int parityDiskIndex = layout.getParityDisk(sectorIndex), sourceCount = 0;
+        stats.countReconstructWrite();
+
         for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
-            if ( systemState.disksStatus[diskIndex] )
-                ++counter;
+            if ( diskIndex == parityDiskIndex ) continue;
+            if ( sources[diskIndex] ) {
+                paritySources[sourceCount++] = sources[diskIndex];
+                continue;
+            }
+            //Untouched member -> its current content is a part of the new parity
+            if ( !checkedRead(diskIndex, sectorIndex, oldSectorsData(diskIndex)) )
+                return false;
+            paritySources[sourceCount++] = oldSectorsData(diskIndex);
         }
-        return counter;
+        CXorEngine::xorSources(parityBuffer, paritySources, sourceCount, SECTOR_SIZE);
+
+        if ( !writeRowData(sectorIndex, sources) )
+            return false;
+        return writeRowParity(sectorIndex, parityBuffer);
     }
 
-    int getFailedDiscIndex()
+    //Old data of the touched members is removed from the old parity and the new data is added to it
+    bool readModifyWrite(int sectorIndex, const std::byte **sources)
     {
+        CBufferArena::CBuffer buffer = bufferArena.acquire(( device.m_Devices + 1 ) * SECTOR_SIZE);
+        std::byte *parityBuffer = buffer.data() + device.m_Devices * SECTOR_SIZE;
+        auto oldSectorsData = [&buffer](int diskIndex) { return buffer.data() + diskIndex * SECTOR_SIZE; };
+        const std::byte *paritySources[2 * MAX_RAID_DEVICES];
+        int parityDiskIndex = layout.getParityDisk(sectorIndex), sourceCount = 0;
+        stats.countReadModifyWrite();
+
+        //Read the old parity
+        if ( !checkedRead(parityDiskIndex, sectorIndex, parityBuffer) )
+            return false;
+        paritySources[sourceCount++] = parityBuffer;
+
+        //Read the old data sectors, old data is xored out of the parity and the new one is xored in
         for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
-            if ( systemState.disksStatus[diskIndex] )
-                return diskIndex;
+            if ( !sources[diskIndex] ) continue;
+            if ( !checkedRead(diskIndex, sectorIndex, oldSectorsData(diskIndex)) )
+                return false;
+            paritySources[sourceCount++] = oldSectorsData(diskIndex);
+            paritySources[sourceCount++] = sources[diskIndex];
         }
-        return MAX_RAID_DEVICES;
+        CXorEngine::xorSources(parityBuffer, paritySources, sourceCount, SECTOR_SIZE);
+
+        if ( !writeRowData(sectorIndex, sources) )
+            return false;
+        return writeRowParity(sectorIndex, parityBuffer);
     }
 
-    bool calculateParity(int failedDiskIndex, int sectorIndex, std::byte *parityBuffer)
+    bool writeRowData(int sectorIndex, const std::byte **sources)
     {
-        std::byte buffer[SECTOR_SIZE]{};
-        memset(parityBuffer, 0, SECTOR_SIZE);
+        //If disk still works, write the new sector data
         for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex) {
-            if ( diskIndex == failedDiskIndex ) continue;
-            if ( device.m_Read(diskIndex, sectorIndex, buffer, 1) != 1 ) {
-                systemState.disksStatus[diskIndex] = true;
-                systemState.raidStatus = RAID_FAILED;
+            if ( !sources[diskIndex] || !isDiskUsable(diskIndex, sectorIndex) ) continue;
+            if ( !atomicWrite(diskIndex, sectorIndex, sources[diskIndex]) )
                 return false;
-            }
-            xorBuffer(parityBuffer, buffer);
         }
         return true;
-
     }
 
-    static void xorBuffer(std::byte *lhsBuffer, std::byte *rhsBuffer)
+    bool writeRowParity(int sectorIndex, const std::byte *parityBuffer)
     {
-        for (int i = 0; i < SECTOR_SIZE; ++i) {
-            lhsBuffer[i] ^= rhsBuffer[i];
+        //If parity disk still works, write the new parity
+        int parityDiskIndex = layout.getParityDisk(sectorIndex);
+        if ( !isDiskUsable(parityDiskIndex, sectorIndex) )
+            return true;
+        return atomicWrite(parityDiskIndex, sectorIndex, parityBuffer);
+    }
+
+    bool atomicWrite( int diskIndex, int sectorIndex, const std::byte *source, int sectorCount = 1 ) {
+        return completeWrite(diskIndex, sectorIndex, sectorCount, backendWrite(diskIndex, sectorIndex, source, sectorCount) == sectorCount);
+    }
+
+    //Updates the system state after a write into the disk, the disk has missed the sectors in case of a failure
+    bool completeWrite( int diskIndex, int sectorIndex, int sectorCount, bool writeSucceeded ) {
+        if ( writeSucceeded )
+            return true;
+
+        //Failed to write the rebuilt part of the disk being resynced -> the rebuild starts over; the watermark is
+        //reset before the bits are set, so that resync never clears them
+        bool rebuildFailed = isDiskFailed(diskIndex);
+        if ( rebuildFailed )
+            rebuildWatermark = 0;
+        {
+            std::lock_guard<std::mutex> lock(bitmapMutex);
+            intentBitmap.setRange(sectorIndex, sectorIndex + sectorCount - 1);
         }
+        if ( rebuildFailed )
+            return true;
 
+        //Failed to write in normal state -> degraded, that's fine; failed in degraded state -> Disk failed
+        return failDisk(diskIndex) != RAID_FAILED;
     }
 
-    std::pair<int, int> getRelativeIndexes(int sectorIndex) const
+    int getRaidStatus() const
     {
-        int shift = device.m_Devices * (device.m_Devices - 1);
-        sectorIndex += (int) (sectorIndex / device.m_Devices) + 1 + (int)(sectorIndex / shift);
-        return make_pair(sectorIndex % device.m_Devices, (int) (sectorIndex / device.m_Devices));
+        return (int) ( stateWord.load() >> STATUS_SHIFT );
     }
 
-    bool checkedRead(int diskIndex, int sectorIndex, std::byte *destination)
+    bool isDiskFailed(int diskIndex) const
     {
-        //Reading from a normal disk
-        if ( !systemState.disksStatus[diskIndex] ) {
-            if ( device.m_Read(diskIndex, sectorIndex, destination, 1) != 1 ) {
-                //Failed to read in normal state -> update current metadata and try to read the same sector as failed one
-                if (systemState.raidStatus == RAID_OK) {
-                    systemState.raidStatus = RAID_DEGRADED;
-                    systemState.disksStatus[diskIndex] = true;
-                }
-                //Failed in degraded state -> Disk failed
-                else {
-                    systemState.raidStatus = RAID_FAILED;
-                    systemState.disksStatus[diskIndex] = true;
-                    return false;
-                }
-            }
+        return stateWord.load() >> diskIndex & 1;
+    }
+
+    //Publishes the status kept in systemState as the live one
+    int publishState(int raidStatus)
+    {
+        uint32_t state = (uint32_t) raidStatus << STATUS_SHIFT;
+        for (int diskIndex = 0; diskIndex < MAX_RAID_DEVICES; ++diskIndex)
+            if ( systemState.disksStatus[diskIndex] )
+                state |= 1u << diskIndex;
+        systemState.raidStatus = raidStatus;
+        stateWord = state;
+        return raidStatus;
+    }
+
+    //Writes the current metadata into all the disks
+    void storeMetadata()
+    {
+        std::byte metadataSector[SECTOR_SIZE];
+        std::vector<TDiskRequest> requests;
+        captureState();
+        systemState.store(metadataSector);
+        if ( ioWorkers.workerCount() ) ioWorkers.waitIdle();
+        for (int diskIndex = 0; diskIndex < device.m_Devices; ++diskIndex)
+            requests.push_back({ diskIndex, device.m_Sectors - 1, 1, nullptr, metadataSector });
+        runRequests(device, ioWorkers, requests, &stats);
+    }
+
+    //Copies the live status into systemState, so that it can be stored
+    void captureState()
+    {
+        uint32_t state = stateWord.load();
+        for (int diskIndex = 0; diskIndex < MAX_RAID_DEVICES; ++diskIndex)
+            systemState.disksStatus[diskIndex] = state >> diskIndex & 1;
+        systemState.raidStatus = (int) ( state >> STATUS_SHIFT );
+    }
+
+    //The disk stopped answering: OK -> DEGRADED, DEGRADED -> FAILED; a disk failed before changes nothing,
+    //so concurrent requests noticing the same failure agree on the result. Returns the new RAID status.
+    int failDisk(int diskIndex)
+    {
+        uint32_t state = stateWord.load(), newState;
+        do {
+            if ( state >> diskIndex & 1 )
+                return (int) ( state >> STATUS_SHIFT );
+            int raidStatus = (int) ( state >> STATUS_SHIFT );
+            if ( raidStatus == RAID_OK ) raidStatus = RAID_DEGRADED;
+            else if ( raidStatus == RAID_DEGRADED ) raidStatus = RAID_FAILED;
+            newState = (uint32_t) raidStatus << STATUS_SHIFT | ( state & DISKS_MASK ) | 1u << diskIndex;
+        } while ( !stateWord.compare_exchange_weak(state, newState) );
+        return (int) ( newState >> STATUS_SHIFT );
+    }
+
+    //Data are lost, failed disks stay marked
+    void failRaid()
+    {
+        uint32_t state = stateWord.load();
+        while ( !stateWord.compare_exchange_weak(state, (uint32_t) RAID_FAILED << STATUS_SHIFT | ( state & DISKS_MASK )) );
+    }
+
+    //Rebuilt disk joins the array again, unless anything else has failed meanwhile
+    bool restoreDisk(int diskIndex)
+    {
+        uint32_t state = (uint32_t) RAID_DEGRADED << STATUS_SHIFT | 1u << diskIndex;
+        return stateWord.compare_exchange_strong(state, (uint32_t) RAID_OK << STATUS_SHIFT);
+    }
+
+    //Live status word: bits 0-15 failed disks, the RAID status above them
+    static constexpr int STATUS_SHIFT = MAX_RAID_DEVICES;
+    static constexpr uint32_t DISKS_MASK = ( 1u << STATUS_SHIFT ) - 1;
+
+    TBlkDev device = TBlkDev();
+    Metadata systemState;
+    CRaidLayout layout;
+    std::atomic<uint32_t> stateWord { (uint32_t) RAID_STOPPED << STATUS_SHIFT };
+    CStripeCache stripeCache;
+    CDiskWorkers ioWorkers;
+    CRowLocks rowLocks;
+    CIoTracer tracer;
+    CRaidStats stats;
+    CBufferArena bufferArena;
+
+    //Hedged reads, reads lost in a row and the end of the demotion (steady clock microseconds) per disk
+    THedgeConfig hedge;
+    std::atomic<int> slowReads[MAX_RAID_DEVICES] {};
+    std::atomic<int64_t> demotedUntil[MAX_RAID_DEVICES] {};
+    //Disk rows (first, last) still being read by the abandoned reads
+    std::mutex abandonedMutex;
+    std::condition_variable abandonedDone;
+    std::vector<std::pair<int, int>> abandonedRows;
+
+    //Write gathering: the buffered stripes, the lock guarding the buffer (never held over disk I/O), the stripes
+    //finishing their write out and the thread writing out the expired ones
+    TGatherConfig gather;
+    CWriteGather writeGather;
+    std::mutex gatherLock;
+    std::condition_variable gatherDone;
+    //Set while the last reshape batch runs, writes bypass the buffer then
+    bool gatherSuspended = false;
+    std::atomic<bool> gatherFailed { false };
+    std::thread gatherThread;
+    std::mutex gatherThreadMutex;
+    std::condition_variable gatherWake;
+    bool gatherStopping = false;
+
+    //Resync state, sectors of the rebuilt disk below the watermark are already restored; rows from the watermark
+    //up to the window end are being rebuilt and not written by the foreground
+    std::mutex resyncMutex;
+    std::atomic<int> rebuildDiskIndex { -1 };
+    std::atomic<int> rebuildWatermark { 0 };
+    std::mutex rebuildWindowMutex;
+    std::condition_variable rebuildWindowChanged;
+    int rebuildWindowEnd = 0;
+    int resyncRate = 0;
+    long long resyncThrottledSectors = 0;
+    std::chrono::steady_clock::time_point resyncStartTime;
+
+    //Parity scrub: position (row), finished passes, throttling and the background thread
+    TScrubConfig scrub;
+    std::mutex scrubMutex;
+    std::atomic<int> scrubRow { 0 };
+    std::atomic<int> scrubPasses { 0 };
+    std::chrono::steady_clock::time_point scrubStartTime;
+    long long scrubThrottledRows = 0;
+    std::thread scrubThread;
+    std::mutex scrubThreadMutex;
+    std::condition_variable scrubWake;
+    bool scrubStopping = false;
+
+    //Regions written while some disk was not receiving the data
+    std::mutex bitmapMutex;
+    std::mutex bitmapFlushMutex;
+    CRegionBitmap intentBitmap;
+
+    //Regions written since create (or since their discard)
+    std::mutex allocationMutex;
+    CRegionBitmap allocationBitmap;
+
+    //Reshape onto one more disk: the lock ordering the batches and the reshape start (exclusively) against the
+    //requests (always shared, a request keeps the layout it started with), the device with the new disk until it
+    //joins and its rows cleared so far; the volume size changes once the reshape is complete
+    mutable std::mutex reshapeStepMutex;
+    std::shared_mutex reshapeMutex;
+    std::atomic<bool> reshaping { false };
+    TBlkDev reshapeDevice = TBlkDev();
+    int reshapeClearedRows = 0;
+    std::atomic<int64_t> volumeSectors { 0 };
+};
+
+//Asynchronous front end of a volume: requests are submitted in batches and a dispatcher thread takes everything
+//pending at once. Requests not depending on each other are sorted by sector and adjacent ones of the same kind are
+//merged into a single volume call; every request gets its own completion.
+class CIoQueue
+{
+public:
+    struct TRequest
+    {
+        bool m_Write;
+        int64_t m_SecNr;
+        int m_SecCnt;
+        //Destination of a read, source of a write; it has to stay valid until the completion is reaped
+        void *m_Buffer;
+        uint64_t m_Tag;
+    };
+
+    struct TCompletion
+    {
+        uint64_t m_Tag;
+        bool m_Succeeded;
+    };
+
+    struct TStats
+    {
+        size_t m_Requests = 0;
+        size_t m_VolumeCalls = 0;
+    };
+
+    explicit CIoQueue(CRaidVolume &volume)
+        : volume(volume), dispatcher(&CIoQueue::dispatchLoop, this)
+    {
+    }
+
+    CIoQueue(const CIoQueue&) = delete;
+    CIoQueue& operator=(const CIoQueue&) = delete;
+
+    //Requests submitted so far are still executed
+    ~CIoQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
         }
-        //Reading from a failed disk -> parity needs to be calculated
-        if ( systemState.disksStatus[diskIndex] ) {
-            if ( !calculateParity(diskIndex, sectorIndex, destination) ) {
-                systemState.raidStatus = RAID_FAILED;
-                return false;
-            }
+        wakeUp.notify_one();
+        dispatcher.join();
+    }
+
+    void submit(const std::vector<TRequest> &requests)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            submitted.insert(submitted.end(), requests.begin(), requests.end());
+            inFlight += requests.size();
         }
-        return true;
+        wakeUp.notify_one();
     }
 
-    bool checkedWrite(int diskIndex, int sectorIndex, std::byte *source) {
-        std::byte parityBuffer[SECTOR_SIZE]{}, oldSectorData[SECTOR_SIZE]{};
-        int parityDiskIndex = sectorIndex % device.m_Devices;
+    //Waits until at least minCount completions are available (or nothing is in flight anymore), appends all the
+    //available ones and returns their count
+    size_t reap(std::vector<TCompletion> &completions, size_t minCount = 1)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        completed.wait(lock, [this, minCount] { return ready.size() >= minCount || inFlight == ready.size(); });
+        size_t count = ready.size();
+        completions.insert(completions.end(), ready.begin(), ready.end());
+        inFlight -= count;
+        ready.clear();
+        return count;
+    }
 
-        //Read the old sector data
-        if ( !checkedRead(diskIndex, sectorIndex, oldSectorData) )
-            return false;
+    TStats getStats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
 
-        //Read the old parity
-        if (!checkedRead(parityDiskIndex, sectorIndex, parityBuffer))
-            return false;
+private:
+    //Upper bound of sectors of a merged volume call
+    static constexpr int MAX_MERGED_SECTORS = 2048;
 
-        //If disk still works, write the new sector data
-        if ( !systemState.disksStatus[diskIndex] && !atomicWrite(diskIndex, sectorIndex, source))
-            return false;
+    void dispatchLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while ( true ) {
+            wakeUp.wait(lock, [this] { return stopping || !submitted.empty(); });
+            if ( submitted.empty() ) return;
+            std::vector<TRequest> batch;
+            batch.swap(submitted);
+            lock.unlock();
 
-        //If parity disk still works, calculate new parity and update it
-        if ( !systemState.disksStatus[parityDiskIndex] ) {
-            //First xor to remove old data, second xor to include the new one
-            xorBuffer(parityBuffer, oldSectorData);
-            xorBuffer(parityBuffer, source);
+            std::vector<TCompletion> completions;
+            size_t volumeCalls = executeBatch(batch, completions);
 
-            //Write the new parity
-            if ( !atomicWrite(parityDiskIndex, sectorIndex, parityBuffer) )
-                return false;
+            lock.lock();
+            ready.insert(ready.end(), completions.begin(), completions.end());
+            stats.m_Requests += batch.size();
+            stats.m_VolumeCalls += volumeCalls;
+            completed.notify_all();
         }
+    }
 
-        return true;
+    static bool isConflicting(const TRequest &first, const TRequest &second)
+    {
+        return ( first.m_Write || second.m_Write ) && first.m_SecNr < second.m_SecNr + second.m_SecCnt
+               && second.m_SecNr < first.m_SecNr + first.m_SecCnt;
     }
 
-    bool atomicWrite( int diskIndex, int sectorIndex, std::byte *source ) {
-        if ( device.m_Write(diskIndex, sectorIndex, source, 1) != 1 ) {
-            //Failed to write in normal state -> update current metadata, that's fine
-            if (systemState.raidStatus == RAID_OK) {
-                systemState.raidStatus = RAID_DEGRADED;
-                systemState.disksStatus[diskIndex] = true;
+    //Splits the batch into epochs, a request overlapping a write of the current epoch (or a write overlapping
+    //anything) starts a new one, so that the order of dependent requests is kept
+    size_t executeBatch(const std::vector<TRequest> &batch, std::vector<TCompletion> &completions)
+    {
+        size_t epochStart = 0, volumeCalls = 0;
+        for (size_t requestIndex = 0; requestIndex <= batch.size(); ++requestIndex) {
+            bool conflicting = requestIndex == batch.size();
+            for (size_t earlierIndex = epochStart; !conflicting && earlierIndex < requestIndex; ++earlierIndex)
+                conflicting = isConflicting(batch[earlierIndex], batch[requestIndex]);
+            if ( !conflicting ) continue;
+            volumeCalls += executeEpoch(batch, epochStart, requestIndex, completions);
+            epochStart = requestIndex;
+        }
+        return volumeCalls;
+    }
+
+    //Sorts the independent requests by volume sector and merges neighbours of the same kind. Ascending volume sectors
+    //map onto ascending sectors of every member disk, so the order is the elevator sweep of each disk as well, and the
+    //per-disk runs of a merged call are coalesced by the volume. A merged call that fails is repeated request by
+    //request, so that every request gets its own status.
+    size_t executeEpoch(const std::vector<TRequest> &batch, size_t first, size_t last, std::vector<TCompletion> &completions)
+    {
+        std::vector<const TRequest*> order;
+        for (size_t requestIndex = first; requestIndex < last; ++requestIndex)
+            order.push_back(&batch[requestIndex]);
+        std::stable_sort(order.begin(), order.end(), [](const TRequest *a, const TRequest *b) {
+            return a->m_SecNr < b->m_SecNr;
+        });
+
+        size_t volumeCalls = 0;
+        for (size_t groupStart = 0, groupEnd; groupStart < order.size(); groupStart = groupEnd) {
+            //Reads may overlap each other, writes of an epoch never do
+            int64_t secNr = order[groupStart]->m_SecNr, endSector = secNr + order[groupStart]->m_SecCnt;
+            bool write = order[groupStart]->m_Write;
+            for (groupEnd = groupStart + 1; groupEnd < order.size(); ++groupEnd) {
+                const TRequest &next = *order[groupEnd];
+                if ( next.m_Write != write || next.m_SecNr > endSector
+                     || std::max(endSector, next.m_SecNr + next.m_SecCnt) - secNr > MAX_MERGED_SECTORS ) break;
+                endSector = std::max(endSector, next.m_SecNr + next.m_SecCnt);
             }
-            //Failed in degraded state -> Disk failed
-            else {
-                systemState.raidStatus = RAID_FAILED;
-                systemState.disksStatus[diskIndex] = true;
-                return false;
+
+            bool succeeded = executeGroup(order, groupStart, groupEnd, secNr, (int) ( endSector - secNr ));
+            ++volumeCalls;
+            for (size_t requestIndex = groupStart; requestIndex < groupEnd; ++requestIndex) {
+                const TRequest &request = *order[requestIndex];
+                bool requestSucceeded = succeeded;
+                if ( !succeeded && groupEnd - groupStart > 1 ) {
+                    requestSucceeded = executeGroup(order, requestIndex, requestIndex + 1, request.m_SecNr, request.m_SecCnt);
+                    ++volumeCalls;
+                }
+                completions.push_back({ request.m_Tag, requestSucceeded });
             }
         }
+        return volumeCalls;
+    }
+
+    bool executeGroup(const std::vector<const TRequest*> &order, size_t first, size_t last, int64_t secNr, int secCnt)
+    {
+        const TRequest &request = *order[first];
+        if ( last - first == 1 )
+            return request.m_Write ? volume.write(secNr, request.m_Buffer, secCnt) : volume.read(secNr, request.m_Buffer, secCnt);
+
+        //Requests following each other go to the volume as the segments of a single vectored call, overlapping
+        //reads are staged in a common buffer
+        std::vector<TIoSegment> segments;
+        int64_t endSector = secNr;
+        for (size_t requestIndex = first; requestIndex < last && order[requestIndex]->m_SecNr == endSector; ++requestIndex) {
+            segments.push_back({ order[requestIndex]->m_Buffer, (size_t) order[requestIndex]->m_SecCnt * SECTOR_SIZE });
+            endSector += order[requestIndex]->m_SecCnt;
+        }
+        if ( segments.size() == last - first )
+            return request.m_Write ? volume.writev(secNr, segments.data(), (int) segments.size())
+                                   : volume.readv(secNr, segments.data(), (int) segments.size());
+
+        std::vector<std::byte> buffer((size_t) secCnt * SECTOR_SIZE);
+        if ( request.m_Write ) {
+            for (size_t requestIndex = first; requestIndex < last; ++requestIndex)
+                memcpy(buffer.data() + (size_t) ( order[requestIndex]->m_SecNr - secNr ) * SECTOR_SIZE,
+                       order[requestIndex]->m_Buffer, (size_t) order[requestIndex]->m_SecCnt * SECTOR_SIZE);
+            return volume.write(secNr, buffer.data(), secCnt);
+        }
+
+        if ( !volume.read(secNr, buffer.data(), secCnt) )
+            return false;
+        for (size_t requestIndex = first; requestIndex < last; ++requestIndex)
+            memcpy(order[requestIndex]->m_Buffer, buffer.data() + (size_t) ( order[requestIndex]->m_SecNr - secNr ) * SECTOR_SIZE,
+                   (size_t) order[requestIndex]->m_SecCnt * SECTOR_SIZE);
         return true;
     }
 
-    TBlkDev device = TBlkDev();
-    Metadata systemState;
+    CRaidVolume &volume;
+    mutable std::mutex mutex;
+    std::condition_variable wakeUp;
+    std::condition_variable completed;
+    std::vector<TRequest> submitted;
+    std::vector<TCompletion> ready;
+    size_t inFlight = 0;
+    bool stopping = false;
+    TStats stats;
+    std::thread dispatcher;
 };
 
 #ifndef __PROGTEST__
+#include "backends.cpp"
+#ifdef RAID_BENCHMARK
+#include "bench.cpp"
+#elif defined(RAID_REPLAY)
+#include "replay.cpp"
+#else
 #include "tests.cpp"
+#endif
 
 #endif /* __PROGTEST__ */
@@ -0,0 +1,292 @@
+/* SW RAID5 - trace replay
+ *
+ * Built instead of the tests when RAID_REPLAY is defined:
+ *
+ *   g++ -std=c++20 -O2 -DRAID_REPLAY main.cpp -o replay
+ *   ./replay trace [timed] [threads=N] [backend=memory|pread|direct|mmap] [parallel] [degraded]
+ *
+ * The trace comes from CRaidVolume::startTrace. A fresh volume of the traced geometry is created over the chosen
+ * backend (sparse memory disks by default, disk images in RAID_REPLAY_DIR, /tmp by default, otherwise) and the read,
+ * write and resync calls of the trace are issued again: back to back, or at their original time offsets with timed.
+ * The result is a single line of key=value fields, the figures of the replay next to those recorded in the trace.
+ */
+#include <chrono>
+#include <atomic>
+#include <memory>
+
+//-------------------------------------------------------------------------------------------------
+/** Sparse disks kept in memory: blocks are allocated on the first write, the rest reads as zeros,
+ * so that traces of large volumes fit. Disk 0 may be switched to failing.
+ */
+constexpr int                          REPLAY_BLOCK_SECTORS                    = 64;
+
+struct TReplayDisk
+{
+  std::mutex                             m_Mutex;
+  std::unordered_map<int, std::unique_ptr<char[]>> m_Blocks;
+};
+
+static std::vector<std::unique_ptr<TReplayDisk>> g_ReplayDisks;
+static int                             g_ReplaySectors = 0;
+static std::atomic<bool>               g_ReplayFailed { false };
+
+int                                    replayTransfer                          ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 char                                * data,
+                                                                                 int                                   sectorCnt,
+                                                                                 bool                                  write )
+{
+  if ( device < 0 || device >= (int) g_ReplayDisks . size () || ( device == 0 && g_ReplayFailed ) || sectorCnt <= 0
+       || sectorNr < 0 || sectorNr + sectorCnt > g_ReplaySectors )
+    return 0;
+  TReplayDisk & disk = *g_ReplayDisks[device];
+  std::lock_guard<std::mutex> lock ( disk . m_Mutex );
+  for ( int done = 0; done < sectorCnt; )
+  {
+    int      block = ( sectorNr + done ) / REPLAY_BLOCK_SECTORS, offset = ( sectorNr + done ) % REPLAY_BLOCK_SECTORS;
+    int      count = std::min ( sectorCnt - done, REPLAY_BLOCK_SECTORS - offset );
+    auto     it = disk . m_Blocks . find ( block );
+    if ( write && it == disk . m_Blocks . end () )
+      it = disk . m_Blocks . emplace ( block, std::make_unique<char[]> ( (size_t) REPLAY_BLOCK_SECTORS * SECTOR_SIZE ) ) . first;
+    char   * sectors = data + (size_t) done * SECTOR_SIZE;
+    if ( write )
+      memcpy ( it -> second . get () + (size_t) offset * SECTOR_SIZE, sectors, (size_t) count * SECTOR_SIZE );
+    else if ( it == disk . m_Blocks . end () )
+      memset ( sectors, 0, (size_t) count * SECTOR_SIZE );
+    else
+      memcpy ( sectors, it -> second . get () + (size_t) offset * SECTOR_SIZE, (size_t) count * SECTOR_SIZE );
+    done += count;
+  }
+  return sectorCnt;
+}
+//-------------------------------------------------------------------------------------------------
+int                                    replayRead                              ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 void                                * data,
+                                                                                 int                                   sectorCnt )
+{
+  return replayTransfer ( device, sectorNr, (char *) data, sectorCnt, false );
+}
+//-------------------------------------------------------------------------------------------------
+int                                    replayWrite                             ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 const void                          * data,
+                                                                                 int                                   sectorCnt )
+{
+  return replayTransfer ( device, sectorNr, (char *) data, sectorCnt, true );
+}
+//-------------------------------------------------------------------------------------------------
+TBlkDev                                createReplayDisks                       ( int                                   devices,
+                                                                                 int                                   sectors )
+{
+  TBlkDev    res;
+
+  g_ReplayDisks . clear ();
+  for ( int i = 0; i < devices; i ++ )
+    g_ReplayDisks . push_back ( std::make_unique<TReplayDisk> () );
+  g_ReplaySectors = sectors;
+  res . m_Devices = devices;
+  res . m_Sectors = sectors;
+  res . m_Read    = replayRead;
+  res . m_Write   = replayWrite;
+  return res;
+}
+//-------------------------------------------------------------------------------------------------
+std::vector<std::string>               replayFilePaths                         ( int                                   devices )
+{
+  const char * directory = getenv ( "RAID_REPLAY_DIR" );
+  std::vector<std::string> paths;
+  for ( int i = 0; i < devices; i ++ )
+    paths . push_back ( std::string ( directory ? directory : "/tmp" ) + "/raid-replay-" + std::to_string ( i ) );
+  return paths;
+}
+//-------------------------------------------------------------------------------------------------
+struct TReplayOptions
+{
+  bool                                   m_Timed = false;
+  int                                    m_Threads = 0;
+  const char                           * m_Backend = "memory";
+  bool                                   m_ParallelIo = false;
+  /* disk 0 does not answer from the start (memory backend only) */
+  bool                                   m_Degraded = false;
+};
+//-------------------------------------------------------------------------------------------------
+/** Latency percentile of a sorted list, 0 for an empty one.
+ */
+double                                 replayPercentile                        ( const std::vector<double>           & sorted,
+                                                                                 int                                   percent )
+{
+  return sorted . empty () ? 0 : sorted[std::min ( sorted . size () - 1, sorted . size () * percent / 100 )];
+}
+//-------------------------------------------------------------------------------------------------
+/** Issues the volume calls of the trace on the started volume from the given number of threads. Calls are taken in
+ * the order of their start; timed replay waits for the original offset of every call. Returns the latency of every
+ * call (microseconds) and counts the failed ones.
+ */
+std::vector<double>                    replayCalls                             ( CRaidVolume                         & vol,
+                                                                                 const std::vector<CIoTracer::TRecord> & calls,
+                                                                                 bool                                  timed,
+                                                                                 int                                   threadCount,
+                                                                                 std::atomic<int>                    & failed )
+{
+  std::vector<double> latencies ( calls . size () );
+  std::atomic<size_t> next { 0 };
+  int        maxSectors = 1;
+  for ( const auto & call : calls )
+    if ( call . m_Kind != CIoTracer::RESYNC )
+      maxSectors = std::max ( maxSectors, call . m_SecCnt );
+  auto       begin = std::chrono::steady_clock::now ();
+
+  auto       worker = [&] ()
+  {
+    std::vector<char> buffer ( (size_t) maxSectors * SECTOR_SIZE, 0x5a );
+    for ( size_t index; ( index = next ++ ) < calls . size (); )
+    {
+      const CIoTracer::TRecord & call = calls[index];
+      if ( timed )
+        std::this_thread::sleep_until ( begin + std::chrono::microseconds ( call . m_TimeUs ) );
+      auto   start = std::chrono::steady_clock::now ();
+      bool   ok;
+      if ( call . m_Kind == CIoTracer::READ )
+        ok = vol . read ( call . m_SecNr, buffer . data (), call . m_SecCnt );
+      else if ( call . m_Kind == CIoTracer::WRITE )
+        ok = vol . write ( call . m_SecNr, buffer . data (), call . m_SecCnt );
+      else
+        ok = ( call . m_SecCnt ? vol . resyncStep ( call . m_SecCnt ) : vol . resync () ) != RAID_FAILED;
+      latencies[index] = std::chrono::duration<double, std::micro> ( std::chrono::steady_clock::now () - start ) . count ();
+      if ( ! ok )
+        failed ++;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for ( int i = 1; i < threadCount; i ++ )
+    threads . emplace_back ( worker );
+  worker ();
+  for ( auto & thread : threads )
+    thread . join ();
+  return latencies;
+}
+//-------------------------------------------------------------------------------------------------
+/** Replays the trace file and prints one line: calls, IOPS, MB/s of user data, median and 99th percentile call
+ * latency and backend calls per user sector, of the replay and (trace*) as recorded.
+ */
+void                                   replayTrace                             ( const char                          * fileName,
+                                                                                 const TReplayOptions                & options )
+{
+  CIoTracer::THeader header;
+  std::vector<CIoTracer::TRecord> records, calls;
+  if ( ! CIoTracer::load ( fileName, header, records ) )
+    throw std::runtime_error ( "Trace load error" );
+
+  /* figures of the traced run */
+  std::vector<double> traceLatencies;
+  long long  traceDiskCalls = 0, sectors = 0;
+  uint64_t   traceEnd = 0;
+  for ( const auto & record : records )
+    if ( record . m_Kind == CIoTracer::DISK_READ || record . m_Kind == CIoTracer::DISK_WRITE )
+      traceDiskCalls ++;
+    else
+    {
+      calls . push_back ( record );
+      traceLatencies . push_back ( record . m_LatencyUs );
+      traceEnd = std::max ( traceEnd, record . m_TimeUs + record . m_LatencyUs );
+      if ( record . m_Kind != CIoTracer::RESYNC )
+        sectors += record . m_SecCnt;
+    }
+  std::stable_sort ( calls . begin (), calls . end (), [] ( const auto & a, const auto & b ) { return a . m_TimeUs < b . m_TimeUs; } );
+  std::sort ( traceLatencies . begin (), traceLatencies . end () );
+
+  /* the same geometry on the chosen backend */
+  const std::pair<const char *, TFileMode> modes[] = { { "pread", TFileMode::PREAD }, { "direct", TFileMode::DIRECT },
+                                                       { "mmap", TFileMode::MMAP } };
+  bool       memory = ! strcmp ( options . m_Backend, "memory" );
+  auto       mode = std::find_if ( std::begin ( modes ), std::end ( modes ),
+                                   [&options] ( const auto & mode ) { return ! strcmp ( mode . first, options . m_Backend ); } );
+  if ( ! memory && mode == std::end ( modes ) )
+    throw std::runtime_error ( "Unknown replay backend" );
+  TBlkDev    dev = memory ? createReplayDisks ( header . m_Devices, header . m_DiskSectors )
+                          : createFileDisks ( replayFilePaths ( header . m_Devices ), header . m_DiskSectors, mode -> second );
+  TRaidConfig config;
+  config . m_ChunkSectors = header . m_ChunkSectors;
+  config . m_Rotation = (CRaidLayout::TRotation) header . m_Rotation;
+  config . m_AllocationRegion = header . m_AllocationRegion;
+  config . m_ParallelIo = options . m_ParallelIo;
+  if ( ! CRaidVolume::create ( dev, config ) )
+    throw std::runtime_error ( "Replay volume create error" );
+  g_ReplayFailed = memory && options . m_Degraded;
+  CRaidVolume vol;
+  if ( vol . start ( dev ) == RAID_STOPPED )
+    throw std::runtime_error ( "Replay volume start error" );
+
+  int        threadCount = options . m_Threads > 0 ? options . m_Threads : options . m_Timed ? 16 : 1;
+  std::atomic<int> failed { 0 };
+  vol . resetStats ();
+  auto       begin = std::chrono::steady_clock::now ();
+  std::vector<double> latencies = replayCalls ( vol, calls, options . m_Timed, threadCount, failed );
+  double     seconds = std::chrono::duration<double> ( std::chrono::steady_clock::now () - begin ) . count ();
+  long long  diskCalls = 0;
+  for ( const auto & disk : vol . statsSnapshot () . m_Disks )
+    diskCalls += disk . m_ReadCalls + disk . m_WriteCalls;
+  vol . stop ();
+  if ( ! memory )
+  {
+    closeFileDisks ();
+    for ( const auto & path : replayFilePaths ( header . m_Devices ) )
+      unlink ( path . c_str () );
+  }
+  g_ReplayDisks . clear ();
+
+  double     traceSeconds = traceEnd / 1e6;
+  std::sort ( latencies . begin (), latencies . end () );
+  printf ( "replay backend=%s mode=%s threads=%d parallel=%d devices=%d calls=%zu failed=%d"
+           " iops=%.0f MBps=%.2f p50us=%.2f p99us=%.2f callsPerSector=%.3f"
+           " traceIops=%.0f traceMBps=%.2f traceP50us=%.2f traceP99us=%.2f traceCallsPerSector=%.3f\n",
+           options . m_Backend, options . m_Timed ? "timed" : "fast", threadCount, options . m_ParallelIo,
+           header . m_Devices, calls . size (), failed . load (),
+           seconds > 0 ? calls . size () / seconds : 0, seconds > 0 ? sectors * (double) SECTOR_SIZE / seconds / 1e6 : 0,
+           replayPercentile ( latencies, 50 ), replayPercentile ( latencies, 99 ), sectors ? diskCalls / (double) sectors : 0,
+           traceSeconds > 0 ? calls . size () / traceSeconds : 0, traceSeconds > 0 ? sectors * (double) SECTOR_SIZE / traceSeconds / 1e6 : 0,
+           replayPercentile ( traceLatencies, 50 ), replayPercentile ( traceLatencies, 99 ),
+           sectors ? traceDiskCalls / (double) sectors : 0 );
+  fflush ( stdout );
+}
+//-------------------------------------------------------------------------------------------------
+int                                    main                                    ( int                                   argc,
+                                                                                 char                                * argv[] )
+{
+  TReplayOptions options;
+
+  if ( argc < 2 )
+  {
+    fprintf ( stderr, "Usage: %s trace [timed] [threads=N] [backend=memory|pread|direct|mmap] [parallel] [degraded]\n", argv[0] );
+    return EXIT_FAILURE;
+  }
+  for ( int i = 2; i < argc; i ++ )
+    if ( ! strcmp ( argv[i], "timed" ) )
+      options . m_Timed = true;
+    else if ( ! strcmp ( argv[i], "parallel" ) )
+      options . m_ParallelIo = true;
+    else if ( ! strcmp ( argv[i], "degraded" ) )
+      options . m_Degraded = true;
+    else if ( ! strncmp ( argv[i], "threads=", 8 ) )
+      options . m_Threads = atoi ( argv[i] + 8 );
+    else if ( ! strncmp ( argv[i], "backend=", 8 ) )
+      options . m_Backend = argv[i] + 8;
+    else
+    {
+      fprintf ( stderr, "Unknown option %s\n", argv[i] );
+      return EXIT_FAILURE;
+    }
+
+  try
+  {
+    replayTrace ( argv[1], options );
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf ( stderr, "%s\n", e . what () );
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -15,12 +15,14 @@
  * again, this is only a starting point.
  */
 
+#include <atomic>
 
 constexpr int                          RAID_DEVICES = 4;
 constexpr int                          DISK_SECTORS = 8192;
 static FILE                          * g_Fp[RAID_DEVICES];
 
 bool canBreak = false;
+std::atomic<int> g_Calls { 0 };
 
 //-------------------------------------------------------------------------------------------------
 /** Sample sector reading function. The function will be called by your Raid driver implementation.
@@ -34,6 +36,7 @@ int                                    diskRead                                (
 {
     if (device == 0 && canBreak) return 0;
 
+  g_Calls ++;
   if ( device < 0 || device >= RAID_DEVICES )
     return 0;
   if ( g_Fp[device] == nullptr )
@@ -53,6 +56,7 @@ int                                    diskWrite                               (
 {
     if (device == 0 && canBreak) return 0;
 
+  g_Calls ++;
   if ( device < 0 || device >= RAID_DEVICES )
     return 0;
   if ( g_Fp[device] == NULL )
@@ -216,9 +220,1599 @@ void                                   test2                                   (
   doneDisks ();
 }
 //-------------------------------------------------------------------------------------------------
+/** Checks that every data row of the volume (or of the row range) xors to zero, i.e. parity matches the data.
+ */
+bool                                   checkParity                             ( const TBlkDev                       & dev,
+                                                                                 const CRaidVolume                   & vol,
+                                                                                 int                                   firstRow = 0,
+                                                                                 int                                   rowCnt = -1 )
+{
+  char       buffer[SECTOR_SIZE], parity[SECTOR_SIZE];
+  int        endRow = rowCnt < 0 ? vol . size () / ( dev . m_Devices - 1 ) : firstRow + rowCnt;
+
+  for ( int row = firstRow; row < endRow; row ++ )
+  {
+    memset ( parity, 0, sizeof ( parity ) );
+    for ( int i = 0; i < dev . m_Devices; i ++ )
+    {
+      if ( dev . m_Read ( i, row, buffer, 1 ) != 1 )
+        return false;
+      for ( int j = 0; j < SECTOR_SIZE; j ++ )
+        parity[j] ^= buffer[j];
+    }
+    for ( int j = 0; j < SECTOR_SIZE; j ++ )
+      if ( parity[j] )
+        return false;
+  }
+  return true;
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test3                                   ( bool                                  parallelIo )
+{
+  /* Multi-sector writes: full stripes, partial stripes and unaligned ranges,
+   * both in the OK and in the degraded mode.
+   */
+  TBlkDev  dev = createDisks ();
+  TRaidConfig config;
+  config . m_ParallelIo = parallelIo;
+  assert ( CRaidVolume::create ( dev, config ) );
+
+  CRaidVolume vol;
+  vol . setParallelIo ( parallelIo );
+  assert ( vol . start ( dev ) == RAID_OK );
+
+  const int   maxCnt = 3 * ( RAID_DEVICES - 1 ) + 2;
+  static char data[maxCnt * SECTOR_SIZE], check[maxCnt * SECTOR_SIZE];
+  unsigned    seed = 1;
+
+  for ( int pass = 0; pass < 2; pass ++ )
+  {
+    for ( int secNr = 0; secNr + maxCnt <= 256; secNr += 7 )
+      for ( int secCnt = 1; secCnt <= maxCnt; secCnt += 4 )
+      {
+        for ( int i = 0; i < secCnt * SECTOR_SIZE; i ++ )
+          data[i] = (char) ( ( seed = seed * 1103515245 + 12345 ) >> 16 );
+        assert ( vol . write ( secNr, data, secCnt ) );
+        assert ( vol . read ( secNr, check, secCnt ) );
+        assert ( ! memcmp ( data, check, secCnt * SECTOR_SIZE ) );
+      }
+
+    if ( pass == 0 )
+    {
+      /* Large requests shall be coalesced into one call per disk */
+      static char big[64 * ( RAID_DEVICES - 1 ) * SECTOR_SIZE];
+      g_Calls = 0;
+      assert ( vol . write ( 0, big, 64 * ( RAID_DEVICES - 1 ) ) );
+      assert ( vol . read ( 0, big, 64 * ( RAID_DEVICES - 1 ) ) );
+      assert ( g_Calls == 2 * RAID_DEVICES );
+
+      assert ( checkParity ( dev, vol ) );
+      canBreak = true;
+    }
+  }
+
+  /* Everything written while degraded shall be restored on the returned disk */
+  canBreak = false;
+  assert ( vol . status () == RAID_DEGRADED );
+  assert ( vol . resync () == RAID_OK );
+  assert ( checkParity ( dev, vol ) );
+
+  assert ( vol . stop () == RAID_STOPPED );
+  doneDisks ();
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test4                                   ()
+{
+  /* Every XOR kernel available on this CPU, the sector ones included, shall match a plain byte by byte XOR:
+   * odd lengths, sources and destination at misaligned offsets of their own, the destination being one of the
+   * sources, and no byte past the length touched.
+   */
+  const int     lengths[] = { 1, 7, 63, 65, SECTOR_SIZE - 1, SECTOR_SIZE, SECTOR_SIZE + 200, 4 * SECTOR_SIZE + 13 };
+  const int     maxLength = 4 * SECTOR_SIZE + 13, slack = 64;
+  static std::byte buffers[MAX_RAID_DEVICES][maxLength + slack], expected[maxLength], result[maxLength + 2 * slack];
+  const std::byte * sources[MAX_RAID_DEVICES];
+
+  for ( int i = 0; i < MAX_RAID_DEVICES; i ++ )
+    for ( int j = 0; j < maxLength + slack; j ++ )
+      buffers[i][j] = std::byte ( i * 31 + j * 7 + ( j >> 8 ) );
+
+  for ( const auto & kernel : CXorEngine::availableKernels () )
+    for ( int length : lengths )
+      for ( int offset : { 0, 1, 3, 17, 33 } )
+        for ( int sourceCount = 1; sourceCount <= MAX_RAID_DEVICES; sourceCount ++ )
+        {
+          for ( int i = 0; i < sourceCount; i ++ )
+            sources[i] = buffers[i] + ( offset + i * 5 ) % slack;
+          for ( int j = 0; j < length; j ++ )
+          {
+            std::byte  value { 0 };
+            for ( int i = 0; i < sourceCount; i ++ )
+              value ^= sources[i][j];
+            expected[j] = value;
+          }
+
+          std::byte * destination = result + slack / 2 + offset;
+          for ( const auto function : { kernel . m_Kernel, kernel . m_SectorKernel } )
+          {
+            if ( function == kernel . m_SectorKernel && length != SECTOR_SIZE )
+              continue;
+            memset ( result, 0xa5, sizeof ( result ) );
+            function ( destination, sources, sourceCount, length );
+            assert ( ! memcmp ( destination, expected, length ) );
+            for ( std::byte * guard = result; guard < result + sizeof ( result ); guard ++ )
+              assert ( ( guard >= destination && guard < destination + length ) || *guard == std::byte ( 0xa5 ) );
+
+            /* in place: the destination holds the first source */
+            memcpy ( destination, sources[0], length );
+            const std::byte * inPlace[MAX_RAID_DEVICES];
+            std::copy ( sources, sources + sourceCount, inPlace );
+            inPlace[0] = destination;
+            function ( destination, inPlace, sourceCount, length );
+            assert ( ! memcmp ( destination, expected, length ) );
+          }
+        }
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test5                                   ()
+{
+  /* Rewriting a hot sector shall be served from the stripe cache: once the old data
+   * and parity are cached, the read-modify-write only writes.
+   */
+  TBlkDev  dev = createDisks ();
+  assert ( CRaidVolume::create ( dev ) );
+
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+
+  char     buffer[SECTOR_SIZE], check[SECTOR_SIZE];
+  for ( int i = 0; i < 100; i ++ )
+  {
+    memset ( buffer, i, sizeof ( buffer ) );
+    g_Calls = 0;
+    assert ( vol . write ( 5, buffer, 1 ) );
+    assert ( vol . read ( 5, check, 1 ) );
+    assert ( ! memcmp ( buffer, check, sizeof ( buffer ) ) );
+    assert ( i == 0 || g_Calls == 2 );
+  }
+  assert ( vol . cacheStats () . m_Hits >= 3 * 99 );
+
+  /* A disk failure drops its cached sectors, the data shall be reconstructed */
+  canBreak = true;
+  for ( int i = 0; i < 3 * ( RAID_DEVICES - 1 ); i ++ )
+  {
+    memset ( buffer, i + 1, sizeof ( buffer ) );
+    assert ( vol . write ( i, buffer, 1 ) );
+  }
+  for ( int i = 0; i < 3 * ( RAID_DEVICES - 1 ); i ++ )
+  {
+    memset ( buffer, i + 1, sizeof ( buffer ) );
+    assert ( vol . read ( i, check, 1 ) );
+    assert ( ! memcmp ( buffer, check, sizeof ( buffer ) ) );
+  }
+  canBreak = false;
+  assert ( vol . resync () == RAID_OK );
+  assert ( checkParity ( dev, vol ) );
+
+  /* No cache at all shall still work */
+  vol . setCacheCapacity ( 0 );
+  assert ( vol . read ( 5, check, 1 ) );
+  assert ( vol . stop () == RAID_STOPPED );
+  doneDisks ();
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test6                                   ()
+{
+  /* Online resync: foreground I/O runs between the resync steps, the part of the disk
+   * below the watermark is read directly, the rest is reconstructed from parity.
+   */
+  TBlkDev  dev = createDisks ();
+  assert ( CRaidVolume::create ( dev ) );
+
+  CRaidVolume vol;
+  vol . setCacheCapacity ( 0 );
+  assert ( vol . start ( dev ) == RAID_OK );
+
+  static char data[DISK_SECTORS * ( RAID_DEVICES - 1 ) / 8 * SECTOR_SIZE], check[SECTOR_SIZE];
+  const int   dataSectors = sizeof ( data ) / SECTOR_SIZE;
+  for ( size_t i = 0; i < sizeof ( data ); i ++ )
+    data[i] = (char) ( i * 13 + i / SECTOR_SIZE );
+
+  canBreak = true;
+  assert ( vol . write ( 0, data, dataSectors ) );
+  assert ( vol . status () == RAID_DEGRADED );
+  canBreak = false;
+
+  int      step = 0;
+  while ( vol . resyncStep ( 1000 ) == RAID_DEGRADED )
+  {
+    CRaidVolume::TResyncProgress progress = vol . resyncProgress ();
+    assert ( progress . m_DiskIndex == 0 && progress . m_Watermark == ( ++ step ) * 1000 );
+
+    /* sector 3 lives on disk 0 in row 1; row watermark + 501 has parity on disk 1, so its first data sector lives on disk 0 too */
+    g_Calls = 0;
+    assert ( vol . read ( 3, check, 1 ) && ! memcmp ( check, data + 3 * SECTOR_SIZE, SECTOR_SIZE ) );
+    assert ( g_Calls == 1 );
+    int    high = ( RAID_DEVICES - 1 ) * ( progress . m_Watermark + 500 ) + 3;
+    if ( high < dataSectors )
+    {
+      g_Calls = 0;
+      assert ( vol . read ( high, check, 1 ) && ! memcmp ( check, data + high * SECTOR_SIZE, SECTOR_SIZE ) );
+      assert ( g_Calls == RAID_DEVICES - 1 );
+    }
+
+    /* foreground writes both below and above the watermark */
+    for ( int secNr : { 1, 2, dataSectors - 5 } )
+    {
+      memset ( data + secNr * SECTOR_SIZE, step, SECTOR_SIZE );
+      assert ( vol . write ( secNr, data + secNr * SECTOR_SIZE, 1 ) );
+    }
+  }
+  assert ( vol . status () == RAID_OK );
+  assert ( vol . resyncProgress () . m_DiskIndex == -1 );
+  assert ( checkParity ( dev, vol ) );
+  for ( int i = 0; i < dataSectors; i ++ )
+  {
+    assert ( vol . read ( i, check, 1 ) );
+    assert ( ! memcmp ( check, data + i * SECTOR_SIZE, SECTOR_SIZE ) );
+  }
+
+  /* Bandwidth cap: the single dirty region of 1024 sectors at 4000 sectors per second takes at least 0.2 s */
+  canBreak = true;
+  assert ( vol . write ( 0, data, 1 ) );
+  canBreak = false;
+  vol . setResyncRate ( 4000 );
+  auto     begin = std::chrono::steady_clock::now ();
+  assert ( vol . resync () == RAID_OK );
+  assert ( std::chrono::steady_clock::now () - begin >= std::chrono::milliseconds ( 200 ) );
+  assert ( checkParity ( dev, vol ) );
+
+  assert ( vol . stop () == RAID_STOPPED );
+  doneDisks ();
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test7                                   ()
+{
+  /* Write-intent bitmap: a disk coming back after a failure gets only the regions written while
+   * it was away, even across stop/start; a blank replacement disk gets the whole rebuild.
+   */
+  TBlkDev  dev = createDisks ();
+  TRaidConfig config;
+  config . m_BitmapRegion = 256;
+  assert ( CRaidVolume::create ( dev, config ) );
+
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  const int   dataSectors = vol . size ();
+  static char data[DISK_SECTORS * RAID_DEVICES * SECTOR_SIZE], check[SECTOR_SIZE];
+  for ( int i = 0; i < dataSectors * SECTOR_SIZE; i ++ )
+    data[i] = (char) ( i * 7 + i / SECTOR_SIZE );
+  assert ( vol . write ( 0, data, dataSectors ) );
+
+  /* rows 300 and 3000 are missed by disk 0, the new data survives a restart of the volume */
+  canBreak = true;
+  for ( int secNr : { 300 * ( RAID_DEVICES - 1 ), 3000 * ( RAID_DEVICES - 1 ) + 1 } )
+  {
+    memset ( data + secNr * SECTOR_SIZE, 0x5a, SECTOR_SIZE );
+    assert ( vol . write ( secNr, data + secNr * SECTOR_SIZE, 1 ) );
+  }
+  assert ( vol . status () == RAID_DEGRADED );
+  canBreak = false;
+  assert ( vol . stop () == RAID_STOPPED );
+  assert ( vol . start ( dev ) == RAID_DEGRADED );
+
+  /* two dirty regions of 256 rows: a few batches instead of the whole disk */
+  g_Calls = 0;
+  assert ( vol . resync () == RAID_OK );
+  assert ( g_Calls < 3 * RAID_DEVICES * 4 );
+  assert ( checkParity ( dev, vol ) );
+
+  /* with every disk in sync a write touches no bitmap sectors: just the data and the parity */
+  vol . resetStats ();
+  assert ( vol . write ( 5, data + 5 * SECTOR_SIZE, 1 ) );
+  CRaidStats::TSnapshot stats = vol . statsSnapshot ();
+  uint64_t   writeCalls = 0;
+  for ( int disk = 0; disk < RAID_DEVICES; disk ++ )
+    writeCalls += stats . m_Disks[disk] . m_WriteCalls;
+  assert ( writeCalls == 2 );
+  for ( int i = 0; i < dataSectors; i ++ )
+  {
+    assert ( vol . read ( i, check, 1 ) );
+    assert ( ! memcmp ( check, data + i * SECTOR_SIZE, SECTOR_SIZE ) );
+  }
+  assert ( vol . stop () == RAID_STOPPED );
+
+  /* blank disk 0 does not carry the volume metadata, all of it is rebuilt */
+  memset ( check, 0, SECTOR_SIZE );
+  for ( int i = 0; i < DISK_SECTORS; i ++ )
+    diskWrite ( 0, i, check, 1 );
+  assert ( vol . start ( dev ) == RAID_DEGRADED );
+  assert ( vol . resync () == RAID_OK );
+  assert ( checkParity ( dev, vol ) );
+  for ( int i = 0; i < dataSectors; i ++ )
+  {
+    assert ( vol . read ( i, check, 1 ) );
+    assert ( ! memcmp ( check, data + i * SECTOR_SIZE, SECTOR_SIZE ) );
+  }
+  assert ( vol . stop () == RAID_STOPPED );
+  doneDisks ();
+}
+//-------------------------------------------------------------------------------------------------
+/** Disks kept in memory, any device count; used where the file backed disks above are too rigid.
+ */
+static std::vector<std::vector<char>>  g_Memory;
+static std::atomic<int>                g_MemoryFailed { -1 };
+/* reads of this disk take g_MemorySlowUs longer */
+static std::atomic<int>                g_MemorySlow { -1 };
+static std::atomic<int>                g_MemorySlowUs { 0 };
+
+int                                    memoryRead                              ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 void                                * data,
+                                                                                 int                                   sectorCnt )
+{
+  if ( device < 0 || device >= (int) g_Memory . size () || device == g_MemoryFailed || sectorCnt <= 0
+       || sectorNr < 0 || ( sectorNr + sectorCnt ) * SECTOR_SIZE > (int) g_Memory[device] . size () )
+    return 0;
+  if ( device == g_MemorySlow )
+    std::this_thread::sleep_for ( std::chrono::microseconds ( g_MemorySlowUs ) );
+  memcpy ( data, g_Memory[device] . data () + sectorNr * SECTOR_SIZE, sectorCnt * SECTOR_SIZE );
+  return sectorCnt;
+}
+//-------------------------------------------------------------------------------------------------
+int                                    memoryWrite                             ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 const void                          * data,
+                                                                                 int                                   sectorCnt )
+{
+  if ( device < 0 || device >= (int) g_Memory . size () || device == g_MemoryFailed || sectorCnt <= 0
+       || sectorNr < 0 || ( sectorNr + sectorCnt ) * SECTOR_SIZE > (int) g_Memory[device] . size () )
+    return 0;
+  memcpy ( g_Memory[device] . data () + sectorNr * SECTOR_SIZE, data, sectorCnt * SECTOR_SIZE );
+  return sectorCnt;
+}
+//-------------------------------------------------------------------------------------------------
+TBlkDev                                createMemoryDisks                       ( int                                   devices,
+                                                                                 int                                   sectors )
+{
+  TBlkDev    res;
+
+  g_Memory . assign ( devices, std::vector<char> ( sectors * SECTOR_SIZE, 0 ) );
+  res . m_Devices = devices;
+  res . m_Sectors = sectors;
+  res . m_Read    = memoryRead;
+  res . m_Write   = memoryWrite;
+  return res;
+}
+//-------------------------------------------------------------------------------------------------
+void                                   fillPattern                             ( char                                * sector,
+                                                                                 int                                   secNr,
+                                                                                 int                                   version )
+{
+  memcpy ( sector, &secNr, sizeof ( secNr ) );
+  for ( int i = sizeof ( secNr ); i < SECTOR_SIZE; i ++ )
+    sector[i] = (char) ( ( ( secNr * 40503u + i ) * 2654435761u + version ) >> 13 );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test8                                   ()
+{
+  /* Chunked layout: for every device count and parity rotation, each volume sector lands in exactly one disk sector,
+   * every row holds one parity, consecutive sectors of a chunk are consecutive sectors of a disk.
+   */
+  const int  sectors = 200;
+  char       check[SECTOR_SIZE];
+
+  for ( int devices = 3; devices <= MAX_RAID_DEVICES; devices ++ )
+    for ( int chunk : { 1, 6, 64 } )
+    for ( int rotation = 0; rotation < CRaidLayout::ROTATION_COUNT; rotation ++ )
+    {
+      TBlkDev  dev = createMemoryDisks ( devices, sectors );
+      TRaidConfig config;
+      config . m_ChunkSectors = chunk;
+      config . m_Rotation = (CRaidLayout::TRotation) rotation;
+      assert ( CRaidVolume::create ( dev, config ) );
+
+      CRaidVolume vol;
+      assert ( vol . start ( dev ) == RAID_OK );
+      const int   size = vol . size (), rows = size / ( devices - 1 );
+      assert ( size % ( devices - 1 ) == 0 && rows % chunk == 0 && rows > sectors - 2 - chunk );
+
+      std::vector<char> data ( size * SECTOR_SIZE );
+      for ( int i = 0; i < size; i ++ )
+        fillPattern ( data . data () + i * SECTOR_SIZE, i, 0 );
+      assert ( vol . write ( 0, data . data (), size ) );
+
+      std::vector<std::pair<int, int>> where ( size, { -1, -1 } );
+      for ( int row = 0; row < rows; row ++ )
+      {
+        int    dataCnt = 0;
+        char   parity[SECTOR_SIZE] = {};
+        for ( int disk = 0; disk < devices; disk ++ )
+        {
+          const char * sector = g_Memory[disk] . data () + row * SECTOR_SIZE;
+          int    secNr;
+          memcpy ( &secNr, sector, sizeof ( secNr ) );
+          for ( int i = 0; i < SECTOR_SIZE; i ++ )
+            parity[i] ^= sector[i];
+          if ( secNr < 0 || secNr >= size || memcmp ( sector, data . data () + secNr * SECTOR_SIZE, SECTOR_SIZE ) )
+            continue;
+          assert ( where[secNr] . first == -1 );
+          where[secNr] = { disk, row };
+          dataCnt ++;
+        }
+        assert ( dataCnt == devices - 1 );
+        for ( int i = 0; i < SECTOR_SIZE; i ++ )
+          assert ( parity[i] == 0 );
+      }
+      for ( int i = 0; i < size; i ++ )
+      {
+        assert ( where[i] . first != -1 );
+        if ( i % chunk )
+          assert ( where[i] . first == where[i - 1] . first && where[i] . second == where[i - 1] . second + 1 );
+      }
+      /* first data disk of the first two stripes */
+      const int firstDisk[][2] = { { 1, 0 }, { 1, 2 }, { 0, 0 }, { 0, devices - 1 } };
+      assert ( where[0] . first == firstDisk[rotation][0] && where[( devices - 1 ) * chunk] . first == firstDisk[rotation][1] );
+
+      /* unaligned partial writes spanning several chunks */
+      int      first = chunk / 2 + 1, count = std::min ( 3 * chunk + 2, size - first );
+      for ( int i = first; i < first + count; i ++ )
+        fillPattern ( data . data () + i * SECTOR_SIZE, i, 1 );
+      assert ( vol . write ( first, data . data () + first * SECTOR_SIZE, count ) );
+      std::vector<char> readBack ( size * SECTOR_SIZE );
+      assert ( vol . read ( 0, readBack . data (), size ) );
+      assert ( readBack == data );
+      assert ( vol . read ( size - 1, check, 1 ) && ! memcmp ( check, data . data () + ( size - 1 ) * SECTOR_SIZE, SECTOR_SIZE ) );
+      assert ( vol . stop () == RAID_STOPPED );
+
+      /* the chunk size survives a restart */
+      assert ( vol . start ( dev ) == RAID_OK );
+      assert ( vol . read ( 0, readBack . data (), size ) && readBack == data );
+      assert ( vol . stop () == RAID_STOPPED );
+    }
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test9                                   ()
+{
+  /* Concurrent requests: every thread writes its own sectors, which share the rows with the sectors of the
+   * other threads, and reads any range. A disk fails in the middle, comes back and is resynced while the
+   * requests go on; afterwards parity matches the data and every sector holds the last write of its owner.
+   */
+  const int  threads = 8, devices = 5;
+  TBlkDev    dev = createMemoryDisks ( devices, 1024 );
+  TRaidConfig config;
+  config . m_ChunkSectors = 4;
+  config . m_BitmapRegion = 64;
+  config . m_ParallelIo   = true;
+  assert ( CRaidVolume::create ( dev, config ) );
+
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  const int  size = vol . size ();
+  std::vector<int>  versions ( size, 0 );
+  std::vector<char> data ( size * SECTOR_SIZE );
+  for ( int i = 0; i < size; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 0 );
+  assert ( vol . write ( 0, data . data (), size ) );
+
+  std::atomic<bool> stop { false };
+  std::atomic<int>  progress { 0 };
+  std::vector<std::thread> workers;
+  for ( int id = 0; id < threads; id ++ )
+    workers . emplace_back ( [&, id] ()
+    {
+      unsigned   seed = id * 7919 + 1;
+      char       sector[SECTOR_SIZE], expected[SECTOR_SIZE];
+      std::vector<char> buffer ( 16 * SECTOR_SIZE );
+      for ( int op = 0; ! stop || op < 1000; op ++, progress ++ )
+      {
+        seed = seed * 1103515245 + 12345;
+        int    secNr = ( seed >> 8 ) % size;
+        if ( op % 3 )
+        {
+          secNr = secNr - secNr % threads + id;
+          if ( secNr >= size )
+            continue;
+          fillPattern ( sector, secNr, ++ versions[secNr] );
+          assert ( vol . write ( secNr, sector, 1 ) );
+          continue;
+        }
+        int    secCnt = std::min ( 16, size - secNr );
+        assert ( vol . read ( secNr, buffer . data (), secCnt ) );
+        for ( int i = secNr; i < secNr + secCnt; i ++ )
+          if ( i % threads == id )
+          {
+            fillPattern ( expected, i, versions[i] );
+            assert ( ! memcmp ( buffer . data () + ( i - secNr ) * SECTOR_SIZE, expected, SECTOR_SIZE ) );
+          }
+      }
+    } );
+
+  while ( progress < 2000 )
+    std::this_thread::yield ();
+  g_MemoryFailed = 2;
+  while ( progress < 6000 )
+    std::this_thread::yield ();
+  g_MemoryFailed = -1;
+  assert ( vol . status () == RAID_DEGRADED );
+  while ( vol . resyncStep ( 64 ) == RAID_DEGRADED )
+    ;
+  assert ( vol . status () == RAID_OK );
+  stop = true;
+  for ( auto & worker : workers )
+    worker . join ();
+
+  assert ( vol . status () == RAID_OK );
+  assert ( checkParity ( dev, vol ) );
+  for ( int i = 0; i < size; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, versions[i] );
+  std::vector<char> readBack ( size * SECTOR_SIZE );
+  assert ( vol . read ( 0, readBack . data (), size ) );
+  assert ( readBack == data );
+  assert ( vol . stop () == RAID_STOPPED );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test10                                  ()
+{
+  /* Asynchronous queue: small requests submitted together are merged into a few volume calls, each of them
+   * gets a completion, and dependent requests keep their order.
+   */
+  TBlkDev    dev = createMemoryDisks ( 4, 1024 );
+  assert ( CRaidVolume::create ( dev ) );
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+
+  const int  count = 300;
+  std::vector<char> data ( count * SECTOR_SIZE ), check ( count * SECTOR_SIZE );
+  std::vector<CIoQueue::TRequest> requests;
+  std::vector<CIoQueue::TCompletion> completions;
+  for ( int i = 0; i < count; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 3 );
+  /* writes in a scrambled order, reads of the same sectors right behind them */
+  for ( int i = 0; i < count; i ++ )
+  {
+    int      secNr = i * 7 % count;
+    requests . push_back ( { true, secNr, 1, data . data () + secNr * SECTOR_SIZE, (uint64_t) secNr } );
+  }
+  for ( int i = 0; i < count; i ++ )
+    requests . push_back ( { false, i, 1, check . data () + i * SECTOR_SIZE, (uint64_t) ( count + i ) } );
+
+  {
+    CIoQueue queue ( vol );
+    queue . submit ( requests );
+    while ( completions . size () < requests . size () )
+      queue . reap ( completions, requests . size () - completions . size () );
+    assert ( queue . getStats () . m_Requests == requests . size () );
+    assert ( queue . getStats () . m_VolumeCalls <= 4 );
+  }
+  std::vector<bool> seen ( requests . size (), false );
+  for ( const auto & completion : completions )
+  {
+    assert ( completion . m_Succeeded && completion . m_Tag < requests . size () && ! seen[completion . m_Tag] );
+    seen[completion . m_Tag] = true;
+  }
+  assert ( check == data );
+
+  /* write, read, write, read of the same sector within one batch */
+  char       first[SECTOR_SIZE], second[SECTOR_SIZE], firstRead[SECTOR_SIZE], secondRead[SECTOR_SIZE];
+  fillPattern ( first, 5, 10 );
+  fillPattern ( second, 5, 11 );
+  requests = { { true, 5, 1, first, 0 }, { false, 4, 3, check . data (), 1 }, { false, 5, 1, firstRead, 2 },
+               { true, 5, 1, second, 3 }, { false, 5, 1, secondRead, 4 } };
+  completions . clear ();
+  {
+    CIoQueue queue ( vol );
+    queue . submit ( requests );
+  }
+  assert ( ! memcmp ( firstRead, first, SECTOR_SIZE ) && ! memcmp ( secondRead, second, SECTOR_SIZE ) );
+  assert ( ! memcmp ( check . data () + SECTOR_SIZE, first, SECTOR_SIZE ) );
+
+  /* a failing request merged with good ones fails alone: the last sectors of the volume and the sectors past its end */
+  const int  size = (int) vol . size ();
+  std::vector<char> tail ( 8 * SECTOR_SIZE );
+  requests = { { false, size - 8, 4, tail . data (), 0 }, { false, size - 4, 4, tail . data () + 4 * SECTOR_SIZE, 1 },
+               { false, size, 4, check . data (), 2 }, { true, size - 8, 2, data . data (), 3 },
+               { true, size - 6, 8, data . data (), 4 } };
+  completions . clear ();
+  {
+    CIoQueue queue ( vol );
+    queue . submit ( requests );
+    while ( completions . size () < requests . size () )
+      queue . reap ( completions, requests . size () - completions . size () );
+  }
+  for ( const auto & completion : completions )
+    assert ( completion . m_Succeeded == ( completion . m_Tag != 2 && completion . m_Tag != 4 ) );
+  assert ( vol . read ( size - 8, check . data (), 2 ) && ! memcmp ( check . data (), data . data (), 2 * SECTOR_SIZE ) );
+  assert ( vol . stop () == RAID_STOPPED );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test11                                  ()
+{
+  /* Counters: write strategies, per disk calls and errors, reconstructions, latency histograms, resync progress */
+  TBlkDev    dev = createMemoryDisks ( 4, 1024 );
+  TRaidConfig config;
+  config . m_BitmapRegion = 0;
+  assert ( CRaidVolume::create ( dev, config ) );
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  vol . setCacheCapacity ( 0 );
+  vol . resetStats ();
+
+  static char data[3 * 64 * SECTOR_SIZE];
+  assert ( vol . write ( 0, data, 3 * 64 ) );
+  CRaidStats::TSnapshot stats = vol . statsSnapshot ();
+  assert ( stats . m_Writes == 1 && stats . m_WriteSectors == 3 * 64 && stats . m_FullStripeRows == 64 );
+  assert ( stats . m_ReadModifyWrites == 0 && stats . m_ReconstructWrites == 0 );
+  for ( int disk = 0; disk < 4; disk ++ )
+    assert ( stats . m_Disks[disk] . m_WriteCalls == 1 && stats . m_Disks[disk] . m_WriteSectors == 64
+             && stats . m_Disks[disk] . m_ReadCalls == 0 );
+
+  /* single sector: old data + parity read, new data + parity written */
+  assert ( vol . write ( 500, data, 1 ) );
+  stats = vol . statsSnapshot ();
+  assert ( stats . m_ReadModifyWrites + stats . m_ReconstructWrites == 1 );
+
+  /* disk 1 dies, reads reconstruct its sectors */
+  g_MemoryFailed = 1;
+  assert ( vol . read ( 0, data, 3 * 64 ) );
+  g_MemoryFailed = -1;
+  stats = vol . statsSnapshot ();
+  assert ( vol . status () == RAID_DEGRADED );
+  assert ( stats . m_Disks[1] . m_Errors == 1 && stats . m_Reconstructions == 1 && stats . m_ReconstructedSectors > 0 );
+  assert ( stats . m_Reads == 1 && stats . m_FailedRequests == 0 );
+  uint64_t   histogramTotal = 0;
+  for ( uint64_t count : stats . m_WriteLatency )
+    histogramTotal += count;
+  assert ( histogramTotal == stats . m_Writes );
+  assert ( CRaidStats::getPercentile ( stats . m_ReadLatency, 0.5 ) > 0 );
+  assert ( stats . m_ResyncDisk == -1 );
+
+  /* after a reset only the resync traffic shows up */
+  vol . resetStats ();
+  assert ( vol . resyncStep ( 64 ) == RAID_DEGRADED );
+  stats = vol . statsSnapshot ();
+  assert ( stats . m_ResyncDisk == 1 && stats . m_ResyncWatermark == 64 && stats . m_ResyncSectors == vol . size () / 3 );
+  assert ( stats . m_Disks[1] . m_WriteCalls == 1 && stats . m_Disks[1] . m_WriteSectors == 64 );
+  assert ( stats . m_Reads == 0 && stats . m_Writes == 0 && stats . m_Disks[1] . m_Errors == 0 && stats . m_FullStripeRows == 0 );
+  assert ( CRaidStats::getPercentile ( stats . m_ReadLatency, 0.99 ) == 0 );
+  assert ( vol . resync () == RAID_OK );
+  assert ( vol . stop () == RAID_STOPPED );
+
+  /* percentiles come from the bucket bounds */
+  CRaidStats::THistogram histogram {};
+  histogram[CRaidStats::getLatencyBucket ( 3 )] = 50;
+  histogram[CRaidStats::getLatencyBucket ( 1000 )] = 49;
+  histogram[CRaidStats::getLatencyBucket ( 100000 )] = 1;
+  assert ( CRaidStats::getPercentile ( histogram, 0.5 ) == 4 );
+  assert ( CRaidStats::getPercentile ( histogram, 0.99 ) == 1024 );
+  assert ( CRaidStats::getPercentile ( histogram, 1 ) == 131072 );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test12                                  ()
+{
+  /* Degraded sequential read: every surviving disk is read once for the whole request and the rows of the
+   * failed disk are reconstructed from those buffers, no extra calls per stripe.
+   */
+  TBlkDev    dev = createMemoryDisks ( 4, 1024 );
+  TRaidConfig config;
+  config . m_ChunkSectors = 8;
+  assert ( CRaidVolume::create ( dev, config ) );
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  vol . setCacheCapacity ( 0 );
+
+  const int  count = 3 * 200;
+  std::vector<char> data ( count * SECTOR_SIZE ), check ( count * SECTOR_SIZE );
+  for ( int i = 0; i < count; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i + 5, 4 );
+  assert ( vol . write ( 5, data . data (), count ) );
+
+  vol . resetStats ();
+  assert ( vol . read ( 5, check . data (), count ) );
+  assert ( check == data );
+  CRaidStats::TSnapshot healthy = vol . statsSnapshot ();
+
+  /* disk 2 fails on a write, the following reads run degraded */
+  g_MemoryFailed = 2;
+  assert ( vol . write ( 5, data . data (), count ) );
+  g_MemoryFailed = -1;
+  assert ( vol . status () == RAID_DEGRADED );
+
+  vol . resetStats ();
+  std::fill ( check . begin (), check . end (), 0 );
+  assert ( vol . read ( 5, check . data (), count ) );
+  assert ( check == data );
+  CRaidStats::TSnapshot degraded = vol . statsSnapshot ();
+  uint64_t   healthyCalls = 0, degradedCalls = 0;
+  for ( int disk = 0; disk < 4; disk ++ )
+  {
+    healthyCalls += healthy . m_Disks[disk] . m_ReadCalls;
+    degradedCalls += degraded . m_Disks[disk] . m_ReadCalls;
+    assert ( degraded . m_Disks[disk] . m_ReadSectors <= 216 );
+  }
+  assert ( degraded . m_Disks[2] . m_ReadCalls == 0 && degradedCalls <= healthyCalls );
+  assert ( degraded . m_Reconstructions > 0 && degraded . m_ReconstructedSectors <= 216 );
+
+  /* short reads within single chunks, one of them on the failed disk */
+  for ( int offset = 0; offset < 32; offset += 8 )
+  {
+    assert ( vol . read ( 5 + offset + 2, check . data (), 3 ) );
+    assert ( ! memcmp ( check . data (), data . data () + ( offset + 2 ) * SECTOR_SIZE, 3 * SECTOR_SIZE ) );
+  }
+  assert ( vol . stop () == RAID_STOPPED );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test13                                  ()
+{
+  /* Hedged reads: a disk stuck in a latency spike is outrun by the reconstruction from the others, after a few
+   * lost races it is read through the parity only, yet it never gets failed.
+   */
+  TBlkDev    dev = createMemoryDisks ( 4, 1024 );
+  assert ( CRaidVolume::create ( dev ) );
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  vol . setCacheCapacity ( 0 );
+  CRaidVolume::THedgeConfig hedge;
+  hedge . m_Enabled = true;
+  hedge . m_DelayUs = 2000;
+  hedge . m_DemoteAfter = 2;
+  hedge . m_DemoteUs = 60 * 1000000;
+  vol . setHedging ( hedge );
+
+  const int  count = 60;
+  std::vector<char> data ( count * SECTOR_SIZE ), check ( count * SECTOR_SIZE );
+  for ( int i = 0; i < count; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 6 );
+  assert ( vol . write ( 0, data . data (), count ) );
+  vol . resetStats ();
+
+  /* fast disks: nothing gets hedged */
+  assert ( vol . read ( 0, check . data (), count ) && check == data );
+  assert ( vol . statsSnapshot () . m_HedgedReads == 0 );
+
+  /* disk 1 stalls; sector 0 lives on it */
+  g_MemorySlow = 1;
+  g_MemorySlowUs = 300000;
+  for ( int attempt = 0; attempt < 2; attempt ++ )
+  {
+    auto     begin = std::chrono::steady_clock::now ();
+    std::fill ( check . begin (), check . end (), 0 );
+    assert ( vol . read ( 0, check . data (), count ) && check == data );
+    assert ( std::chrono::steady_clock::now () - begin < std::chrono::milliseconds ( 150 ) );
+  }
+  CRaidStats::TSnapshot stats = vol . statsSnapshot ();
+  assert ( stats . m_HedgedReads == 2 && stats . m_HedgeWins == 2 && stats . m_Demotions == 1 );
+
+  /* demoted: read straight through the parity, no more races */
+  auto       begin = std::chrono::steady_clock::now ();
+  assert ( vol . read ( 0, check . data (), count ) && check == data );
+  assert ( std::chrono::steady_clock::now () - begin < std::chrono::milliseconds ( 150 ) );
+  assert ( vol . statsSnapshot () . m_HedgedReads == 2 && vol . status () == RAID_OK );
+
+  /* the demoted disk still receives writes */
+  fillPattern ( data . data (), 0, 7 );
+  assert ( vol . write ( 0, data . data (), 1 ) );
+  g_MemorySlow = -1;
+  assert ( vol . stop () == RAID_STOPPED );
+  assert ( vol . start ( dev ) == RAID_OK );
+  assert ( vol . read ( 0, check . data (), count ) && check == data );
+  assert ( checkParity ( dev, vol ) );
+  assert ( vol . stop () == RAID_STOPPED );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test14                                  ()
+{
+  /* File backends: the volume over disk images accessed by pread/pwrite, O_DIRECT and mmap. The images are sized
+   * without writing them and the data written in one mode is read back in another one after a reopen.
+   */
+  const int  sectors = 4096, count = 1000;
+  std::vector<std::string> paths;
+  for ( int i = 0; i < 4; i ++ )
+    paths . push_back ( "/tmp/raid-file-" + std::to_string ( i ) );
+  std::vector<char> data ( count * SECTOR_SIZE ), check ( count * SECTOR_SIZE + 1 );
+
+  for ( TFileMode mode : { TFileMode::PREAD, TFileMode::DIRECT, TFileMode::MMAP } )
+  {
+    TBlkDev  dev;
+    try
+    {
+      dev = createFileDisks ( paths, sectors, mode );
+    }
+    catch ( const std::runtime_error & )
+    {
+      /* file systems without O_DIRECT support, e.g. tmpfs */
+      assert ( mode == TFileMode::DIRECT );
+      continue;
+    }
+    assert ( dev . m_Sectors == sectors );
+    assert ( CRaidVolume::create ( dev ) );
+    CRaidVolume vol;
+    assert ( vol . start ( dev ) == RAID_OK );
+    vol . setParallelIo ( true );
+    vol . setCacheCapacity ( 0 );
+    for ( int i = 0; i < count; i ++ )
+      fillPattern ( data . data () + i * SECTOR_SIZE, i, (int) mode );
+    assert ( vol . write ( 3, data . data (), count ) );
+    /* unaligned destination */
+    assert ( vol . read ( 3, check . data () + 1, count ) && ! memcmp ( check . data () + 1, data . data (), count * SECTOR_SIZE ) );
+    assert ( vol . stop () == RAID_STOPPED );
+    assert ( flushFileDisks () );
+    closeFileDisks ();
+
+    dev = openFileDisks ( paths, 0, TFileMode::PREAD );
+    assert ( dev . m_Sectors == sectors );
+    assert ( vol . start ( dev ) == RAID_OK );
+    std::fill ( check . begin (), check . end (), 0 );
+    assert ( vol . read ( 3, check . data (), count ) && ! memcmp ( check . data (), data . data (), count * SECTOR_SIZE ) );
+    assert ( vol . stop () == RAID_STOPPED );
+    closeFileDisks ();
+  }
+  for ( const auto & path : paths )
+    unlink ( path . c_str () );
+}
+//-------------------------------------------------------------------------------------------------
+/** Splits the buffer into segments of the given lengths repeated over and over, the last one takes the rest.
+ */
+std::vector<TIoSegment>                splitSegments                           ( char                                * data,
+                                                                                 size_t                                length,
+                                                                                 const std::vector<size_t>           & lengths )
+{
+  std::vector<TIoSegment> segments;
+  for ( size_t offset = 0, i = 0; offset < length; i ++ )
+  {
+    size_t   segmentLength = std::min ( lengths[i % lengths . size ()], length - offset );
+    segments . push_back ( { data + offset, segmentLength } );
+    offset += segmentLength;
+  }
+  return segments;
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test15                                  ()
+{
+  /* Vectored I/O: fragmented caller buffers (sectors split between segments, empty segments) give the same
+   * data as contiguous ones, in OK and degraded state, for sector and chunk layouts.
+   */
+  for ( int chunk : { 1, 16 } )
+  {
+    TBlkDev  dev = createMemoryDisks ( 5, 1024 );
+    TRaidConfig config;
+    config . m_ChunkSectors = chunk;
+    assert ( CRaidVolume::create ( dev, config ) );
+    CRaidVolume vol;
+    assert ( vol . start ( dev ) == RAID_OK );
+    vol . setCacheCapacity ( 0 );
+
+    const int count = 300;
+    const size_t length = count * SECTOR_SIZE;
+    std::vector<char> data ( length ), check ( length ), fragments ( length );
+    for ( int i = 0; i < count; i ++ )
+      fillPattern ( data . data () + i * SECTOR_SIZE, i + 7, chunk );
+    std::vector<TIoSegment> segments = splitSegments ( data . data (), length, { 100, 0, 3 * SECTOR_SIZE + 17, 8 * SECTOR_SIZE } );
+    assert ( vol . writev ( 7, segments . data (), (int) segments . size () ) );
+    assert ( vol . read ( 7, check . data (), count ) && check == data );
+
+    for ( int failed : { -1, 2 } )
+    {
+      g_MemoryFailed = failed;
+      segments = splitSegments ( fragments . data (), length, { 64 * SECTOR_SIZE, SECTOR_SIZE - 1, 1, 700 } );
+      std::fill ( fragments . begin (), fragments . end (), 0 );
+      assert ( vol . readv ( 7, segments . data (), (int) segments . size () ) );
+      assert ( fragments == data );
+    }
+    assert ( vol . status () == RAID_DEGRADED );
+    g_MemoryFailed = -1;
+
+    /* a sector split between segments is written in degraded state as well */
+    for ( int i = 0; i < count; i ++ )
+      fillPattern ( data . data () + i * SECTOR_SIZE, i + 7, chunk + 1 );
+    segments = splitSegments ( data . data (), length, { 5 * SECTOR_SIZE + 3 } );
+    assert ( vol . writev ( 7, segments . data (), (int) segments . size () ) );
+    assert ( vol . read ( 7, check . data (), count ) && check == data );
+
+    /* the total length has to be whole sectors */
+    segments = { { check . data (), SECTOR_SIZE + 1 } };
+    assert ( ! vol . readv ( 0, segments . data (), 1 ) && ! vol . writev ( 0, segments . data (), 1 ) );
+    assert ( vol . resync () == RAID_OK );
+    assert ( checkParity ( dev, vol ) );
+    assert ( vol . read ( 7, check . data (), count ) && check == data );
+    assert ( vol . stop () == RAID_STOPPED );
+  }
+}
+//-------------------------------------------------------------------------------------------------
+/** Sparse disks of any size: only the written sectors are kept, the others read as zeros.
+ */
+static std::unordered_map<uint64_t, std::vector<char>> g_Sparse;
+static int                             g_SparseSectors = 0;
+static int                             g_SparseFailed = -1;
+
+int                                    sparseTransfer                          ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 char                                * data,
+                                                                                 int                                   sectorCnt,
+                                                                                 bool                                  write )
+{
+  if ( device < 0 || device >= MAX_RAID_DEVICES || device == g_SparseFailed || sectorCnt <= 0
+       || sectorNr < 0 || sectorNr > g_SparseSectors - sectorCnt )
+    return 0;
+  for ( int i = 0; i < sectorCnt; i ++ )
+  {
+    uint64_t key = ( (uint64_t) device << 32 ) | (uint32_t) ( sectorNr + i );
+    if ( write )
+      g_Sparse[key] . assign ( data + (size_t) i * SECTOR_SIZE, data + (size_t) ( i + 1 ) * SECTOR_SIZE );
+    else if ( g_Sparse . count ( key ) )
+      memcpy ( data + (size_t) i * SECTOR_SIZE, g_Sparse[key] . data (), SECTOR_SIZE );
+    else
+      memset ( data + (size_t) i * SECTOR_SIZE, 0, SECTOR_SIZE );
+  }
+  return sectorCnt;
+}
+//-------------------------------------------------------------------------------------------------
+int                                    sparseRead                              ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 void                                * data,
+                                                                                 int                                   sectorCnt )
+{
+  return sparseTransfer ( device, sectorNr, (char *) data, sectorCnt, false );
+}
+//-------------------------------------------------------------------------------------------------
+int                                    sparseWrite                             ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 const void                          * data,
+                                                                                 int                                   sectorCnt )
+{
+  return sparseTransfer ( device, sectorNr, (char *) data, sectorCnt, true );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test16                                  ()
+{
+  /* 64-bit addressing: three disks of INT_MAX sectors make a volume of more than 2^31 sectors, requests
+   * around 2^31 and at the very end of the volume work in OK and degraded state, past the end they fail.
+   */
+  for ( int chunk : { 1, 8 } )
+  {
+    TBlkDev  dev { 3, INT_MAX, sparseRead, sparseWrite };
+    TRaidConfig config;
+    config . m_ChunkSectors = chunk;
+    g_Sparse . clear ();
+    g_SparseSectors = INT_MAX;
+    assert ( CRaidVolume::create ( dev, config ) );
+    CRaidVolume vol;
+    assert ( vol . start ( dev ) == RAID_OK );
+    assert ( vol . size () > INT_MAX && vol . size () < 2LL * INT_MAX );
+
+    const int count = 40;
+    const int64_t starts[] = { INT_MAX - count / 2, 1LL << 31, vol . size () - count };
+    std::vector<char> data ( count * SECTOR_SIZE ), check ( count * SECTOR_SIZE );
+    for ( int64_t secNr : starts )
+    {
+      for ( int i = 0; i < count; i ++ )
+        fillPattern ( data . data () + i * SECTOR_SIZE, (int) ( secNr + i ), chunk );
+      assert ( vol . write ( secNr, data . data (), count ) );
+      assert ( vol . read ( secNr, check . data (), count ) && check == data );
+    }
+
+    assert ( ! vol . write ( vol . size () - 1, data . data (), 2 ) && ! vol . read ( vol . size (), check . data (), 1 ) );
+    assert ( ! vol . read ( -1, check . data (), 1 ) && vol . status () == RAID_OK );
+
+    g_SparseFailed = 1;
+    vol . setCacheCapacity ( 0 );
+    for ( int64_t secNr : starts )
+    {
+      for ( int i = 0; i < count; i ++ )
+        fillPattern ( data . data () + i * SECTOR_SIZE, (int) ( secNr + i ), chunk );
+      assert ( vol . read ( secNr, check . data (), count ) && check == data );
+    }
+    assert ( vol . status () == RAID_DEGRADED );
+    g_SparseFailed = -1;
+    assert ( vol . stop () == RAID_STOPPED );
+  }
+  g_Sparse . clear ();
+}
+//-------------------------------------------------------------------------------------------------
+uint64_t                               diskWrites                              ( const CRaidVolume                   & vol )
+{
+  uint64_t   calls = 0;
+  for ( const auto & disk : vol . statsSnapshot () . m_Disks )
+    calls += disk . m_WriteCalls;
+  return calls;
+}
+//-------------------------------------------------------------------------------------------------
+uint64_t                               diskReads                               ( const CRaidVolume                   & vol )
+{
+  uint64_t   calls = 0;
+  for ( const auto & disk : vol . statsSnapshot () . m_Disks )
+    calls += disk . m_ReadCalls;
+  return calls;
+}
+//-------------------------------------------------------------------------------------------------
+/** Memory disk read whose first call after g_SlowOnceArmed is set waits until g_SlowOnceRelease; g_SlowOnceEntered
+ * tells the call has started.
+ */
+static std::atomic<bool>               g_SlowOnceArmed { false };
+static std::atomic<bool>               g_SlowOnceEntered { false };
+static std::atomic<bool>               g_SlowOnceRelease { false };
+
+int                                    slowOnceRead                            ( int                                   device,
+                                                                                 int                                   sectorNr,
+                                                                                 void                                * data,
+                                                                                 int                                   sectorCnt )
+{
+  if ( g_SlowOnceArmed . exchange ( false ) )
+  {
+    g_SlowOnceEntered = true;
+    while ( ! g_SlowOnceRelease )
+      std::this_thread::sleep_for ( std::chrono::microseconds ( 100 ) );
+  }
+  return memoryRead ( device, sectorNr, data, sectorCnt );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test17                                  ()
+{
+  /* Write gathering: small appends are buffered until their stripe is complete and then written as full stripes,
+   * reads see the buffered data, the oldest stripes are written out when the buffer is full, large writes bypass
+   * the buffer, flush, stop and the delay write everything out.
+   */
+  for ( int chunk : { 1, 4 } )
+  {
+    TBlkDev  dev = createMemoryDisks ( 5, 1024 );
+    TRaidConfig config;
+    config . m_ChunkSectors = chunk;
+    assert ( CRaidVolume::create ( dev, config ) );
+    CRaidVolume vol;
+    assert ( vol . start ( dev ) == RAID_OK );
+    vol . setCacheCapacity ( 0 );
+    CRaidVolume::TGatherConfig gather;
+    gather . m_Enabled = true;
+    gather . m_DelayUs = 0;
+    vol . setWriteGather ( gather );
+
+    const int stripe = 4 * chunk, count = 20 * stripe;
+    std::vector<char> data ( count * SECTOR_SIZE ), check ( count * SECTOR_SIZE );
+    for ( int i = 0; i < count; i ++ )
+      fillPattern ( data . data () + i * SECTOR_SIZE, i, chunk );
+
+    /* appends of 1 to 3 sectors, the last stripe stays incomplete */
+    vol . resetStats ();
+    int        appended = 0;
+    for ( int size = 1; appended + size < count - 1; appended += size, size = size % 3 + 1 )
+      assert ( vol . write ( appended, data . data () + appended * SECTOR_SIZE, size ) );
+    assert ( vol . read ( 0, check . data (), appended ) && ! memcmp ( check . data (), data . data (), appended * SECTOR_SIZE ) );
+    CRaidStats::TSnapshot stats = vol . statsSnapshot ();
+    assert ( stats . m_GatherFullStripes == (uint64_t) ( appended / stripe ) && stats . m_GatherPartialStripes == 0 );
+    assert ( stats . m_ReadModifyWrites == 0 && stats . m_ReconstructWrites == 0 );
+    uint64_t   writes = diskWrites ( vol );
+    assert ( vol . flush () && diskWrites ( vol ) > writes );
+    assert ( vol . statsSnapshot () . m_GatherPartialStripes == 1 && checkParity ( dev, vol ) );
+    assert ( vol . write ( appended, data . data () + appended * SECTOR_SIZE, count - appended ) && vol . flush () );
+
+    /* scattered sectors: a full buffer writes out its oldest stripes */
+    gather . m_MaxStripes = 4;
+    vol . setWriteGather ( gather );
+    vol . resetStats ();
+    for ( int i = 0; i < 10; i ++ )
+    {
+      fillPattern ( data . data () + i * stripe * SECTOR_SIZE, i * stripe, chunk + 1 );
+      assert ( vol . write ( i * stripe, data . data () + i * stripe * SECTOR_SIZE, 1 ) );
+    }
+    assert ( vol . statsSnapshot () . m_GatherPartialStripes == 6 );
+
+    /* a large write over buffered stripes */
+    for ( int i = 2 * stripe + 1; i < 6 * stripe + 2; i ++ )
+      fillPattern ( data . data () + i * SECTOR_SIZE, i, chunk + 2 );
+    assert ( vol . write ( 2 * stripe + 1, data . data () + ( 2 * stripe + 1 ) * SECTOR_SIZE, 4 * stripe + 1 ) );
+    assert ( vol . read ( 0, check . data (), count ) && check == data );
+    assert ( vol . stop () == RAID_STOPPED );
+    assert ( checkParity ( dev, vol ) );
+    assert ( vol . start ( dev ) == RAID_OK );
+    assert ( vol . read ( 0, check . data (), count ) && check == data );
+
+    /* an incomplete stripe is written out after the delay */
+    gather . m_DelayUs = 1000;
+    vol . setWriteGather ( gather );
+    vol . resetStats ();
+    assert ( vol . write ( 1, data . data () + SECTOR_SIZE, 1 ) );
+    for ( int i = 0; i < 1000 && ! vol . statsSnapshot () . m_GatherPartialStripes; i ++ )
+      std::this_thread::sleep_for ( std::chrono::milliseconds ( 1 ) );
+    assert ( vol . statsSnapshot () . m_GatherPartialStripes == 1 );
+    assert ( vol . stop () == RAID_STOPPED );
+  }
+
+  /* a read found in the buffer completely does not touch the disks; a read waiting for a disk holds up neither
+   * buffered writes nor large writes nor reads of other stripes */
+  TBlkDev    dev = createMemoryDisks ( 4, 1024 );
+  dev . m_Read = slowOnceRead;
+  assert ( CRaidVolume::create ( dev ) );
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  vol . setCacheCapacity ( 0 );
+  CRaidVolume::TGatherConfig gather;
+  gather . m_Enabled = true;
+  gather . m_DelayUs = 0;
+  vol . setWriteGather ( gather );
+  std::vector<char> data ( 12 * SECTOR_SIZE ), check ( 12 * SECTOR_SIZE );
+  for ( int i = 0; i < 12; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 1 );
+  assert ( vol . write ( 0, data . data (), 2 ) );
+  vol . resetStats ();
+  assert ( vol . read ( 0, check . data (), 2 ) && ! memcmp ( check . data (), data . data (), 2 * SECTOR_SIZE ) );
+  assert ( diskReads ( vol ) == 0 );
+
+  g_SlowOnceArmed = true;
+  std::thread reader ( [&] ()
+  {
+    char     sector[SECTOR_SIZE], zero[SECTOR_SIZE] = {};
+    assert ( vol . read ( 6, sector, 1 ) && ! memcmp ( sector, zero, SECTOR_SIZE ) );
+  } );
+  while ( ! g_SlowOnceEntered )
+    std::this_thread::yield ();
+  assert ( vol . write ( 3, data . data () + 3 * SECTOR_SIZE, 2 ) );
+  assert ( vol . write ( 9, data . data () + 9 * SECTOR_SIZE, 3 ) );
+  assert ( vol . read ( 3, check . data (), 2 ) && ! memcmp ( check . data (), data . data () + 3 * SECTOR_SIZE, 2 * SECTOR_SIZE ) );
+  assert ( vol . read ( 9, check . data (), 3 ) && ! memcmp ( check . data (), data . data () + 9 * SECTOR_SIZE, 3 * SECTOR_SIZE ) );
+  g_SlowOnceRelease = true;
+  reader . join ();
+  g_SlowOnceEntered = false;
+  g_SlowOnceRelease = false;
+  assert ( vol . flush () );
+
+  /* a large write keeps the buffered stripes it overwrites readable until it is on the disks: the write waits for
+   * a read stalled in stripe 0, the buffered sector 1 reads as buffered meanwhile, not as the older disk content */
+  fillPattern ( data . data () + SECTOR_SIZE, 1, 1 << 20 );
+  assert ( vol . write ( 1, data . data () + SECTOR_SIZE, 1 ) );
+  std::vector<char> newer ( 3 * SECTOR_SIZE );
+  for ( int i = 0; i < 3; i ++ )
+    fillPattern ( newer . data () + i * SECTOR_SIZE, i, 2 << 20 );
+  g_SlowOnceArmed = true;
+  reader = std::thread ( [&] ()
+  {
+    char     sector[SECTOR_SIZE];
+    assert ( vol . read ( 0, sector, 1 ) && ! memcmp ( sector, data . data (), SECTOR_SIZE ) );
+  } );
+  while ( ! g_SlowOnceEntered )
+    std::this_thread::yield ();
+  std::thread writer ( [&] ()
+  {
+    assert ( vol . write ( 0, newer . data (), 3 ) );
+  } );
+  std::this_thread::sleep_for ( std::chrono::milliseconds ( 20 ) );
+  assert ( vol . read ( 1, check . data (), 1 ) && ! memcmp ( check . data (), data . data () + SECTOR_SIZE, SECTOR_SIZE ) );
+  g_SlowOnceRelease = true;
+  reader . join ();
+  writer . join ();
+  g_SlowOnceEntered = false;
+  g_SlowOnceRelease = false;
+  assert ( vol . read ( 0, check . data (), 3 ) && ! memcmp ( check . data (), newer . data (), 3 * SECTOR_SIZE ) );
+  assert ( vol . stop () == RAID_STOPPED );
+  assert ( checkParity ( dev, vol ) );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test18                                  ()
+{
+  /* Parity scrub: corrupted rows are found and counted, repaired only when asked to, the position survives
+   * stop/start, the background scrub finishes passes on its own, a degraded volume is not scrubbed.
+   */
+  TBlkDev    dev = createMemoryDisks ( 4, 1024 );
+  assert ( CRaidVolume::create ( dev ) );
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  vol . setCacheCapacity ( 0 );
+  const int  size = (int) vol . size (), rows = size / 3;
+  std::vector<char> data ( size * SECTOR_SIZE ), check ( size * SECTOR_SIZE );
+  for ( int i = 0; i < size; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 0 );
+  assert ( vol . write ( 0, data . data (), size ) );
+
+  vol . resetStats ();
+  assert ( vol . scrubStep ( rows ) == RAID_OK );
+  CRaidStats::TSnapshot stats = vol . statsSnapshot ();
+  assert ( stats . m_ScrubbedRows == (uint64_t) rows && stats . m_ScrubMismatches == 0 );
+  assert ( vol . scrubProgress () . m_Row == 0 && vol . scrubProgress () . m_Passes == 1 );
+
+  /* silent corruption of a data sector and of a parity sector (disk 0 holds the parity of row 20) */
+  g_Memory[1][10 * SECTOR_SIZE + 7] ^= 0x10;
+  g_Memory[0][20 * SECTOR_SIZE] ^= 0x01;
+  assert ( vol . scrubStep ( 100 ) == RAID_OK && vol . scrubProgress () . m_Row == 100 );
+  assert ( vol . statsSnapshot () . m_ScrubMismatches == 2 && vol . statsSnapshot () . m_ScrubRepairs == 0 );
+  assert ( ! checkParity ( dev, vol ) );
+
+  /* the position is stored with the metadata */
+  assert ( vol . stop () == RAID_STOPPED );
+  assert ( vol . start ( dev ) == RAID_OK );
+  assert ( vol . scrubProgress () . m_Row == 100 );
+  assert ( vol . scrubStep ( rows ) == RAID_OK && vol . scrubProgress () . m_Row == 0 );
+
+  CRaidVolume::TScrubConfig scrub;
+  scrub . m_Repair = true;
+  vol . setScrub ( scrub );
+  vol . resetStats ();
+  assert ( vol . scrubStep ( rows ) == RAID_OK );
+  assert ( vol . statsSnapshot () . m_ScrubMismatches == 2 && vol . statsSnapshot () . m_ScrubRepairs == 2 );
+  assert ( checkParity ( dev, vol ) );
+  /* the parity follows the data, the corrupted data sector (row 10 of disk 1 is volume sector 31) stays as it is */
+  data[31 * SECTOR_SIZE + 7] ^= 0x10;
+  assert ( vol . read ( 0, check . data (), size ) && check == data );
+
+  /* background passes next to foreground reads */
+  scrub . m_Enabled = true;
+  scrub . m_YieldUs = 100;
+  scrub . m_MaxYieldUs = 1000;
+  int        passes = vol . scrubProgress () . m_Passes;
+  vol . setScrub ( scrub );
+  for ( int i = 0; i < 10000 && vol . scrubProgress () . m_Passes < passes + 2; i ++ )
+  {
+    assert ( vol . read ( i % size, check . data (), 1 ) );
+    std::this_thread::sleep_for ( std::chrono::microseconds ( 200 ) );
+  }
+  assert ( vol . scrubProgress () . m_Passes >= passes + 2 );
+  vol . setScrub ( CRaidVolume::TScrubConfig () );
+  assert ( vol . statsSnapshot () . m_ScrubMismatches == 2 );
+
+  /* nothing is checked without redundancy */
+  g_MemoryFailed = 2;
+  assert ( vol . read ( 0, check . data (), size ) && vol . status () == RAID_DEGRADED );
+  vol . resetStats ();
+  assert ( vol . scrubStep ( rows ) == RAID_DEGRADED && vol . statsSnapshot () . m_ScrubbedRows == 0 );
+  g_MemoryFailed = -1;
+  assert ( vol . stop () == RAID_STOPPED );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test19                                  ()
+{
+  /* Allocation bitmap: never written regions read as zeros without disk access, the first write of a region zeroes
+   * the rest of it (parity matches), resync and scrub skip unwritten regions, discard forgets whole regions only,
+   * everything survives stop/start.
+   */
+  const int  regionRows = 64, regionSectors = regionRows * 3;
+  TBlkDev    dev = createMemoryDisks ( 4, 1024 );
+  for ( size_t disk = 0; disk < g_Memory . size (); disk ++ )
+    for ( size_t i = 0; i < g_Memory[disk] . size (); i ++ )
+      g_Memory[disk][i] = (char) ( i * 7 + disk );
+  TRaidConfig config;
+  config . m_AllocationRegion = regionRows;
+  assert ( CRaidVolume::create ( dev, config ) );
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  vol . setCacheCapacity ( 0 );
+  const int  size = (int) vol . size (), rows = size / 3;
+  std::vector<char> data ( size * SECTOR_SIZE, 0 ), check ( size * SECTOR_SIZE );
+
+  vol . resetStats ();
+  assert ( vol . read ( 0, check . data (), size ) && check == data );
+  assert ( diskReads ( vol ) == 0 && vol . statsSnapshot () . m_UnwrittenSectorsRead == (uint64_t) size );
+
+  /* a single sector allocates its region, a write of a whole region needs no zeroing */
+  fillPattern ( data . data () + 100 * SECTOR_SIZE, 100, 1 );
+  assert ( vol . write ( 100, data . data () + 100 * SECTOR_SIZE, 1 ) );
+  for ( int i = 2 * regionSectors; i < 3 * regionSectors; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 1 );
+  vol . resetStats ();
+  assert ( vol . write ( 2 * regionSectors, data . data () + 2 * regionSectors * SECTOR_SIZE, regionSectors ) );
+  assert ( vol . statsSnapshot () . m_Disks[0] . m_WriteSectors < (uint64_t) regionRows + 4 );
+  assert ( vol . statsSnapshot () . m_RegionsAllocated == 1 );
+  assert ( vol . read ( 0, check . data (), size ) && check == data );
+  assert ( checkParity ( dev, vol, 0, regionRows ) && checkParity ( dev, vol, 2 * regionRows, regionRows ) );
+  assert ( ! checkParity ( dev, vol, regionRows, regionRows ) );
+
+  /* a blank disk gets the written regions only */
+  assert ( vol . stop () == RAID_STOPPED );
+  for ( size_t i = 0; i < g_Memory[1] . size (); i ++ )
+    g_Memory[1][i] = (char) i;
+  assert ( vol . start ( dev ) == RAID_DEGRADED );
+  vol . setCacheCapacity ( 0 );
+  vol . resetStats ();
+  assert ( vol . resync () == RAID_OK );
+  assert ( vol . statsSnapshot () . m_Disks[1] . m_WriteSectors < (uint64_t) 2 * regionRows + 8 );
+  assert ( g_Memory[1][regionRows * SECTOR_SIZE + 5] == (char) ( regionRows * SECTOR_SIZE + 5 ) );
+  assert ( checkParity ( dev, vol, 0, regionRows ) && checkParity ( dev, vol, 2 * regionRows, regionRows ) );
+  assert ( vol . read ( 0, check . data (), size ) && check == data );
+
+  vol . resetStats ();
+  assert ( vol . scrubStep ( rows ) == RAID_OK );
+  assert ( vol . statsSnapshot () . m_ScrubbedRows == (uint64_t) 2 * regionRows );
+  assert ( vol . statsSnapshot () . m_ScrubMismatches == 0 );
+
+  /* discard: region 0 completely, region 1 only partly */
+  vol . resetStats ();
+  assert ( vol . discard ( 50, 50 ) && vol . discard ( 0, regionSectors + 10 ) );
+  assert ( vol . statsSnapshot () . m_RegionsDiscarded == 1 );
+  memset ( data . data (), 0, regionSectors * SECTOR_SIZE );
+  assert ( ! vol . discard ( size - 1, 2 ) );
+
+  /* the bitmap is stored on every disk, the restored one included */
+  assert ( vol . stop () == RAID_STOPPED );
+  g_MemoryFailed = 2;
+  assert ( vol . start ( dev ) == RAID_DEGRADED );
+  vol . resetStats ();
+  assert ( vol . read ( 0, check . data (), regionSectors ) && diskReads ( vol ) == 0 );
+  assert ( vol . read ( 0, check . data (), size ) && check == data );
+
+  /* the first write of a region in the degraded mode, the missing disk gets it by resync */
+  fillPattern ( data . data () + 10 * SECTOR_SIZE, 10, 2 );
+  assert ( vol . write ( 10, data . data () + 10 * SECTOR_SIZE, 1 ) );
+  assert ( vol . read ( 0, check . data (), size ) && check == data );
+  g_MemoryFailed = -1;
+  assert ( vol . resync () == RAID_OK );
+  assert ( checkParity ( dev, vol, 0, regionRows ) );
+  assert ( vol . read ( 0, check . data (), size ) && check == data );
+  assert ( vol . stop () == RAID_STOPPED );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test20                                  ()
+{
+  /* I/O trace: the header carries the geometry, every volume call is recorded in order with its range and result,
+   * backend calls carry the number of the call they were issued by (on the disk workers too), nothing is recorded
+   * once the trace is stopped.
+   */
+  const char * fileName = "/tmp/raid-trace";
+  TBlkDev    dev = createMemoryDisks ( 4, 1024 );
+  TRaidConfig config;
+  config . m_ChunkSectors = 4;
+  assert ( CRaidVolume::create ( dev, config ) );
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  vol . setCacheCapacity ( 0 );
+  std::vector<char> data ( 24 * SECTOR_SIZE, 0x33 );
+
+  assert ( vol . startTrace ( fileName ) );
+  assert ( vol . write ( 0, data . data (), 12 ) );
+  assert ( vol . write ( 30, data . data (), 1 ) );
+  assert ( vol . read ( 5, data . data (), 20 ) );
+  assert ( ! vol . read ( vol . size (), data . data (), 1 ) );
+  vol . setParallelIo ( true );
+  assert ( vol . write ( 96, data . data (), 24 ) );
+  assert ( vol . resync () == RAID_OK );
+  assert ( vol . stopTrace () );
+  assert ( vol . read ( 0, data . data (), 1 ) );
+
+  CIoTracer::THeader header;
+  std::vector<CIoTracer::TRecord> records;
+  assert ( CIoTracer::load ( fileName, header, records ) );
+  unlink ( fileName );
+  assert ( header . m_Devices == 4 && header . m_DiskSectors == 1024 && header . m_ChunkSectors == 4 );
+
+  struct { uint8_t kind; int64_t secNr; int secCnt; bool succeeded; } expected[] =
+    { { CIoTracer::WRITE, 0, 12, true }, { CIoTracer::WRITE, 30, 1, true }, { CIoTracer::READ, 5, 20, true },
+      { CIoTracer::READ, vol . size (), 1, false }, { CIoTracer::WRITE, 96, 24, true }, { CIoTracer::RESYNC, 0, 0, true } };
+  int        calls = 0, diskCalls[7] = {};
+  uint64_t   lastTime = 0;
+  for ( const auto & record : records )
+  {
+    assert ( record . m_Request >= 1 && record . m_Request <= 6 );
+    if ( record . m_Kind == CIoTracer::DISK_READ || record . m_Kind == CIoTracer::DISK_WRITE )
+    {
+      assert ( record . m_Disk < 4 && record . m_Succeeded && record . m_SecNr + record . m_SecCnt <= 1024 );
+      diskCalls[record . m_Request] ++;
+      continue;
+    }
+    assert ( record . m_Request == (uint32_t) calls + 1 && record . m_TimeUs >= lastTime );
+    assert ( record . m_Kind == expected[calls] . kind && record . m_SecNr == expected[calls] . secNr
+             && record . m_SecCnt == expected[calls] . secCnt && record . m_Succeeded == expected[calls] . succeeded );
+    lastTime = record . m_TimeUs;
+    calls ++;
+  }
+  assert ( calls == 6 );
+  /* a full stripe (12 sectors) is 4 writes, a single sector read-modify-write 2 reads and 2 writes, the parallel
+   * write of 2 whole stripes a single run per disk issued by the disk workers */
+  assert ( diskCalls[1] == 4 && diskCalls[2] == 4 && diskCalls[3] > 0 && diskCalls[4] == 0 && diskCalls[5] == 4 );
+  assert ( diskCalls[6] == 0 );
+  assert ( vol . stop () == RAID_STOPPED );
+}
+//-------------------------------------------------------------------------------------------------
+void                                   test21                                  ()
+{
+  /* Reshape onto an added disk: the data stay readable and writable between the steps (across the reshape boundary
+   * and in the degraded mode too), the moved part survives stop/start, a start without the new disk is refused, the
+   * volume grows at the end with the parity in order; never written regions are reshaped as zeros. The moved part
+   * survives a volume that was not stopped too.
+   */
+  TBlkDev    dev = createMemoryDisks ( 4, 1024 );
+  TRaidConfig config;
+  config . m_ChunkSectors = 4;
+  config . m_Rotation = CRaidLayout::LEFT_SYMMETRIC;
+  assert ( CRaidVolume::create ( dev, config ) );
+  CRaidVolume vol;
+  assert ( vol . start ( dev ) == RAID_OK );
+  vol . setParallelIo ( true );
+  const int  size = (int) vol . size (), rows = size / 3, newSize = rows * 4;
+  std::vector<char> data ( newSize * SECTOR_SIZE, 0 ), check ( newSize * SECTOR_SIZE );
+  for ( int i = 0; i < size; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 1 );
+  assert ( vol . write ( 0, data . data (), size ) );
+
+  g_Memory . push_back ( std::vector<char> ( 1024 * SECTOR_SIZE, 0x5a ) );
+  TBlkDev    grown = dev;
+  grown . m_Devices = 5;
+  assert ( ! vol . addDisk ( dev ) );
+  assert ( vol . addDisk ( grown ) );
+  assert ( ! vol . addDisk ( grown ) );
+  CRaidVolume::TReshapeProgress progress = vol . reshapeProgress ();
+  assert ( progress . m_Devices == 4 && progress . m_NewDevices == 5 && progress . m_Rows == rows );
+
+  /* requests between the steps, some of them crossing the boundary, split into segments */
+  unsigned   seed = 1, version = 2;
+  while ( vol . reshapeProgress () . m_MovedSectors < size / 2 )
+  {
+    assert ( vol . reshapeStep ( 64 ) == RAID_OK );
+    progress = vol . reshapeProgress ();
+    seed = seed * 1103515245 + 12345;
+    int      secNr = (int) std::min<int64_t> ( size - 40, std::max<int64_t> ( 0, progress . m_MovedSectors - 20 + ( seed >> 8 ) % 8 ) );
+    int      secCnt = 1 + ( seed >> 16 ) % 40;
+    for ( int i = secNr; i < secNr + secCnt; i ++ )
+      fillPattern ( data . data () + i * SECTOR_SIZE, i, version );
+    version ++;
+    std::vector<TIoSegment> segments = splitSegments ( data . data () + secNr * SECTOR_SIZE, secCnt * SECTOR_SIZE, { 700, 1500 } );
+    assert ( vol . writev ( secNr, segments . data (), (int) segments . size () ) );
+    segments = splitSegments ( check . data (), ( secCnt + 8 ) * SECTOR_SIZE, { 300, 2000 } );
+    assert ( vol . readv ( secNr - 4 < 0 ? 0 : secNr - 4, segments . data (), (int) segments . size () ) );
+    assert ( ! memcmp ( check . data (), data . data () + ( secNr - 4 < 0 ? 0 : secNr - 4 ) * SECTOR_SIZE, ( secCnt + 8 ) * SECTOR_SIZE ) );
+  }
+  assert ( vol . size () == size );
+  assert ( vol . read ( 0, check . data (), size ) && ! memcmp ( check . data (), data . data (), size * SECTOR_SIZE ) );
+  assert ( checkParity ( grown, vol ) );
+
+  /* the moved part is kept by stop, the volume does not start without the new disk */
+  assert ( vol . stop () == RAID_STOPPED );
+  assert ( vol . start ( dev ) == RAID_STOPPED );
+  assert ( vol . start ( grown ) == RAID_OK );
+  assert ( vol . reshapeProgress () == progress && vol . size () == size );
+  assert ( vol . read ( 0, check . data (), size ) && ! memcmp ( check . data (), data . data (), size * SECTOR_SIZE ) );
+
+  /* a failed disk holds the reshape until resync, both layouts are reconstructed meanwhile */
+  g_MemoryFailed = 2;
+  assert ( vol . read ( 0, check . data (), size ) && ! memcmp ( check . data (), data . data (), size * SECTOR_SIZE ) );
+  assert ( vol . reshapeStep () == RAID_DEGRADED && vol . reshapeProgress () == progress );
+  fillPattern ( data . data () + 5 * SECTOR_SIZE, 5, version );
+  fillPattern ( data . data () + ( size - 5 ) * SECTOR_SIZE, size - 5, version );
+  assert ( vol . write ( 5, data . data () + 5 * SECTOR_SIZE, 1 ) && vol . write ( size - 5, data . data () + ( size - 5 ) * SECTOR_SIZE, 1 ) );
+  g_MemoryFailed = -1;
+  assert ( vol . resync () == RAID_OK );
+  assert ( checkParity ( grown, vol ) );
+
+  /* the rest runs while another thread keeps writing and reading back */
+  std::atomic<bool> done { false };
+  std::thread worker ( [&] ()
+  {
+    unsigned   seed = 7;
+    std::vector<char> buffer ( 32 * SECTOR_SIZE );
+    for ( int op = 0; ! done || op < 200; op ++ )
+    {
+      seed = seed * 1103515245 + 12345;
+      int      secCnt = 1 + ( seed >> 20 ) % 32, secNr = ( seed >> 8 ) % ( size - secCnt );
+      for ( int i = secNr; i < secNr + secCnt; i ++ )
+        fillPattern ( data . data () + i * SECTOR_SIZE, i, op + 100 );
+      assert ( vol . write ( secNr, data . data () + secNr * SECTOR_SIZE, secCnt ) );
+      assert ( vol . read ( secNr, buffer . data (), secCnt ) );
+      assert ( ! memcmp ( buffer . data (), data . data () + secNr * SECTOR_SIZE, secCnt * SECTOR_SIZE ) );
+    }
+  } );
+  assert ( vol . reshape () );
+  done = true;
+  worker . join ();
+
+  progress = vol . reshapeProgress ();
+  assert ( progress . m_Devices == 5 && progress . m_NewDevices == 5 && vol . size () == newSize );
+  assert ( vol . statsSnapshot () . m_ReshapedSectors > 0 );
+  assert ( vol . read ( 0, check . data (), newSize ) && check == data );
+  assert ( checkParity ( grown, vol ) );
+  for ( int i = size; i < newSize; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 1 );
+  assert ( vol . write ( size, data . data () + size * SECTOR_SIZE, newSize - size ) );
+  assert ( vol . stop () == RAID_STOPPED );
+  assert ( vol . start ( grown ) == RAID_OK && vol . size () == newSize );
+  assert ( vol . read ( 0, check . data (), newSize ) && check == data );
+  assert ( checkParity ( grown, vol ) );
+  assert ( vol . stop () == RAID_STOPPED );
+
+  /* with the allocation bitmap, never written regions come out as zeros with matching parity */
+  dev = createMemoryDisks ( 3, 1024 );
+  config = TRaidConfig ();
+  config . m_AllocationRegion = 64;
+  assert ( CRaidVolume::create ( dev, config ) );
+  assert ( vol . start ( dev ) == RAID_OK );
+  const int  smallSize = (int) vol . size ();
+  std::fill ( data . begin (), data . end (), 0 );
+  for ( int i = 0; i < 64; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 1 );
+  assert ( vol . write ( 0, data . data (), 64 ) );
+  g_Memory . push_back ( std::vector<char> ( 1024 * SECTOR_SIZE, 0x5a ) );
+  grown = dev;
+  grown . m_Devices = 4;
+  assert ( vol . addDisk ( grown ) && vol . reshape () );
+  assert ( vol . size () == smallSize / 2 * 3 );
+  assert ( vol . read ( 0, check . data (), (int) vol . size () ) && ! memcmp ( check . data (), data . data (), vol . size () * SECTOR_SIZE ) );
+  assert ( checkParity ( grown, vol ) );
+  assert ( vol . stop () == RAID_STOPPED );
+
+  /* a read running when the disk is added ends in the layout it started with, addDisk waits for it */
+  dev = createMemoryDisks ( 3, 1024 );
+  dev . m_Read = slowOnceRead;
+  assert ( CRaidVolume::create ( dev ) );
+  assert ( vol . start ( dev ) == RAID_OK );
+  vol . setCacheCapacity ( 0 );
+  const int  slowSize = (int) vol . size ();
+  for ( int i = 0; i < slowSize; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 3 );
+  assert ( vol . write ( 0, data . data (), slowSize ) );
+  g_Memory . push_back ( std::vector<char> ( 1024 * SECTOR_SIZE, 0x5a ) );
+  grown = dev;
+  grown . m_Devices = 4;
+  std::atomic<bool> readDone { false };
+  g_SlowOnceArmed = true;
+  std::thread reader ( [&] ()
+  {
+    std::vector<char> buffer ( slowSize * SECTOR_SIZE );
+    assert ( vol . read ( 0, buffer . data (), slowSize ) );
+    assert ( ! memcmp ( buffer . data (), data . data (), slowSize * SECTOR_SIZE ) );
+    readDone = true;
+  } );
+  while ( ! g_SlowOnceEntered )
+    std::this_thread::yield ();
+  std::thread releaser ( [] ()
+  {
+    std::this_thread::sleep_for ( std::chrono::milliseconds ( 20 ) );
+    g_SlowOnceRelease = true;
+  } );
+  assert ( vol . addDisk ( grown ) );
+  assert ( g_SlowOnceRelease );
+  assert ( vol . reshapeStep ( 1024 ) == RAID_OK && vol . reshapeProgress () . m_MovedSectors == 0 );
+  assert ( vol . reshape () );
+  reader . join ();
+  releaser . join ();
+  assert ( readDone );
+  g_SlowOnceEntered = false;
+  g_SlowOnceRelease = false;
+  assert ( vol . read ( 0, check . data (), slowSize ) && ! memcmp ( check . data (), data . data (), slowSize * SECTOR_SIZE ) );
+  assert ( checkParity ( grown, vol ) );
+  assert ( vol . stop () == RAID_STOPPED );
+
+  /* the volume dies between two batches: the disks as they were then start with the moved part kept */
+  dev = createMemoryDisks ( 3, 1024 );
+  assert ( CRaidVolume::create ( dev ) );
+  assert ( vol . start ( dev ) == RAID_OK );
+  const int  crashSize = (int) vol . size ();
+  for ( int i = 0; i < crashSize; i ++ )
+    fillPattern ( data . data () + i * SECTOR_SIZE, i, 4 );
+  assert ( vol . write ( 0, data . data (), crashSize ) );
+  g_Memory . push_back ( std::vector<char> ( 1024 * SECTOR_SIZE, 0x5a ) );
+  grown = dev;
+  grown . m_Devices = 4;
+  assert ( vol . addDisk ( grown ) );
+  while ( vol . reshapeProgress () . m_MovedSectors < crashSize / 2 )
+    assert ( vol . reshapeStep ( 64 ) == RAID_OK );
+  progress = vol . reshapeProgress ();
+  std::vector<std::vector<char>> crashed = g_Memory;
+  assert ( vol . stop () == RAID_STOPPED );
+  g_Memory = crashed;
+  assert ( vol . start ( grown ) == RAID_OK && vol . reshapeProgress () == progress );
+  assert ( vol . read ( 0, check . data (), crashSize ) && ! memcmp ( check . data (), data . data (), crashSize * SECTOR_SIZE ) );
+  assert ( vol . reshape () && vol . size () == crashSize / 2 * 3 );
+  assert ( vol . read ( 0, check . data (), crashSize ) && ! memcmp ( check . data (), data . data (), crashSize * SECTOR_SIZE ) );
+  assert ( checkParity ( grown, vol ) );
+  assert ( vol . stop () == RAID_STOPPED );
+}
+//-------------------------------------------------------------------------------------------------
 int                                    main                                    ()
 {
   test1 ();
   test2 ();
+  test3 ( false );
+  test3 ( true );
+  test4 ();
+  test5 ();
+  test6 ();
+  test7 ();
+  test8 ();
+  test9 ();
+  test10 ();
+  test11 ();
+  test12 ();
+  test13 ();
+  test14 ();
+  test15 ();
+  test16 ();
+  test17 ();
+  test18 ();
+  test19 ();
+  test20 ();
+  test21 ();
   return EXIT_SUCCESS;
 }
\ No newline at end of file